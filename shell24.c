@@ -1,719 +1,8231 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
+#include <termios.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 
-#define MAX_ARGS 5
-#define MAX_COMMAND_LENGTH 1000
-#define MAX_NUMBER_OF_COMMANDS 20
-#define MAX_BG_PROCESSES 100
-// This KeyValuePair array holds all the commands
-struct KeyValuePair
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEXER_HAS_SIMD 1
+#endif
+
+#define COMMAND_HASH_BUCKETS 256
+#define JOB_EVENT_CHILD 1  // waitForEvents: a child exited, stopped or continued
+#define JOB_EVENT_INPUT 2  // waitForEvents: stdin is readable
+#define STREAM_CHUNK_SIZE (1 << 30)   // Largest single copy_file_range/sendfile/splice request
+#define STREAM_BUFFER_SIZE (1 << 17)  // Buffer used when the kernel cannot copy for us
+#define ARENA_CHUNK_SIZE (64 * 1024)    // Regular chunk size of the per-line arena
+#define SESSION_BUFFER_SIZE (256 * 1024) // Output kept for a detached session
+#define SESSION_DETACH_KEY 0x1d          // Ctrl+] goes back from a session to the shell that attached it
+#define PARSE_CACHE_BUCKETS 1024
+#define PARSE_CACHE_CAPACITY 256        // Lines kept by the parse cache unless SHELL24_PARSE_CACHE says otherwise
+#define EXPANSION_START '\x01'           // Word text: a $(...) or `...` kept as written up to EXPANSION_END,
+#define EXPANSION_END '\x02'             // the byte after EXPANSION_START is 'c', or 'C' inside double quotes.
+                                         // $NAME and ${NAME} are kept the same way with 'v' or 'V'.
+#define CAPTURE_BUFFER_SIZE 4096         // First size of the buffer that collects a substitution's output
+#define GLOB_ESCAPE '\x03'               // Word text: the next byte is a quoted *, ? or [ and matches itself
+#define GLOB_CACHE_CAPACITY 8            // Directory listings kept unless SHELL24_GLOB_CACHE says otherwise
+#define DIRECTORY_READ_SIZE (256 * 1024) // Bytes of entries asked for by one getdents64 call
+#define VARIABLE_TABLE_SIZE 256          // First number of slots of the variable table, a power of two
+#define HISTORY_TRIGRAM_BUCKETS 65536    // Hash buckets of the history search index
+#define COMPLETION_LIST_LIMIT 100        // Matches listed by a second Tab, the rest are only counted
+#define COMMAND_NAME_LIMIT 256           // Longer names in PATH directories are not completed
+#define IOPRIO_CLASS_SHIFT 13            // ioprio_set: the class is stored above the level
+#define IOPRIO_WHO_PROCESS 1             // ioprio_set: who is a thread id, 0 for the caller
+#define PLACEMENT_MPOL_BIND 2            // set_mempolicy: MPOL_BIND, memory only from the given nodes
+#define PLACEMENT_MAX_NODES 64           // NUMA nodes sched -m can name, one bit each
+#define TRACE_RING_SIZE 8192             // Events the trace ring holds before the flusher catches up, a power of two
+#define TRACE_NAME_LENGTH 64             // Longer event names are cut
+#define TRACE_FLUSH_INTERVAL_NS 20000000 // The flusher looks at the ring this often
+#define TRACE_OUTPUT_SIZE (64 * 1024)    // JSON collected by the flusher for one write
+#define ARGUMENT_HEADROOM 2048           // Bytes of ARG_MAX left unused by batches, like xargs does
+// Kinds of tokens produced by lexLine
+enum TokenType
+{
+    TOKEN_WORD,     // Plain unquoted word
+    TOKEN_QUOTED,   // Word that had quotes in it, never treated as an operator
+    TOKEN_IO_NUMBER, // Digits right in front of a redirection, the descriptor it applies to
+    TOKEN_OPERATOR  // One of the operators in OperatorType
+};
+
+enum OperatorType
+{
+    OP_NONE,
+    OP_CONCAT,       // #
+    OP_PIPE,         // |
+    OP_OR,           // ||
+    OP_BACKGROUND,   // &
+    OP_AND,          // &&
+    OP_REDIRECT_OUT, // >
+    OP_APPEND,       // >>
+    OP_REDIRECT_IN,  // <
+    OP_SEQUENCE,     // ;
+    OP_HEREDOC,      // <<
+    OP_HEREDOC_TABS, // <<-, leading tabs are removed from the body
+    OP_HERESTRING,   // <<<
+    OP_DUP_OUT,      // >&
+    OP_DUP_IN,       // <&
+    OP_REDIRECT_ALL, // &>, stdout and stderr to one file
+    OP_APPEND_ALL    // &>>
+};
+
+// One token of a command line
+struct Token
+{
+    int type;   // TokenType
+    int op;     // OperatorType for operator tokens, OP_NONE otherwise
+    char *text; // Word with quotes removed and ~ expanded, or the operator text
+    int hasExpansions; // The text holds command substitutions to run before it is used
+};
+
+// Kinds of nodes in the parse tree of a command line
+enum NodeType
+{
+    NODE_COMMAND,   // A program with its arguments
+    NODE_CONCAT,    // Files joined with #, argv holds the file names
+    NODE_PIPELINE,  // Commands joined with |
+    NODE_AND,       // left && right
+    NODE_OR,        // left || right
+    NODE_SEQUENCE,  // left ; right
+    NODE_BACKGROUND // left &
+};
+
+// One redirection of a command, applied in the order they were written
+struct Redirect
+{
+    int op;                // One of the redirection operators, &> and &>> are split up by the parser
+    int fd;                // Descriptor of the command that is redirected
+    char *target;          // File name, descriptor to duplicate or - to close, here-doc delimiter or here-string
+    int isQuoted;          // The target had quotes in it
+    char *body;            // Here-doc: the lines up to the delimiter, read after the command line
+    size_t bodyLength;
+    struct Redirect *next; // Next redirection of the same command
+};
+
+// Where and how urgently the processes started under a sched prefix run. Applied in each child
+// before it execs, the shell's own settings are never changed.
+struct Placement
+{
+    cpu_set_t cpus;      // CPUs to run on, empty to leave them as they are
+    unsigned long nodes; // NUMA nodes to take memory from, 0 to leave it
+    int isNiceSet;
+    int nice;            // Added to the nice value, like nice -n
+    int ioClass;         // 1 realtime, 2 best effort, 3 idle, 0 to leave the I/O priority
+    int ioLevel;         // 0 (highest) to 7 within the class
+    int isSpread;        // One CPU per process, neighbouring cores for neighbouring stages
+};
+
+// Filters a foreground pipeline can run on a thread of the shell instead of in a process
+enum FilterType
+{
+    FILTER_CAT,  // cat [file...]
+    FILTER_HEAD, // head [-n N | -N]
+    FILTER_WC,   // wc [-l] [-w] [-c]
+    FILTER_GREP  // grep [-F] [-v] [-c] text, a fixed string
+};
+
+// A node of the parse tree, all nodes of a line live in the line arena
+struct AstNode
+{
+    int type;                   // NodeType
+    char **argv;                // Command and concat: NULL terminated words
+    int argc;                   // Command and concat: number of words
+    struct Redirect *redirects; // Command and concat: redirections
+    struct AstNode **stages;    // Pipeline: the commands from left to right
+    int stageCount;             // Pipeline: number of commands
+    struct AstNode *left;       // And, or, sequence and background: first operand
+    struct AstNode *right;      // And, or and sequence: second operand
+    int isTimed;                // Any node: time was written in front of it
+    int hasExpansions;          // Command and concat: a word or redirection target needs expanding
+    char **assignments;         // Command: NAME=value words in front of the command
+    int assignmentCount;
+    struct Placement *placement; // Any node: sched was written in front of it, NULL otherwise
+    int batchStart;             // Expanded command: argv words from globs and substitutions that
+    int batchEnd;               // may be split into batches, both 0 for every word after the name
+    int substitutionStatus;     // Expanded command: status of its last command substitution, 0 without one
+};
+
+enum JobState
+{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+};
+
+// A background or stopped pipeline
+struct Job
+{
+    int id;            // Number shown as [n] and used as %n
+    pid_t pgid;        // Own process group of background jobs, 0 when it shares the shell's
+    pid_t *pids;       // Every process of the job, 0 once it has been reaped
+    int processCount;
+    int remaining;     // Processes that have not exited yet
+    int state;         // JobState
+    int status;        // Exit status of the last process
+    int stopSignal;    // Signal that stopped the job
+    int isSignaled;    // The last process was killed by a signal
+    int isChanged;     // Finished or stopped since the user was last told
+    char *commandText; // What the job runs, malloc'd
+    struct StageUsage *usage; // Per process resource use of a timed foreground job, NULL otherwise
+};
+
+// How the argv of a command too long for exec is split: every batch is the words before start, a
+// run of the words from start to end and the words after end
+struct BatchPlan
+{
+    int start;
+    int end;
+    int count;   // Batches, 1 when the command is run as it is
+    int *starts; // First word of the run of every batch, the last run ends at end
+};
+
+// Resources used by one stage of a timed pipeline or chain
+struct StageUsage
+{
+    struct AstNode *command; // Stage it belongs to, NULL for a pipe relay
+    double start;            // When the stage was started
+    double end;              // When it was reaped, 0 while it runs
+    struct rusage usage;     // From wait4, or what the shell itself used for an in-process command
+};
+
+// A pipeline stage run by a filter thread. It owns inFd and outFd and closes them when done, so
+// the stages on either side see the end of their pipe right away.
+struct FilterStage
+{
+    int type;              // FilterType
+    int *fds;              // cat: the files, opened by the shell, NULL to read inFd
+    int fdCount;
+    long long lineLimit;   // head: lines passed on
+    int isCountingLines;   // wc
+    int isCountingWords;
+    int isCountingBytes;
+    const char *pattern;   // grep
+    size_t patternLength;
+    int isInverted;        // grep -v
+    int isCounting;        // grep -c
+    int inFd;
+    int outFd;
+    char *buffer;          // Input, STREAM_BUFFER_SIZE bytes or more for a longer line
+    size_t bufferSize;
+    char *output;          // Output collected for one write, STREAM_BUFFER_SIZE bytes
+    size_t outputLength;
+    int status;
+    struct StageUsage usage;
+    pthread_t thread;
+    int isStarted;         // The thread runs and has to be joined
+    int references;        // The shell and the thread, whoever lets go last frees the stage
+};
+
+// Every stage that finished while a timed node ran, printed as one table at the end
+struct UsageReport
+{
+    double start;
+    struct StageUsage *stages;
+    int stageCount;
+    int capacity;
+};
+
+// A shell24 started by newt on a pseudo-terminal of its own, shown while attached
+struct Session
+{
+    int id;              // Number used by attach
+    pid_t pid;           // shell24 running on the terminal, 0 once it exited
+    int masterFd;        // Our side of the terminal, -1 once the session hung up
+    char *buffer;        // Output produced while detached, a ring of SESSION_BUFFER_SIZE bytes
+    size_t bufferStart;  // Oldest byte in buffer
+    size_t bufferLength;
+    size_t droppedBytes; // Older output that did not fit
+    int status;          // Exit status of the shell
+    int isChanged;       // Exited or hung up since the user was last told
+};
+
+// A command the shell runs itself, at function call cost
+struct Builtin
+{
+    const char *name;
+    int (*run)(char *args[], int argc); // Returns the exit status of the command
+};
+
+// State of the recursive descent parser over the tokens of one line
+struct Parser
+{
+    struct Token *tokens;
+    int tokenCount;
+    int position;     // Index of the next token to look at
+    int isFailed;     // Set once an error was reported
+};
+
+// A chunk of memory handed out by the arena, bigger requests get a chunk of their own
+struct ArenaChunk
+{
+    struct ArenaChunk *next; // Next chunk in the arena
+    size_t size;             // Usable bytes in data
+    size_t used;             // Bytes already handed out
+    char data[];
+};
+
+// Bump allocator that owns all memory of one command line and is reset as a whole
+struct Arena
+{
+    struct ArenaChunk *first;   // First chunk, kept across resets
+    struct ArenaChunk *current; // Chunk allocations are currently taken from
+    size_t allocated;           // Bytes handed out since the last reset
+    size_t peakAllocated;       // Largest number of bytes a single line needed
+    size_t capacity;            // Bytes currently held by all chunks
+    size_t peakCapacity;        // Largest capacity the arena ever reached
+};
+
+// One command line with its parse tree, kept across lines by the parse cache
+struct ParseCacheEntry
+{
+    char *line;                    // Raw text of the line without its newline
+    size_t length;
+    unsigned long long hash;       // hashLine of the text
+    struct AstNode *tree;          // Copy of the parse tree, in the same allocation as the entry
+    struct ParseCacheEntry *next;  // Next entry in the same bucket
+    struct ParseCacheEntry *newer; // Neighbours in least recently used order
+    struct ParseCacheEntry *older;
+};
+
+// Parse trees of recently run lines, so a repeated line skips lexing and parsing
+struct ParseCache
+{
+    struct ParseCacheEntry *buckets[PARSE_CACHE_BUCKETS];
+    struct ParseCacheEntry *newest;
+    struct ParseCacheEntry *oldest;
+    int count;
+    int capacity; // Most lines kept, 0 turns the cache off
+    long hits;
+    long misses;
+    long evictions;
+};
+
+// One name in a directory listing
+struct DirectoryEntry
 {
-    char **cmd;      // Pointer to the command array
-    int cmdLen;      // Length of the command array
-    char *cmdSuffix; // This will determine the special character joiner
+    unsigned int offset;  // Start of the name in the listing's names
+    unsigned int length;
+    unsigned char type;   // d_type, DT_UNKNOWN on file systems that do not report it
 };
 
-int isCommandValid;
-int bgProcessArr[MAX_BG_PROCESSES];
-int bgProcessCount = 0;
-int isFgProcess = 0;
+// The entries of one directory, read with getdents64. A listing that goes into the glob cache is
+// sorted by name and reused for as long as the directory's mtime has not changed.
+struct DirectoryListing
+{
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+    char *names;                     // All names back to back, each NUL terminated
+    struct DirectoryEntry *entries;
+    size_t count;
+    int users;                       // Globs walking the listing right now, it is not freed under them
+    int isCached;
+    int isSorted;
+};
+
+// Most recently used listings first
+struct GlobCache
+{
+    struct DirectoryListing **listings;
+    int count;
+    int capacity; // Most directories kept, 0 turns the cache off
+    long hits;
+    long misses;
+};
+
+// A shell variable. entry is "NAME=value" in one block, so the environment can point at it.
+struct Variable
+{
+    char *entry;       // NULL for a slot never used, VARIABLE_REMOVED after an unset
+    size_t nameLength;
+    int envIndex;      // Position in the environment when exported, else -1
+};
+
+// Open addressing table of all variables with linear probing. The exported ones are also kept in
+// envp, which environ points at: setting one replaces its pointer, unsetting one moves the last
+// entry into its place, so a spawn never has to build an environment.
+struct VariableStore
+{
+    struct Variable *slots;
+    size_t capacity; // Always a power of two
+    size_t used;     // Slots holding a variable or a removed marker
+    char **envp;     // NULL terminated
+    int envCount;
+    int envCapacity;
+};
+
+// Entries of the history containing one trigram, in ascending order
+struct HistoryPosting
+{
+    unsigned int trigram;         // The three bytes packed into the low 24 bits
+    unsigned int *entries;
+    unsigned int count;
+    unsigned int capacity;
+    struct HistoryPosting *next;  // Next trigram in the same bucket
+};
+
+// The history log, an append-only file of one command per line shared by every shell24. It is
+// mapped rather than read, so a long log costs nothing at startup. The entry offsets and the
+// trigram index are built the first time they are needed and then grow with the log.
+struct History
+{
+    int fd;                          // The log opened with O_APPEND, -1 while it is not open
+    char *map;
+    size_t mapLength;
+    size_t indexedLength;            // Bytes of the map that are in offsets, always whole lines
+    size_t *offsets;                 // Start of every entry, plus indexedLength at the end
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int trigramCount;       // Entries already in the trigram index
+    struct HistoryPosting **trigrams; // HISTORY_TRIGRAM_BUCKETS buckets, NULL until the first search
+};
+
+// One event of the trace. The slot's sequence tells who may touch it: the ring position it is free
+// for, or that position + 1 once the event is written and waits for the flusher.
+struct TraceEvent
+{
+    unsigned long long sequence;
+    double start;         // nowSeconds when it happened or began
+    double duration;      // Complete events only
+    int tid;              // Lane in the viewer, the shell's pid, a filter thread or a child's pid
+    char phase;           // Chrome trace phase: X complete, B and E a child's life, i instant
+    const char *category; // A string literal
+    const char *argName;  // A string literal naming value, NULL for none
+    long long value;
+    char name[TRACE_NAME_LENGTH];
+};
+
+// The event log of SHELL24_TRACE in Chrome trace format. Any thread adds events to a bounded ring
+// without a lock, and a flusher thread turns them into JSON and writes them in the background.
+// A full ring drops events rather than make a command wait.
+struct Trace
+{
+    int isEnabled;
+    int fd;
+    pid_t pid;
+    double origin;             // nowSeconds at startup, timestamps count from here
+    struct TraceEvent *ring;   // TRACE_RING_SIZE slots
+    unsigned long long head;   // Next position to write, claimed with a compare and swap
+    unsigned long long tail;   // Next position the flusher reads
+    unsigned long long dropped;
+    int isStopping;            // Set at exit, the flusher drains the ring and ends
+    pthread_t flusher;
+    char *output;              // JSON waiting to be written, TRACE_OUTPUT_SIZE bytes
+    size_t outputLength;
+};
+
+// One node of the command trie. The children of a node are a list sorted by byte, and nodes refer
+// to each other by index so the array can grow.
+struct TrieNode
+{
+    int child;           // First child, 0 for none since the root at 0 is nobody's child
+    int sibling;         // Next child of the same parent, 0 for none
+    int count;           // Names that end here or below
+    unsigned char byte;
+    unsigned char isEnd; // A name ends here
+};
+
+// A directory of PATH as it was when its names went into the trie
+struct PathDirectory
+{
+    char *path;
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+    int isTrusted;                    // Its mtime was over a second old when it was read
+    struct DirectoryListing *listing; // NULL if it is missing or cannot be read
+};
+
+// Every command that can be run by name, the builtins and the contents of the PATH directories.
+// Directories are read again only when their mtime moves, so completing a command costs a stat
+// per PATH entry.
+struct CommandTrie
+{
+    struct TrieNode *nodes;
+    int nodeCount;
+    int nodeCapacity;
+    char *pathValue; // PATH the directories were taken from
+    struct PathDirectory *directories;
+    int directoryCount;
+};
+
+// Words a command expands to, in the line arena
+struct WordList
+{
+    char **words;
+    int count;
+    int capacity;
+};
+
+// Matches found for the word at the cursor
+struct Completion
+{
+    struct WordList matches; // The first COMPLETION_LIST_LIMIT of them, for listing
+    int count;               // All of them
+    size_t typedLength;      // Bytes of every match that are already typed
+    char common[4096];       // Longest start all matches share
+    size_t commonLength;
+    int isDirectory;         // The match added last is a directory
+};
+
+// The line being typed at the prompt
+struct LineEditor
+{
+    char *line;
+    size_t length;
+    size_t cursor;
+    size_t capacity;
+    const char *prompt;
+    struct termios savedTerminal;
+    int historyIndex;  // Entry shown by Up and Down, history.count for the line being typed
+    char *draft;       // The line being typed while history or a search is shown, malloc'd
+    size_t draftLength;
+    int isSearching;   // Ctrl-R search is running
+    char query[256];
+    size_t queryLength;
+    int searchIndex;   // Entry the search is on, -1 when nothing matches
+    int lastKey;
+};
+
+// Describes how a child process is created by spawnCommand. Every command the shell runs
+// goes through this one place so that each launch costs a single vfork-style posix_spawn
+// instead of a fork that copies the shell's address space.
+struct SpawnOptions
+{
+    posix_spawn_file_actions_t fileActions; // dup2/close actions applied in the child before exec
+    posix_spawnattr_t attributes;           // Process group and signal state of the child
+    short flags;                            // POSIX_SPAWN_* flags applied to the attributes
+    char **envp;                            // Environment of the child, NULL for the shell's own
+};
+
+// One remembered command name to absolute path mapping, like the hash table of sh
+struct CommandHashEntry
+{
+    char *name;                     // Command name as typed
+    char *path;                     // Absolute path found by searching PATH
+    int hits;                       // Number of times the cached path was used
+    struct CommandHashEntry *next;  // Next entry in the same bucket
+};
+
+// Where command lines come from: a mapped script file, the text of -c, or a stream that is read
+// line by line (a terminal or a pipe)
+struct LineSource
+{
+    const char *data; // Mapped script or -c text, NULL when reading stream
+    size_t length;    // Bytes in data
+    size_t position;  // Offset of the next line in data
+    int seekFd;       // stdin when it is the mapped script, kept at position for the commands, else -1
+    FILE *stream;     // Read with getline when data is NULL
+    char *buffer;     // getline buffer
+    size_t capacity;
+};
+
+extern char **environ;
+
+char variableRemoved[1];       // Marks a variable table slot whose variable was unset
+struct VariableStore variables; // Filled from environ by loadVariables
+
+struct CommandHashEntry *commandHashTable[COMMAND_HASH_BUCKETS];
+char *commandHashPathValue = NULL; // Value of PATH when the table was filled
+
+struct Arena lineArena;  // Owns everything parsed from the current command line
+struct ParseCache parseCache = {.capacity = PARSE_CACHE_CAPACITY};
+struct GlobCache globCache = {.capacity = GLOB_CACHE_CAPACITY};
+struct History history = {.fd = -1};
+struct CommandTrie commandTrie;
+struct Trace trace = {.fd = -1};
+int isArenaDebug = 0;    // Print arena usage after every line when SHELL24_ARENA_DEBUG is set
+
+struct Job **jobTable = NULL; // Background and stopped jobs, oldest first
+int jobCount = 0;
+int jobCapacity = 0;
+int jobEpollFd = -1;          // Watches childSignalFd, and stdin while waiting at the prompt
+int childSignalFd = -1;       // Receives SIGCHLD, which stays blocked in the shell
+struct Session **sessionTable = NULL; // Sessions opened with newt, oldest first
+int sessionCount = 0;
+int sessionCapacity = 0;
+int isInteractive = 0;        // stdin is a terminal
+volatile sig_atomic_t foregroundPgid = 0; // Process group of a job brought back with fg
+volatile sig_atomic_t isFilterInterrupted = 0; // Ctrl+C reached the shell while filter threads ran
+struct FilterStage **pendingFilters = NULL;    // Filters of the pipeline being started, their threads
+int pendingFilterCount = 0;                    // start once all of its processes have
+int lastExitStatus = 0; // Status of the last command that ran, used by $? and exit
+struct UsageReport *activeUsageReport = NULL; // Collects stage usage while a timed node runs
+struct Placement *activePlacement = NULL;     // Placement of the processes started while a sched node runs
+int placementIndex = 0;                       // Processes placed so far under activePlacement
+int spreadOrder[CPU_SETSIZE];                 // CPUs the processes of a spread placement go to, in order
+int spreadCount = 0;
+
+// Returns size bytes from the arena, growing it with a new chunk when the current one is full
+void *arenaAlloc(struct Arena *arena, size_t size)
+{
+    // Keep every allocation aligned for any type
+    size = (size + 15) & ~(size_t)15;
+
+    struct ArenaChunk *chunk = arena->current;
+    while (chunk != NULL && chunk->size - chunk->used < size)
+    {
+        chunk = chunk->next;
+    }
+    if (chunk == NULL)
+    {
+        size_t chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(struct ArenaChunk) + chunkSize);
+        if (chunk == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        chunk->next = NULL;
+        if (arena->first == NULL)
+        {
+            arena->first = chunk;
+        }
+        else
+        {
+            // Append after the last chunk so resets reuse chunks in order
+            struct ArenaChunk *last = arena->current != NULL ? arena->current : arena->first;
+            while (last->next != NULL)
+            {
+                last = last->next;
+            }
+            last->next = chunk;
+        }
+        arena->capacity += chunkSize;
+        if (arena->capacity > arena->peakCapacity)
+        {
+            arena->peakCapacity = arena->capacity;
+        }
+    }
+    arena->current = chunk;
+
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->allocated += size;
+    if (arena->allocated > arena->peakAllocated)
+    {
+        arena->peakAllocated = arena->allocated;
+    }
+    return memory;
+}
+
+char *arenaStrndup(struct Arena *arena, const char *text, size_t length)
+{
+    char *copy = arenaAlloc(arena, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+char *arenaStrdup(struct Arena *arena, const char *text)
+{
+    return arenaStrndup(arena, text, strlen(text));
+}
+
+// Releases everything allocated from the arena at once. Regular chunks are kept for the next
+// line, oversized ones are given back so one huge line does not pin its memory forever.
+void arenaReset(struct Arena *arena)
+{
+    struct ArenaChunk **link = &arena->first;
+    while (*link != NULL)
+    {
+        struct ArenaChunk *chunk = *link;
+        if (chunk->size > ARENA_CHUNK_SIZE)
+        {
+            *link = chunk->next;
+            arena->capacity -= chunk->size;
+            free(chunk);
+            continue;
+        }
+        chunk->used = 0;
+        link = &chunk->next;
+    }
+    arena->current = arena->first;
+    arena->allocated = 0;
+}
+
+void clearParseCache();
+
+// FNV-1a of a variable name
+size_t hashVariableName(const char *name, size_t length)
+{
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Returns the slot holding name, or the slot it would go in: the first removed one on its probe
+// sequence, else the empty one that ends it
+struct Variable *findVariableSlot(const char *name, size_t length)
+{
+    struct Variable *removed = NULL;
+    for (size_t i = hashVariableName(name, length) & (variables.capacity - 1);; i = (i + 1) & (variables.capacity - 1))
+    {
+        struct Variable *slot = &variables.slots[i];
+        if (slot->entry == NULL)
+        {
+            return removed != NULL ? removed : slot;
+        }
+        if (slot->entry == variableRemoved)
+        {
+            removed = removed != NULL ? removed : slot;
+        }
+        else if (slot->nameLength == length && memcmp(slot->entry, name, length) == 0)
+        {
+            return slot;
+        }
+    }
+}
+
+// Doubles the table once it is 70% full, removed markers included, dropping those markers
+void growVariableTable()
+{
+    if (variables.slots != NULL && (variables.used + 1) * 10 < variables.capacity * 7)
+    {
+        return;
+    }
+    struct Variable *old = variables.slots;
+    size_t oldCapacity = variables.capacity;
+    variables.capacity = old == NULL ? VARIABLE_TABLE_SIZE : 2 * oldCapacity;
+    variables.slots = calloc(variables.capacity, sizeof(struct Variable));
+    if (variables.slots == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    variables.used = 0;
+    for (size_t i = 0; i < oldCapacity; i++)
+    {
+        if (old[i].entry != NULL && old[i].entry != variableRemoved)
+        {
+            *findVariableSlot(old[i].entry, old[i].nameLength) = old[i];
+            variables.used++;
+        }
+    }
+    free(old);
+}
+
+// Adds entry at the end of the environment
+void addEnvironmentEntry(struct Variable *variable)
+{
+    if (variables.envCount + 1 >= variables.envCapacity)
+    {
+        variables.envCapacity = variables.envCapacity == 0 ? 64 : 2 * variables.envCapacity;
+        variables.envp = realloc(variables.envp, variables.envCapacity * sizeof(char *));
+        if (variables.envp == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        environ = variables.envp;
+    }
+    variable->envIndex = variables.envCount;
+    variables.envp[variables.envCount++] = variable->entry;
+    variables.envp[variables.envCount] = NULL;
+}
+
+// Takes variable out of the environment by moving the last entry into its place
+void removeEnvironmentEntry(struct Variable *variable)
+{
+    int index = variable->envIndex;
+    char *last = variables.envp[--variables.envCount];
+    variables.envp[variables.envCount] = NULL;
+    variable->envIndex = -1;
+    if (index != variables.envCount)
+    {
+        variables.envp[index] = last;
+        findVariableSlot(last, strcspn(last, "="))->envIndex = index;
+    }
+}
+
+// Copies environ into the table once, before the first variable is used
+void loadVariables()
+{
+    if (variables.slots != NULL)
+    {
+        return;
+    }
+    growVariableTable();
+    char **inherited = environ;
+    variables.envCapacity = 64;
+    variables.envp = malloc(variables.envCapacity * sizeof(char *));
+    if (variables.envp == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    variables.envp[0] = NULL;
+    environ = variables.envp;
+    for (char **entry = inherited; entry != NULL && *entry != NULL; entry++)
+    {
+        size_t length = strcspn(*entry, "=");
+        if ((*entry)[length] != '=' || length == 0)
+        {
+            continue;
+        }
+        growVariableTable();
+        struct Variable *slot = findVariableSlot(*entry, length);
+        if (slot->entry != NULL && slot->entry != variableRemoved)
+        {
+            continue;
+        }
+        variables.used += slot->entry == NULL;
+        *slot = (struct Variable){strdup(*entry), length, -1};
+        addEnvironmentEntry(slot);
+    }
+}
+
+// Returns the value of the variable name[0..length), or NULL if it is not set
+const char *lookupVariable(const char *name, size_t length)
+{
+    loadVariables();
+    struct Variable *slot = findVariableSlot(name, length);
+    if (slot->entry == NULL || slot->entry == variableRemoved)
+    {
+        return NULL;
+    }
+    return slot->entry + length + 1;
+}
+
+const char *getVariable(const char *name)
+{
+    return lookupVariable(name, strlen(name));
+}
+
+// Returns 1 if name[0..length) is a valid variable name
+int isVariableName(const char *name, size_t length)
+{
+    if (length == 0 || (name[0] >= '0' && name[0] <= '9'))
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = name[i];
+        if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Sets name to value. isExported 1 exports it, 0 keeps it in the shell, -1 leaves it as it was.
+// Returns 0, or -1 if name is not a valid variable name.
+int setVariable(const char *name, size_t length, const char *value, int isExported)
+{
+    if (!isVariableName(name, length))
+    {
+        return -1;
+    }
+    loadVariables();
+    growVariableTable();
+    struct Variable *slot = findVariableSlot(name, length);
+    int isNew = slot->entry == NULL || slot->entry == variableRemoved;
+    size_t valueLength = strlen(value);
+    char *entry = malloc(length + valueLength + 2);
+    if (entry == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry, name, length);
+    entry[length] = '=';
+    memcpy(entry + length + 1, value, valueLength + 1);
+    if (isNew)
+    {
+        variables.used += slot->entry == NULL;
+        *slot = (struct Variable){entry, length, -1};
+    }
+    else
+    {
+        free(slot->entry);
+        slot->entry = entry;
+    }
+    // An exported variable only has its pointer replaced, the rest of the environment stays
+    if (slot->envIndex >= 0)
+    {
+        variables.envp[slot->envIndex] = entry;
+        if (isExported == 0)
+        {
+            removeEnvironmentEntry(slot);
+        }
+    }
+    else if (isExported == 1)
+    {
+        addEnvironmentEntry(slot);
+    }
+    if (length == 4 && memcmp(name, "HOME", 4) == 0)
+    {
+        // ~ is expanded while parsing, so cached lines may hold the old home directory
+        clearParseCache();
+    }
+    return 0;
+}
+
+// Exports an existing variable, returns -1 if it is not set
+int exportVariable(const char *name, size_t length)
+{
+    loadVariables();
+    struct Variable *slot = findVariableSlot(name, length);
+    if (slot->entry == NULL || slot->entry == variableRemoved)
+    {
+        return -1;
+    }
+    if (slot->envIndex < 0)
+    {
+        addEnvironmentEntry(slot);
+    }
+    return 0;
+}
+
+void unsetVariable(const char *name, size_t length)
+{
+    loadVariables();
+    struct Variable *slot = findVariableSlot(name, length);
+    if (slot->entry == NULL || slot->entry == variableRemoved)
+    {
+        return;
+    }
+    if (slot->envIndex >= 0)
+    {
+        removeEnvironmentEntry(slot);
+    }
+    free(slot->entry);
+    // The slot stays taken so later names on the same probe sequence are still found
+    slot->entry = variableRemoved;
+}
+
+// Table used by the scalar scanner, 1 for bytes that end an unquoted run of a word
+unsigned char isLexerSpecial[256];
+
+// Text of every operator, indexed by OperatorType
+const char *operatorText[] = {"", "#", "|", "||", "&", "&&", ">", ">>", "<", ";", "<<", "<<-", "<<<", ">&", "<&", "&>", "&>>"};
+
+// Returns the first byte in [p, end) that is a blank, an operator character or a quote
+const char *findSpecialScalar(const char *p, const char *end)
+{
+    while (p < end && !isLexerSpecial[(unsigned char)*p])
+    {
+        p++;
+    }
+    return p;
+}
+
+#ifdef LEXER_HAS_SIMD
+// SSE2 is part of x86-64 so this version is always available, one compare per special byte
+const char *findSpecialSse2(const char *p, const char *end)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i hash = _mm_set1_epi8('#');
+    const __m128i bar = _mm_set1_epi8('|');
+    const __m128i ampersand = _mm_set1_epi8('&');
+    const __m128i greater = _mm_set1_epi8('>');
+    const __m128i less = _mm_set1_epi8('<');
+    const __m128i semicolon = _mm_set1_epi8(';');
+    const __m128i doubleQuote = _mm_set1_epi8('"');
+    const __m128i singleQuote = _mm_set1_epi8('\'');
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i backquote = _mm_set1_epi8('`');
+
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, hash)));
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(chunk, bar), _mm_cmpeq_epi8(chunk, ampersand)));
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(chunk, greater), _mm_cmpeq_epi8(chunk, less)));
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(chunk, semicolon), _mm_cmpeq_epi8(chunk, doubleQuote)));
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(chunk, singleQuote), _mm_cmpeq_epi8(chunk, dollar)));
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, backquote));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return findSpecialScalar(p, end);
+}
+
+// AVX2 version classifies 32 bytes with two nibble table lookups instead of thirteen compares.
+// Each special byte's high nibble selects a bit, and the low nibble table holds the bits of
+// the high nibbles that form a special byte with it.
+__attribute__((target("avx2"))) const char *findSpecialAvx2(const char *p, const char *end)
+{
+    const __m256i lowTable = _mm256_setr_epi8(0x12, 0, 0x02, 0x02, 0x02, 0, 0x02, 0x02, 0, 0x01, 0x01, 0x04, 0x0c, 0, 0x04, 0,
+                                              0x12, 0, 0x02, 0x02, 0x02, 0, 0x02, 0x02, 0, 0x01, 0x01, 0x04, 0x0c, 0, 0x04, 0);
+    const __m256i highTable = _mm256_setr_epi8(0x01, 0, 0x02, 0x04, 0, 0, 0x10, 0x08, 0, 0, 0, 0, 0, 0, 0, 0,
+                                               0x01, 0, 0x02, 0x04, 0, 0, 0x10, 0x08, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibbleMask = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (end - p >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        __m256i low = _mm256_shuffle_epi8(lowTable, _mm256_and_si256(chunk, nibbleMask));
+        __m256i high = _mm256_shuffle_epi8(highTable, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibbleMask));
+        __m256i misses = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), zero);
+        unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(misses);
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return findSpecialSse2(p, end);
+}
+#endif
+
+// Scanner picked by initLexer for the running CPU
+const char *(*findSpecialByte)(const char *p, const char *end) = findSpecialScalar;
+
+void initLexer()
+{
+    const char *specialBytes = " \t\n#|&><;\"'$`";
+    for (const char *c = specialBytes; *c != '\0'; c++)
+    {
+        isLexerSpecial[(unsigned char)*c] = 1;
+    }
+#ifdef LEXER_HAS_SIMD
+    __builtin_cpu_init();
+    findSpecialByte = __builtin_cpu_supports("avx2") ? findSpecialAvx2 : findSpecialSse2;
+#endif
+}
+
+// Recognises the operator starting at p, returns OP_NONE if there is none
+int operatorAt(const char *p, const char *end, size_t *operatorLength)
+{
+    int isDoubled = (p + 1 < end) && (p[1] == p[0]);
+    *operatorLength = 1;
+    switch (*p)
+    {
+    case '#':
+        return OP_CONCAT;
+    case ';':
+        return OP_SEQUENCE;
+    case '<':
+        if (isDoubled)
+        {
+            // << here-doc, <<- here-doc without leading tabs, <<< here-string
+            *operatorLength = (p + 2 < end && (p[2] == '<' || p[2] == '-')) ? 3 : 2;
+            return *operatorLength == 2 ? OP_HEREDOC : (p[2] == '<' ? OP_HERESTRING : OP_HEREDOC_TABS);
+        }
+        if (p + 1 < end && p[1] == '&')
+        {
+            *operatorLength = 2;
+            return OP_DUP_IN;
+        }
+        return OP_REDIRECT_IN;
+    case '|':
+        *operatorLength += isDoubled;
+        return isDoubled ? OP_OR : OP_PIPE;
+    case '&':
+        if (p + 1 < end && p[1] == '>')
+        {
+            *operatorLength = (p + 2 < end && p[2] == '>') ? 3 : 2;
+            return *operatorLength == 3 ? OP_APPEND_ALL : OP_REDIRECT_ALL;
+        }
+        *operatorLength += isDoubled;
+        return isDoubled ? OP_AND : OP_BACKGROUND;
+    case '>':
+        if (p + 1 < end && p[1] == '&')
+        {
+            *operatorLength = 2;
+            return OP_DUP_OUT;
+        }
+        *operatorLength += isDoubled;
+        return isDoubled ? OP_APPEND : OP_REDIRECT_OUT;
+    }
+    return OP_NONE;
+}
+
+const char *findSubstitutionEnd(const char *p, const char *end);
+
+// Returns the length of the $NAME, ${NAME} or $? at p, 0 if the $ starts none of them. The name
+// is returned in *name and *nameLength.
+size_t variableReferenceLength(const char *p, const char *end, const char **name, size_t *nameLength)
+{
+    const char *q = p + 1;
+    if (q < end && *q == '?')
+    {
+        *name = q;
+        *nameLength = 1;
+        return 2;
+    }
+    int isBraced = q < end && *q == '{';
+    q += isBraced;
+    const char *start = q;
+    while (q < end && (*q == '_' || (*q >= 'a' && *q <= 'z') || (*q >= 'A' && *q <= 'Z') || (q > start && *q >= '0' && *q <= '9')))
+    {
+        q++;
+    }
+    if (q == start || (isBraced && (q >= end || *q != '}')))
+    {
+        return 0;
+    }
+    *name = start;
+    *nameLength = q - start;
+    return q - p + isBraced;
+}
+
+// Returns the " that closes the one at p, or NULL when the line ends first
+const char *findDoubleQuoteEnd(const char *p, const char *end)
+{
+    for (p++; p < end; p++)
+    {
+        if (*p == '"')
+        {
+            return p;
+        }
+        if ((*p == '`' || (*p == '$' && p + 1 < end && p[1] == '(')) && (p = findSubstitutionEnd(p, end)) == NULL)
+        {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Returns the ) or ` that closes the $( or ` at p, or NULL when the line ends first. Quotes and
+// nested substitutions inside are skipped as a whole.
+const char *findSubstitutionEnd(const char *p, const char *end)
+{
+    if (*p == '`')
+    {
+        return memchr(p + 1, '`', end - p - 1);
+    }
+    int depth = 0;
+    for (p += 2; p < end; p++)
+    {
+        if (*p == '\'')
+        {
+            p = memchr(p + 1, '\'', end - p - 1);
+        }
+        else if (*p == '"')
+        {
+            p = findDoubleQuoteEnd(p, end);
+        }
+        else if (*p == '`' || (*p == '$' && p + 1 < end && p[1] == '('))
+        {
+            p = findSubstitutionEnd(p, end);
+        }
+        else if (*p == '(')
+        {
+            depth++;
+        }
+        else if (*p == ')' && depth-- == 0)
+        {
+            return p;
+        }
+        if (p == NULL)
+        {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Stores a quoted byte at out, a glob character gets GLOB_ESCAPE in front so it only matches
+// itself. Returns the end of what was stored.
+char *copyQuotedByte(char *out, char c)
+{
+    if (c == '*' || c == '?' || c == '[')
+    {
+        *out++ = GLOB_ESCAPE;
+    }
+    *out++ = c;
+    return out;
+}
+
+// Returns 1 if word has a *, ? or [...] that is not quoted, outside of any substitution
+int hasGlobCharacters(const char *word)
+{
+    for (const char *p = word; *p != '\0'; p++)
+    {
+        if (*p == GLOB_ESCAPE && p[1] != '\0')
+        {
+            p++;
+        }
+        else if (*p == EXPANSION_START)
+        {
+            p = strchr(p, EXPANSION_END);
+        }
+        else if (*p == '*' || *p == '?' || (*p == '[' && strchr(p + 1, ']') != NULL))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Copies the word in [start, end) to the arena with its quotes removed and a leading ~
+// replaced by the home directory. Command substitutions are kept between EXPANSION_START and
+// EXPANSION_END, they only run when the command does.
+char *copyWordText(const char *start, const char *end, int isQuoted)
+{
+    const char *homeDir = "";
+    size_t homeLen = 0;
+    if (start[0] == '~' && (end - start == 1 || start[1] == '/'))
+    {
+        homeDir = getVariable("HOME") != NULL ? getVariable("HOME") : "";
+        homeLen = strlen(homeDir);
+        start++;
+    }
+
+    // A `...` becomes one byte longer with its markers
+    char *text = arenaAlloc(&lineArena, homeLen + 2 * (end - start) + 1);
+    memcpy(text, homeDir, homeLen);
+    char *out = text + homeLen;
+    if (!isQuoted)
+    {
+        memcpy(out, start, end - start);
+        out += end - start;
+    }
+    else
+    {
+        int isInDoubleQuotes = 0;
+        const char *name;
+        size_t nameLength;
+        while (start < end)
+        {
+            if (*start == '\'' && !isInDoubleQuotes)
+            {
+                const char *close = memchr(start + 1, '\'', end - start - 1);
+                for (start++; start < close; start++)
+                {
+                    out = copyQuotedByte(out, *start);
+                }
+                start = close + 1;
+            }
+            else if (*start == '"')
+            {
+                isInDoubleQuotes = !isInDoubleQuotes;
+                start++;
+            }
+            else if (*start == '$' && variableReferenceLength(start, end, &name, &nameLength) > 0)
+            {
+                // Variables are looked up when the command runs, like substitutions
+                start += variableReferenceLength(start, end, &name, &nameLength);
+                *out++ = EXPANSION_START;
+                *out++ = isInDoubleQuotes ? 'V' : 'v';
+                memcpy(out, name, nameLength);
+                out += nameLength;
+                *out++ = EXPANSION_END;
+            }
+            else if (*start == '`' || (*start == '$' && start + 1 < end && start[1] == '('))
+            {
+                const char *close = findSubstitutionEnd(start, end);
+                const char *inner = start + (*start == '`' ? 1 : 2);
+                *out++ = EXPANSION_START;
+                *out++ = isInDoubleQuotes ? 'C' : 'c';
+                memcpy(out, inner, close - inner);
+                out += close - inner;
+                *out++ = EXPANSION_END;
+                start = close + 1;
+            }
+            else if (isInDoubleQuotes)
+            {
+                out = copyQuotedByte(out, *start++);
+            }
+            else
+            {
+                *out++ = *start++;
+            }
+        }
+    }
+    *out = '\0';
+    return text;
+}
+
+// Splits a command line into word, quoted string and operator tokens in a single pass.
+// Returns the number of tokens stored in *tokensOut or -1 on a syntax error.
+int lexLine(const char *line, size_t length, struct Token **tokensOut)
+{
+    const char *p = line;
+    const char *end = line + length;
+    int capacity = 16;
+    int count = 0;
+    struct Token *tokens = arenaAlloc(&lineArena, capacity * sizeof(struct Token));
+
+    while (1)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        {
+            p++;
+        }
+        if (p >= end)
+        {
+            break;
+        }
+        if (count == capacity)
+        {
+            struct Token *grown = arenaAlloc(&lineArena, 2 * capacity * sizeof(struct Token));
+            memcpy(grown, tokens, capacity * sizeof(struct Token));
+            tokens = grown;
+            capacity *= 2;
+        }
+        struct Token *token = &tokens[count++];
+
+        size_t operatorLength;
+        token->op = operatorAt(p, end, &operatorLength);
+        if (token->op != OP_NONE)
+        {
+            token->type = TOKEN_OPERATOR;
+            token->text = (char *)operatorText[token->op];
+            token->hasExpansions = 0;
+            p += operatorLength;
+            continue;
+        }
+
+        // A word runs until an unquoted blank or operator, quoted parts and substitutions may
+        // contain anything
+        const char *start = p;
+        int isQuoted = 0;
+        int hasSubstitutions = 0;
+        while ((p = findSpecialByte(p, end)) < end)
+        {
+            const char *close;
+            const char *name;
+            size_t nameLength;
+            if (*p == '$' && (p + 1 >= end || p[1] != '('))
+            {
+                // A $ that starts no variable is an ordinary character
+                size_t length = variableReferenceLength(p, end, &name, &nameLength);
+                hasSubstitutions |= length > 0;
+                p += length > 0 ? length : 1;
+                continue;
+            }
+            if (*p == '$' || *p == '`')
+            {
+                if ((close = findSubstitutionEnd(p, end)) == NULL)
+                {
+                    fprintf(stderr, "Syntax error: Unmatched %s\n", *p == '`' ? "`" : "$(");
+                    return -1;
+                }
+                hasSubstitutions = 1;
+            }
+            else if (*p == '"' || *p == '\'')
+            {
+                close = *p == '"' ? findDoubleQuoteEnd(p, end) : memchr(p + 1, '\'', end - p - 1);
+                if (close == NULL)
+                {
+                    fprintf(stderr, "Syntax error: Unmatched %s quote\n", *p == '"' ? "double" : "single");
+                    return -1;
+                }
+                isQuoted = 1;
+            }
+            else
+            {
+                break;
+            }
+            p = close + 1;
+        }
+        token->type = isQuoted ? TOKEN_QUOTED : TOKEN_WORD;
+        token->text = copyWordText(start, p, isQuoted || hasSubstitutions);
+        // Substitutions, patterns and quoted glob characters are dealt with when the command runs
+        token->hasExpansions = hasGlobCharacters(token->text) ||
+                               ((isQuoted || hasSubstitutions) &&
+                                (strchr(token->text, EXPANSION_START) != NULL || strchr(token->text, GLOB_ESCAPE) != NULL));
+        // 2>file: digits directly in front of < or > name the descriptor
+        if (!isQuoted && p < end && (*p == '<' || *p == '>') && p - start <= 4 && strspn(start, "0123456789") == (size_t)(p - start))
+        {
+            token->type = TOKEN_IO_NUMBER;
+        }
+    }
+
+    *tokensOut = tokens;
+    return count;
+}
+
+// Allocates a zeroed tree node from the line arena
+struct AstNode *newAstNode(int type)
+{
+    struct AstNode *node = arenaAlloc(&lineArena, sizeof(struct AstNode));
+    memset(node, 0, sizeof(struct AstNode));
+    node->type = type;
+    return node;
+}
+
+// Operator of the token the parser is looking at, OP_NONE for a word or the end of the line
+int parserPeekOperator(struct Parser *parser)
+{
+    if (parser->position >= parser->tokenCount || parser->tokens[parser->position].type != TOKEN_OPERATOR)
+    {
+        return OP_NONE;
+    }
+    return parser->tokens[parser->position].op;
+}
+
+void parserSyntaxError(struct Parser *parser)
+{
+    if (parser->isFailed)
+    {
+        return;
+    }
+    if (parser->position >= parser->tokenCount)
+    {
+        printf("Syntax error near unexpected end of line\n");
+    }
+    else
+    {
+        printf("Syntax error near unexpected token '%s'\n", parser->tokens[parser->position].text);
+    }
+    parser->isFailed = 1;
+}
+
+int isRedirectOperator(int op)
+{
+    return op == OP_REDIRECT_OUT || op == OP_APPEND || op == OP_REDIRECT_IN || (op >= OP_HEREDOC && op <= OP_APPEND_ALL);
+}
+
+// Input redirections apply to stdin unless a descriptor is given, all others to stdout
+int isInputRedirect(int op)
+{
+    return op == OP_REDIRECT_IN || op == OP_HEREDOC || op == OP_HEREDOC_TABS || op == OP_HERESTRING || op == OP_DUP_IN;
+}
+
+// Adds a redirection to the end of the list at *tail and returns it
+struct Redirect *appendRedirect(struct Redirect ***tail, int op, int fd, char *target)
+{
+    struct Redirect *redirect = arenaAlloc(&lineArena, sizeof(struct Redirect));
+    memset(redirect, 0, sizeof(struct Redirect));
+    redirect->op = op;
+    redirect->fd = fd;
+    redirect->target = target;
+    **tail = redirect;
+    *tail = &redirect->next;
+    return redirect;
+}
+
+// command := (word | redirection)+ ('#' (word | redirection)+)*
+// With # the words are the files to concatenate rather than a program and its arguments.
+struct AstNode *parseCommand(struct Parser *parser)
+{
+    struct AstNode *node = newAstNode(NODE_COMMAND);
+    // No command can have more words than there are tokens left
+    node->argv = arenaAlloc(&lineArena, (parser->tokenCount - parser->position + 1) * sizeof(char *));
+    node->assignments = NULL;
+    struct Redirect **redirectTail = &node->redirects;
+    int segmentWords = 0;
+
+    while (parser->position < parser->tokenCount)
+    {
+        struct Token *token = &parser->tokens[parser->position];
+        int fd = -1;
+        if (token->type == TOKEN_IO_NUMBER)
+        {
+            // The lexer only makes these in front of < or >, so a redirection follows
+            fd = atoi(token->text);
+            token = &parser->tokens[++parser->position];
+        }
+        size_t nameLength = token->type != TOKEN_OPERATOR ? strcspn(token->text, "=") : 0;
+        if (node->argc == 0 && node->type == NODE_COMMAND && token->type != TOKEN_OPERATOR &&
+            token->text[nameLength] == '=' && isVariableName(token->text, nameLength))
+        {
+            // NAME=value in front of a command, expanded when the command runs
+            if (node->assignments == NULL)
+            {
+                node->assignments = arenaAlloc(&lineArena, (parser->tokenCount - parser->position) * sizeof(char *));
+            }
+            node->assignments[node->assignmentCount++] = token->text;
+            node->hasExpansions = 1;
+            parser->position++;
+        }
+        else if (token->type != TOKEN_OPERATOR)
+        {
+            node->hasExpansions |= token->hasExpansions;
+            node->argv[node->argc++] = token->text;
+            segmentWords++;
+            parser->position++;
+        }
+        else if (isRedirectOperator(token->op))
+        {
+            parser->position++;
+            if (parser->position >= parser->tokenCount || parser->tokens[parser->position].type == TOKEN_OPERATOR)
+            {
+                parserSyntaxError(parser);
+                return NULL;
+            }
+            struct Token *target = &parser->tokens[parser->position++];
+            node->hasExpansions |= target->hasExpansions;
+            int op = token->op;
+            if (op == OP_DUP_OUT && fd == -1 && strcmp(target->text, "-") != 0 && strspn(target->text, "0123456789") != strlen(target->text))
+            {
+                // >&file is the old spelling of &>file
+                op = OP_REDIRECT_ALL;
+            }
+            if ((op == OP_DUP_OUT || op == OP_DUP_IN) && strcmp(target->text, "-") != 0 &&
+                (target->text[0] == '\0' || strspn(target->text, "0123456789") != strlen(target->text)))
+            {
+                printf("%s: ambiguous redirect\n", target->text);
+                parser->isFailed = 1;
+                return NULL;
+            }
+            if (op == OP_REDIRECT_ALL || op == OP_APPEND_ALL)
+            {
+                // &>file is >file 2>&1
+                appendRedirect(&redirectTail, op == OP_REDIRECT_ALL ? OP_REDIRECT_OUT : OP_APPEND, STDOUT_FILENO, target->text);
+                appendRedirect(&redirectTail, OP_DUP_OUT, STDERR_FILENO, "1");
+                continue;
+            }
+            if (fd == -1)
+            {
+                fd = isInputRedirect(op) ? STDIN_FILENO : STDOUT_FILENO;
+            }
+            appendRedirect(&redirectTail, op, fd, target->text)->isQuoted = target->type == TOKEN_QUOTED;
+        }
+        else if (token->op == OP_CONCAT && segmentWords > 0)
+        {
+            node->type = NODE_CONCAT;
+            segmentWords = 0;
+            parser->position++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // A line of assignments alone sets shell variables
+    if (segmentWords == 0 && (node->assignmentCount == 0 || node->type != NODE_COMMAND || node->argc > 0))
+    {
+        parserSyntaxError(parser);
+        return NULL;
+    }
+    node->argv[node->argc] = NULL;
+    return node;
+}
+
+// pipeline := command ('|' command)*
+struct AstNode *parsePipeline(struct Parser *parser)
+{
+    struct AstNode *command = parseCommand(parser);
+    if (command == NULL || parserPeekOperator(parser) != OP_PIPE)
+    {
+        return command;
+    }
+
+    struct AstNode *node = newAstNode(NODE_PIPELINE);
+    node->stages = arenaAlloc(&lineArena, (parser->tokenCount - parser->position + 2) * sizeof(struct AstNode *));
+    node->stages[node->stageCount++] = command;
+    while (parserPeekOperator(parser) == OP_PIPE)
+    {
+        parser->position++;
+        if ((command = parseCommand(parser)) == NULL)
+        {
+            return NULL;
+        }
+        node->stages[node->stageCount++] = command;
+    }
+    return node;
+}
+
+// Reads a list like 0-3,8,10-11 into set. Returns -1 if it is not one.
+int parseCpuList(const char *text, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = text;
+    while (*p != '\0')
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+            {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0' && *end != '\n'))
+        {
+            return -1;
+        }
+        for (long i = first; i <= last; i++)
+        {
+            CPU_SET(i, set);
+        }
+        p = *end == ',' ? end + 1 : end + strlen(end);
+    }
+    return 0;
+}
+
+// Adds the CPUs of NUMA node to set, returns -1 if there is no such node
+int addNodeCpus(int node, cpu_set_t *set)
+{
+    char path[128];
+    char text[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t length = fd == -1 ? -1 : read(fd, text, sizeof(text) - 1);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    cpu_set_t nodeCpus;
+    if (length < 0)
+    {
+        return -1;
+    }
+    text[length] = '\0';
+    if (parseCpuList(text, &nodeCpus) == -1)
+    {
+        return -1;
+    }
+    CPU_OR(set, set, &nodeCpus);
+    return 0;
+}
+
+// Reports a bad sched prefix and fails the line, with the usage when the options are malformed
+void placementError(struct Parser *parser, const char *message, const char *value, int isUsage)
+{
+    fprintf(stderr, "sched: %s%s%s\n", message, value != NULL ? ": " : "", value != NULL ? value : "");
+    if (isUsage)
+    {
+        fprintf(stderr, "sched: usage: sched [-c cpus] [-m nodes] [-n nice] [-i idle|be[:level]|rt[:level]] [-s] command\n");
+    }
+    parser->isFailed = 1;
+}
+
+// Reads the options of a sched prefix, the word sched is already taken. Returns NULL after
+// reporting a bad option.
+struct Placement *parsePlacement(struct Parser *parser)
+{
+    struct Placement *placement = arenaAlloc(&lineArena, sizeof(struct Placement));
+    memset(placement, 0, sizeof(struct Placement));
+    cpu_set_t nodeCpus;
+    CPU_ZERO(&nodeCpus);
+    while (parser->position < parser->tokenCount && parser->tokens[parser->position].type != TOKEN_OPERATOR &&
+           parser->tokens[parser->position].text[0] == '-')
+    {
+        const char *option = parser->tokens[parser->position++].text;
+        if (strcmp(option, "-s") == 0)
+        {
+            placement->isSpread = 1;
+            continue;
+        }
+        if (strlen(option) != 2 || strchr("cmni", option[1]) == NULL)
+        {
+            placementError(parser, "unknown option", option, 1);
+            return NULL;
+        }
+        if (parser->position >= parser->tokenCount || parser->tokens[parser->position].type == TOKEN_OPERATOR)
+        {
+            placementError(parser, "missing value of", option, 1);
+            return NULL;
+        }
+        const char *value = parser->tokens[parser->position++].text;
+        char *end;
+        if (option[1] == 'c' && parseCpuList(value, &placement->cpus) == -1)
+        {
+            placementError(parser, "bad CPU list", value, 0);
+            return NULL;
+        }
+        else if (option[1] == 'm')
+        {
+            cpu_set_t nodes;
+            if (parseCpuList(value, &nodes) == -1)
+            {
+                placementError(parser, "bad node list", value, 0);
+                return NULL;
+            }
+            for (int node = 0; node < CPU_SETSIZE; node++)
+            {
+                if (CPU_ISSET(node, &nodes) && (node >= PLACEMENT_MAX_NODES || addNodeCpus(node, &nodeCpus) == -1))
+                {
+                    placementError(parser, "no such NUMA node", value, 0);
+                    return NULL;
+                }
+                placement->nodes |= CPU_ISSET(node, &nodes) ? 1UL << node : 0;
+            }
+        }
+        else if (option[1] == 'n')
+        {
+            placement->nice = strtol(value, &end, 10);
+            placement->isNiceSet = 1;
+            if (end == value || *end != '\0')
+            {
+                placementError(parser, "bad nice value", value, 0);
+                return NULL;
+            }
+        }
+        else if (option[1] == 'i')
+        {
+            // idle, be[:level] or rt[:level], like ionice -c 3, -c 2 -n level and -c 1 -n level
+            size_t classLength = strcspn(value, ":");
+            placement->ioClass = classLength == 4 && strncmp(value, "idle", 4) == 0 ? 3
+                                 : classLength == 2 && strncmp(value, "be", 2) == 0 ? 2
+                                 : classLength == 2 && strncmp(value, "rt", 2) == 0 ? 1
+                                                                                    : 0;
+            placement->ioLevel = value[classLength] == ':' ? strtol(value + classLength + 1, &end, 10) : 4;
+            if (placement->ioClass == 0 || placement->ioLevel < 0 || placement->ioLevel > 7 ||
+                (value[classLength] == ':' && (*end != '\0' || placement->ioClass == 3)))
+            {
+                placementError(parser, "bad I/O class", value, 0);
+                return NULL;
+            }
+        }
+    }
+    // Without -c the CPUs of the -m nodes are used
+    if (CPU_COUNT(&placement->cpus) == 0)
+    {
+        placement->cpus = nodeCpus;
+    }
+    cpu_set_t allowed;
+    if (CPU_COUNT(&placement->cpus) > 0 && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        CPU_AND(&allowed, &allowed, &placement->cpus);
+        if (CPU_COUNT(&allowed) == 0)
+        {
+            placementError(parser, "none of the CPUs can be used", NULL, 0);
+            return NULL;
+        }
+    }
+    if (parser->position >= parser->tokenCount || parser->tokens[parser->position].type == TOKEN_OPERATOR)
+    {
+        placementError(parser, "missing command", NULL, 1);
+        return NULL;
+    }
+    return placement;
+}
+
+// andOr := ['time'] ['sched' options] pipeline (('&&' | '||') pipeline)*, evaluated left to
+// right like sh
+struct AstNode *parseAndOr(struct Parser *parser)
+{
+    // A leading time word times the whole chain and sched places every process it starts. Either
+    // on its own is left to run as a command.
+    int isTimed = 0;
+    struct Placement *placement = NULL;
+    while (parser->position + 1 < parser->tokenCount && parser->tokens[parser->position].type == TOKEN_WORD &&
+           parser->tokens[parser->position + 1].type != TOKEN_OPERATOR)
+    {
+        const char *word = parser->tokens[parser->position].text;
+        if (strcmp(word, "time") == 0 && !isTimed)
+        {
+            parser->position++;
+            isTimed = 1;
+        }
+        else if (strcmp(word, "sched") == 0 && placement == NULL)
+        {
+            parser->position++;
+            if ((placement = parsePlacement(parser)) == NULL)
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    struct AstNode *left = parsePipeline(parser);
+    while (left != NULL && (parserPeekOperator(parser) == OP_AND || parserPeekOperator(parser) == OP_OR))
+    {
+        struct AstNode *node = newAstNode(parserPeekOperator(parser) == OP_AND ? NODE_AND : NODE_OR);
+        parser->position++;
+        node->left = left;
+        if ((node->right = parsePipeline(parser)) == NULL)
+        {
+            return NULL;
+        }
+        left = node;
+    }
+    if (left != NULL)
+    {
+        left->isTimed = isTimed;
+        left->placement = placement;
+    }
+    return left;
+}
+
+// list := andOr ((';' | '&') andOr)* [';' | '&']
+struct AstNode *parseList(struct Parser *parser)
+{
+    struct AstNode *list = NULL;
+    while (parser->position < parser->tokenCount)
+    {
+        struct AstNode *item = parseAndOr(parser);
+        if (item == NULL)
+        {
+            return NULL;
+        }
+        if (parserPeekOperator(parser) == OP_BACKGROUND)
+        {
+            struct AstNode *background = newAstNode(NODE_BACKGROUND);
+            background->left = item;
+            item = background;
+            parser->position++;
+        }
+        else if (parserPeekOperator(parser) == OP_SEQUENCE)
+        {
+            parser->position++;
+        }
+        else if (parser->position < parser->tokenCount)
+        {
+            parserSyntaxError(parser);
+            return NULL;
+        }
+
+        if (list == NULL)
+        {
+            list = item;
+        }
+        else
+        {
+            struct AstNode *sequence = newAstNode(NODE_SEQUENCE);
+            sequence->left = list;
+            sequence->right = item;
+            list = sequence;
+        }
+    }
+    return list;
+}
+
+// Builds the parse tree of a whole command line, NULL for an empty line or a syntax error
+struct AstNode *parseLine(struct Token *tokens, int tokenCount)
+{
+    struct Parser parser = {tokens, tokenCount, 0, 0};
+    struct AstNode *tree = parseList(&parser);
+    return parser.isFailed ? NULL : tree;
+}
+
+// Bytes needed to copy a string or an array into one parse cache block, aligned like arenaAlloc
+size_t cacheSize(size_t size)
+{
+    return (size + 15) & ~(size_t)15;
+}
+
+// Takes size bytes from the block being filled by copyTree
+void *cacheTake(char **cursor, size_t size)
+{
+    void *result = *cursor;
+    *cursor += cacheSize(size);
+    return result;
+}
+
+// Bytes copyTree needs for node and everything below it
+size_t measureTree(struct AstNode *node)
+{
+    if (node == NULL)
+    {
+        return 0;
+    }
+    size_t size = cacheSize(sizeof(struct AstNode));
+    if (node->argv != NULL)
+    {
+        size += cacheSize((node->argc + 1) * sizeof(char *));
+        for (int i = 0; i < node->argc; i++)
+        {
+            size += cacheSize(strlen(node->argv[i]) + 1);
+        }
+    }
+    size += cacheSize(node->assignmentCount * sizeof(char *));
+    for (int i = 0; i < node->assignmentCount; i++)
+    {
+        size += cacheSize(strlen(node->assignments[i]) + 1);
+    }
+    for (struct Redirect *redirect = node->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        size += cacheSize(sizeof(struct Redirect)) + cacheSize(strlen(redirect->target) + 1) + cacheSize(redirect->bodyLength);
+    }
+    size += node->placement != NULL ? cacheSize(sizeof(struct Placement)) : 0;
+    size += cacheSize(node->stageCount * sizeof(struct AstNode *));
+    for (int i = 0; i < node->stageCount; i++)
+    {
+        size += measureTree(node->stages[i]);
+    }
+    return size + measureTree(node->left) + measureTree(node->right);
+}
+
+char *copyCacheString(const char *text, char **cursor)
+{
+    return strcpy(cacheTake(cursor, strlen(text) + 1), text);
+}
+
+// Copies node and everything below it into the block at cursor, which measureTree sized
+struct AstNode *copyTree(struct AstNode *node, char **cursor)
+{
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    struct AstNode *copy = cacheTake(cursor, sizeof(struct AstNode));
+    *copy = *node;
+    if (node->argv != NULL)
+    {
+        copy->argv = cacheTake(cursor, (node->argc + 1) * sizeof(char *));
+        for (int i = 0; i < node->argc; i++)
+        {
+            copy->argv[i] = copyCacheString(node->argv[i], cursor);
+        }
+        copy->argv[node->argc] = NULL;
+    }
+    if (node->assignmentCount > 0)
+    {
+        copy->assignments = cacheTake(cursor, node->assignmentCount * sizeof(char *));
+        for (int i = 0; i < node->assignmentCount; i++)
+        {
+            copy->assignments[i] = copyCacheString(node->assignments[i], cursor);
+        }
+    }
+    struct Redirect **link = &copy->redirects;
+    for (struct Redirect *redirect = node->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        *link = cacheTake(cursor, sizeof(struct Redirect));
+        **link = *redirect;
+        (*link)->target = copyCacheString(redirect->target, cursor);
+        if (redirect->body != NULL)
+        {
+            (*link)->body = memcpy(cacheTake(cursor, redirect->bodyLength), redirect->body, redirect->bodyLength);
+        }
+        link = &(*link)->next;
+    }
+    if (node->placement != NULL)
+    {
+        copy->placement = memcpy(cacheTake(cursor, sizeof(struct Placement)), node->placement, sizeof(struct Placement));
+    }
+    if (node->stageCount > 0)
+    {
+        copy->stages = cacheTake(cursor, node->stageCount * sizeof(struct AstNode *));
+        for (int i = 0; i < node->stageCount; i++)
+        {
+            copy->stages[i] = copyTree(node->stages[i], cursor);
+        }
+    }
+    copy->left = copyTree(node->left, cursor);
+    copy->right = copyTree(node->right, cursor);
+    return copy;
+}
+
+// 64 bit FNV-1a over the raw bytes of a command line
+unsigned long long hashLine(const char *line, size_t length)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)line[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Unlinks entry from the least recently used list
+void unlinkParseCacheEntry(struct ParseCacheEntry *entry)
+{
+    *(entry->newer != NULL ? &entry->newer->older : &parseCache.newest) = entry->older;
+    *(entry->older != NULL ? &entry->older->newer : &parseCache.oldest) = entry->newer;
+}
+
+// Puts entry at the most recently used end of the list
+void pushParseCacheEntry(struct ParseCacheEntry *entry)
+{
+    entry->newer = NULL;
+    entry->older = parseCache.newest;
+    *(parseCache.newest != NULL ? &parseCache.newest->newer : &parseCache.oldest) = entry;
+    parseCache.newest = entry;
+}
+
+void removeParseCacheEntry(struct ParseCacheEntry *entry)
+{
+    struct ParseCacheEntry **link = &parseCache.buckets[entry->hash % PARSE_CACHE_BUCKETS];
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    unlinkParseCacheEntry(entry);
+    parseCache.count--;
+    free(entry);
+}
+
+void clearParseCache()
+{
+    while (parseCache.oldest != NULL)
+    {
+        removeParseCacheEntry(parseCache.oldest);
+    }
+}
+
+// Returns the parse tree cached for line, or NULL when it has to be parsed
+struct AstNode *lookupParseCache(const char *line, size_t length, unsigned long long hash)
+{
+    for (struct ParseCacheEntry *entry = parseCache.buckets[hash % PARSE_CACHE_BUCKETS]; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->length == length && memcmp(entry->line, line, length) == 0)
+        {
+            unlinkParseCacheEntry(entry);
+            pushParseCacheEntry(entry);
+            parseCache.hits++;
+            return entry->tree;
+        }
+    }
+    parseCache.misses++;
+    return NULL;
+}
+
+// Keeps a copy of line and its parse tree, dropping the least recently used line when full
+void storeParseCache(const char *line, size_t length, unsigned long long hash, struct AstNode *tree)
+{
+    if (parseCache.capacity <= 0)
+    {
+        return;
+    }
+    if (parseCache.count >= parseCache.capacity)
+    {
+        removeParseCacheEntry(parseCache.oldest);
+        parseCache.evictions++;
+    }
+
+    // The entry, its line and the whole tree share one allocation
+    size_t headerSize = cacheSize(sizeof(struct ParseCacheEntry));
+    struct ParseCacheEntry *entry = malloc(headerSize + cacheSize(length) + measureTree(tree));
+    if (entry == NULL)
+    {
+        return;
+    }
+    char *cursor = (char *)entry + headerSize;
+    entry->line = cacheTake(&cursor, length);
+    memcpy(entry->line, line, length);
+    entry->length = length;
+    entry->hash = hash;
+    entry->tree = copyTree(tree, &cursor);
+    entry->next = parseCache.buckets[hash % PARSE_CACHE_BUCKETS];
+    parseCache.buckets[hash % PARSE_CACHE_BUCKETS] = entry;
+    pushParseCacheEntry(entry);
+    parseCache.count++;
+}
+
+// FNV-1a hash used to pick a bucket for a command name
+unsigned int hashString(const char *text)
+{
+    unsigned int hash = 2166136261u;
+    for (; *text != '\0'; text++)
+    {
+        hash = (hash ^ (unsigned char)*text) * 16777619u;
+    }
+    return hash;
+}
+
+// Drops every remembered command path
+void clearCommandHash()
+{
+    for (int i = 0; i < COMMAND_HASH_BUCKETS; i++)
+    {
+        struct CommandHashEntry *entry = commandHashTable[i];
+        while (entry != NULL)
+        {
+            struct CommandHashEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        commandHashTable[i] = NULL;
+    }
+}
+
+// Forgets the remembered path of a single command, used when exec of that path fails
+void forgetCommandPath(const char *name)
+{
+    struct CommandHashEntry **link = &commandHashTable[hashString(name) % COMMAND_HASH_BUCKETS];
+    while (*link != NULL)
+    {
+        if (strcmp((*link)->name, name) == 0)
+        {
+            struct CommandHashEntry *entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+// Walks PATH looking for an executable regular file called name, returns a malloc'd path or NULL
+char *searchPath(const char *name)
+{
+    const char *pathValue = getenv("PATH");
+    if (pathValue == NULL)
+    {
+        pathValue = "/usr/local/bin:/usr/bin:/bin";
+    }
+    size_t nameLen = strlen(name);
+    const char *dir = pathValue;
+    while (1)
+    {
+        const char *end = strchrnul(dir, ':');
+        size_t dirLen = end - dir;
+        char *candidate = malloc(dirLen + nameLen + 3);
+        if (candidate == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        // An empty PATH entry means the current directory
+        if (dirLen == 0)
+        {
+            candidate[0] = '.';
+            dirLen = 1;
+        }
+        else
+        {
+            memcpy(candidate, dir, dirLen);
+        }
+        candidate[dirLen] = '/';
+        memcpy(candidate + dirLen + 1, name, nameLen + 1);
+
+        struct stat fileStat;
+        if (stat(candidate, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && access(candidate, X_OK) == 0)
+        {
+            return candidate;
+        }
+        free(candidate);
+        if (*end == '\0')
+        {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+// Returns the path that should be exec'd for name, consulting and filling the command hash
+const char *lookupCommandPath(const char *name)
+{
+    // Names with a slash are never searched for
+    if (strchr(name, '/') != NULL)
+    {
+        return name;
+    }
+
+    // Everything remembered is stale once PATH changes
+    const char *pathValue = getenv("PATH");
+    if (pathValue == NULL)
+    {
+        pathValue = "";
+    }
+    if (commandHashPathValue == NULL || strcmp(commandHashPathValue, pathValue) != 0)
+    {
+        clearCommandHash();
+        free(commandHashPathValue);
+        commandHashPathValue = strdup(pathValue);
+    }
+
+    unsigned int bucket = hashString(name) % COMMAND_HASH_BUCKETS;
+    for (struct CommandHashEntry *entry = commandHashTable[bucket]; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->name, name) == 0)
+        {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    char *path = searchPath(name);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    struct CommandHashEntry *entry = malloc(sizeof(struct CommandHashEntry));
+    if (entry == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = commandHashTable[bucket];
+    commandHashTable[bucket] = entry;
+    return path;
+}
+
+// hash builtin: lists remembered commands, remembers the given names or forgets everything with -r
+int hashBuiltin(char *args[], int argc)
+{
+    if (argc == 1)
+    {
+        int printedHeader = 0;
+        for (int i = 0; i < COMMAND_HASH_BUCKETS; i++)
+        {
+            for (struct CommandHashEntry *entry = commandHashTable[i]; entry != NULL; entry = entry->next)
+            {
+                if (!printedHeader)
+                {
+                    printf("hits\tcommand\n");
+                    printedHeader = 1;
+                }
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if (!printedHeader)
+        {
+            printf("hash: hash table empty\n");
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(args[i], "-r") == 0)
+        {
+            clearCommandHash();
+        }
+        else
+        {
+            // Re-resolve the name even if it was already remembered
+            forgetCommandPath(args[i]);
+            if (lookupCommandPath(args[i]) == NULL)
+            {
+                printf("hash: %s: not found\n", args[i]);
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
+
+double nowSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Adds an event to the trace ring, or drops it when the ring is full. Safe from any thread: a
+// slot is claimed by moving head with a compare and swap, and published by its sequence.
+void traceEvent(char phase, const char *category, int tid, double start, double duration, const char *argName,
+                long long value, const char *format, ...)
+{
+    if (!trace.isEnabled)
+    {
+        return;
+    }
+    unsigned long long position = __atomic_load_n(&trace.head, __ATOMIC_RELAXED);
+    struct TraceEvent *event;
+    while (1)
+    {
+        event = &trace.ring[position & (TRACE_RING_SIZE - 1)];
+        long long lag = (long long)(__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag < 0)
+        {
+            __atomic_add_fetch(&trace.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (lag == 0 && __atomic_compare_exchange_n(&trace.head, &position, position + 1, 1, __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED))
+        {
+            break;
+        }
+        if (lag > 0)
+        {
+            position = __atomic_load_n(&trace.head, __ATOMIC_RELAXED);
+        }
+    }
+    event->phase = phase;
+    event->category = category;
+    event->tid = tid;
+    event->start = start;
+    event->duration = duration;
+    event->argName = argName;
+    event->value = value;
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(event->name, sizeof(event->name), format, arguments);
+    va_end(arguments);
+    __atomic_store_n(&event->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+// Writes what the flusher collected
+void writeTraceOutput()
+{
+    for (size_t written = 0; written < trace.outputLength;)
+    {
+        ssize_t result = write(trace.fd, trace.output + written, trace.outputLength - written);
+        if (result == -1 && errno != EINTR)
+        {
+            break;
+        }
+        written += result > 0 ? result : 0;
+    }
+    trace.outputLength = 0;
+}
+
+// Appends one event as a line of JSON, the name escaped as a JSON string. The process name comes
+// first in the file, so every event starts with the comma that separates it from the one before.
+void appendTraceJson(const struct TraceEvent *event)
+{
+    if (TRACE_OUTPUT_SIZE - trace.outputLength < 8 * TRACE_NAME_LENGTH + 256)
+    {
+        writeTraceOutput();
+    }
+    char *out = trace.output + trace.outputLength;
+    out += sprintf(out, ",\n{\"name\":\"");
+    for (const char *p = event->name; *p != '\0'; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            *out++ = '\\';
+            *out++ = *p;
+        }
+        else if ((unsigned char)*p < 0x20)
+        {
+            out += sprintf(out, "\\u%04x", (unsigned char)*p);
+        }
+        else
+        {
+            *out++ = *p;
+        }
+    }
+    out += sprintf(out, "\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d", event->category,
+                   event->phase, (event->start - trace.origin) * 1e6, trace.pid, event->tid);
+    if (event->phase == 'X')
+    {
+        out += sprintf(out, ",\"dur\":%.3f", event->duration * 1e6);
+    }
+    else if (event->phase == 'i')
+    {
+        out += sprintf(out, ",\"s\":\"t\"");
+    }
+    if (event->argName != NULL)
+    {
+        out += sprintf(out, ",\"args\":{\"%s\":%lld}", event->argName, event->value);
+    }
+    *out++ = '}';
+    trace.outputLength = out - trace.output;
+}
+
+// Moves every published event from the ring into the output and writes it. Only the flusher and,
+// once it ended, finishTrace call this.
+void drainTrace()
+{
+    while (1)
+    {
+        struct TraceEvent *event = &trace.ring[trace.tail & (TRACE_RING_SIZE - 1)];
+        if (__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) != trace.tail + 1)
+        {
+            break;
+        }
+        appendTraceJson(event);
+        // The slot is free again for the writer one lap ahead
+        __atomic_store_n(&event->sequence, trace.tail + TRACE_RING_SIZE, __ATOMIC_RELEASE);
+        trace.tail++;
+    }
+    writeTraceOutput();
+}
+
+void *traceFlusherThread(void *argument)
+{
+    (void)argument;
+    struct timespec interval = {0, TRACE_FLUSH_INTERVAL_NS};
+    while (!__atomic_load_n(&trace.isStopping, __ATOMIC_ACQUIRE))
+    {
+        drainTrace();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// A forked child has a copy of the ring but no flusher, whatever it would add is never written
+void traceAfterFork()
+{
+    trace.isEnabled = 0;
+}
+
+// Registered with atexit: the flusher writes what is left and the JSON array is closed
+void finishTrace()
+{
+    if (!trace.isEnabled)
+    {
+        return;
+    }
+    __atomic_store_n(&trace.isStopping, 1, __ATOMIC_RELEASE);
+    pthread_join(trace.flusher, NULL);
+    unsigned long long dropped = __atomic_load_n(&trace.dropped, __ATOMIC_RELAXED);
+    if (dropped > 0)
+    {
+        traceEvent('i', "trace", trace.pid, nowSeconds(), 0, "dropped", dropped, "events dropped");
+    }
+    trace.isEnabled = 0;
+    drainTrace();
+    if (write(trace.fd, "\n]\n", 3) == -1)
+    {
+        perror("SHELL24_TRACE");
+    }
+    close(trace.fd);
+}
+
+// SHELL24_TRACE=file records the shell's work in Chrome trace format, for chrome://tracing or
+// Perfetto: parsing and running every line, exec, fork, the exit of every child, waiting, pipes
+// and redirections
+void initTrace()
+{
+    const char *path = getenv("SHELL24_TRACE");
+    if (path == NULL || path[0] == '\0')
+    {
+        return;
+    }
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace.fd == -1)
+    {
+        perror(path);
+        return;
+    }
+    trace.ring = malloc(TRACE_RING_SIZE * sizeof(struct TraceEvent));
+    trace.output = malloc(TRACE_OUTPUT_SIZE);
+    for (unsigned long long i = 0; i < TRACE_RING_SIZE; i++)
+    {
+        trace.ring[i].sequence = i;
+    }
+    trace.pid = getpid();
+    trace.origin = nowSeconds();
+    trace.outputLength = sprintf(trace.output, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                                 "\"args\":{\"name\":\"shell24\"}}", trace.pid);
+
+    // Signals stay with the shell's own thread
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int error = pthread_create(&trace.flusher, NULL, traceFlusherThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (error != 0)
+    {
+        errno = error;
+        perror("SHELL24_TRACE");
+        close(trace.fd);
+        return;
+    }
+    trace.isEnabled = 1;
+    pthread_atfork(NULL, NULL, traceAfterFork);
+    atexit(finishTrace);
+}
+
+// Reads a number from a file of /sys, -1 if it is not there
+int readSysNumber(const char *path)
+{
+    char text[32];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t length = fd == -1 ? -1 : read(fd, text, sizeof(text) - 1);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (length <= 0)
+    {
+        return -1;
+    }
+    text[length] = '\0';
+    return atoi(text);
+}
+
+// Socket, core and hyperthread of one CPU, for ordering a spread placement
+struct CpuPosition
+{
+    int cpu;
+    int package;
+    int thread; // 0 for the first CPU of its core, 1 for its sibling and so on
+    int core;
+};
+
+int compareCpuPositions(const void *a, const void *b)
+{
+    const struct CpuPosition *left = a;
+    const struct CpuPosition *right = b;
+    if (left->package != right->package)
+    {
+        return left->package - right->package;
+    }
+    if (left->thread != right->thread)
+    {
+        return left->thread - right->thread;
+    }
+    return left->core != right->core ? left->core - right->core : left->cpu - right->cpu;
+}
+
+// Orders the CPUs of placement, or all the shell may use if it names none, so that the next CPU
+// is always the closest core not used yet: every core of a socket before its hyperthreads, and
+// a whole socket before the next one. Adjacent pipeline stages then share a socket's cache.
+void orderSpreadCpus(struct Placement *placement)
+{
+    cpu_set_t cpus = placement->cpus;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        if (CPU_COUNT(&cpus) == 0)
+        {
+            cpus = allowed;
+        }
+        CPU_AND(&cpus, &cpus, &allowed);
+    }
+    static struct CpuPosition positions[CPU_SETSIZE];
+    spreadCount = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &cpus))
+        {
+            continue;
+        }
+        char path[128];
+        struct CpuPosition *position = &positions[spreadCount++];
+        position->cpu = cpu;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        position->package = readSysNumber(path);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        position->core = readSysNumber(path);
+        position->thread = 0;
+        for (int i = 0; i + 1 < spreadCount; i++)
+        {
+            position->thread += positions[i].package == position->package && positions[i].core == position->core;
+        }
+    }
+    qsort(positions, spreadCount, sizeof(struct CpuPosition), compareCpuPositions);
+    for (int i = 0; i < spreadCount; i++)
+    {
+        spreadOrder[i] = positions[i].cpu;
+    }
+}
+
+// Applies placement to the calling thread, which passes it on to the processes it starts. index
+// counts the processes placed before this one and picks the CPU of a spread placement.
+void applyPlacement(const struct Placement *placement, int index)
+{
+    cpu_set_t cpus = placement->cpus;
+    if (placement->isSpread && spreadCount > 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(spreadOrder[index % spreadCount], &cpus);
+    }
+    if (CPU_COUNT(&cpus) > 0 && sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+    {
+        perror("sched: CPUs");
+    }
+    if (placement->nodes != 0 &&
+        syscall(SYS_set_mempolicy, PLACEMENT_MPOL_BIND, &placement->nodes, PLACEMENT_MAX_NODES + 1) == -1)
+    {
+        perror("sched: memory nodes");
+    }
+    // On Linux the nice value and I/O priority of who 0 belong to the calling thread only
+    if (placement->isNiceSet)
+    {
+        errno = 0;
+        int nice = getpriority(PRIO_PROCESS, 0);
+        if (errno != 0 || setpriority(PRIO_PROCESS, 0, nice + placement->nice) == -1)
+        {
+            perror("sched: nice");
+        }
+    }
+    if (placement->ioClass != 0 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, placement->ioClass << IOPRIO_CLASS_SHIFT | placement->ioLevel) == -1)
+    {
+        perror("sched: I/O priority");
+    }
+}
+
+// A posix_spawn done by a thread of its own
+struct PlacedSpawn
+{
+    pid_t *pid;
+    const char *path;
+    struct SpawnOptions *options;
+    char **args;
+    char **envp;
+    int error;
+};
+
+void *placedSpawnThread(void *argument)
+{
+    struct PlacedSpawn *spawn = argument;
+    applyPlacement(activePlacement, placementIndex);
+    spawn->error = posix_spawn(spawn->pid, spawn->path, &spawn->options->fileActions, &spawn->options->attributes,
+                               spawn->args, spawn->envp);
+    return NULL;
+}
+
+// posix_spawn that applies activePlacement to the child before it execs. A child inherits
+// affinity, memory policy, nice value and I/O priority from the thread that creates it, so a
+// short lived thread takes them on and spawns. The shell's own thread keeps its settings, and
+// none of them has to be given back, which a raised nice value could not be without privilege.
+int placedSpawn(pid_t *pid, const char *path, struct SpawnOptions *options, char *args[], char **envp)
+{
+    if (activePlacement == NULL)
+    {
+        return posix_spawn(pid, path, &options->fileActions, &options->attributes, args, envp);
+    }
+    struct PlacedSpawn spawn = {pid, path, options, args, envp, 0};
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, placedSpawnThread, &spawn);
+    if (error != 0)
+    {
+        return error;
+    }
+    pthread_join(thread, NULL);
+    return spawn.error;
+}
+
+// Prepares the spawn options with the signal state every child should start with
+void initSpawnOptions(struct SpawnOptions *options)
+{
+    options->envp = NULL;
+    posix_spawn_file_actions_init(&options->fileActions);
+    posix_spawnattr_init(&options->attributes);
+
+    // The child starts with nothing blocked and with default handling for the signals the shell
+    // catches or ignores itself
+    sigset_t signalSet;
+    sigemptyset(&signalSet);
+    posix_spawnattr_setsigmask(&options->attributes, &signalSet);
+    sigaddset(&signalSet, SIGINT);
+    sigaddset(&signalSet, SIGQUIT);
+    sigaddset(&signalSet, SIGTSTP);
+    sigaddset(&signalSet, SIGTTIN);
+    sigaddset(&signalSet, SIGTTOU);
+    sigaddset(&signalSet, SIGPIPE);
+    sigaddset(&signalSet, SIGCHLD);
+    posix_spawnattr_setsigdefault(&options->attributes, &signalSet);
+
+    options->flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_USEVFORK;
+}
+
+void destroySpawnOptions(struct SpawnOptions *options)
+{
+    posix_spawn_file_actions_destroy(&options->fileActions);
+    posix_spawnattr_destroy(&options->attributes);
+}
+
+// Makes fromFd available as toFd in the child
+void spawnDup(struct SpawnOptions *options, int fromFd, int toFd)
+{
+    posix_spawn_file_actions_adddup2(&options->fileActions, fromFd, toFd);
+}
+
+void spawnClose(struct SpawnOptions *options, int fd)
+{
+    posix_spawn_file_actions_addclose(&options->fileActions, fd);
+}
+
+// Puts the child in process group pgid, 0 makes the child the leader of a new group
+void spawnSetProcessGroup(struct SpawnOptions *options, pid_t pgid)
+{
+    posix_spawnattr_setpgroup(&options->attributes, pgid);
+    options->flags |= POSIX_SPAWN_SETPGROUP;
+}
+
+// Launches args[0] with the given options. Returns the child pid, or minus the status sh gives a
+// command it cannot run: -127 when it is not found, -126 when it is found but cannot be executed.
+pid_t spawnCommand(char *args[], struct SpawnOptions *options)
+{
+    pid_t pid;
+    posix_spawnattr_setflags(&options->attributes, options->flags);
+
+    // Exec the hashed absolute path directly instead of letting exec walk PATH
+    double start = nowSeconds();
+    const char *path = lookupCommandPath(args[0]);
+    char **envp = options->envp != NULL ? options->envp : environ;
+    int error = ENOENT;
+    if (path != NULL)
+    {
+        error = placedSpawn(&pid, path, options, args, envp);
+        if (error != 0 && error != ENOEXEC && path != args[0])
+        {
+            // The remembered binary may have moved or been removed, search PATH once more
+            forgetCommandPath(args[0]);
+            path = lookupCommandPath(args[0]);
+            if (path != NULL)
+            {
+                error = placedSpawn(&pid, path, options, args, envp);
+                if (error != 0 && error != ENOEXEC)
+                {
+                    forgetCommandPath(args[0]);
+                }
+            }
+        }
+    }
+    if (error == ENOEXEC)
+    {
+        // An executable file without #! is a script for sh, as execvp does it
+        int argc = 0;
+        while (args[argc] != NULL)
+        {
+            argc++;
+        }
+        char **shellArgs = arenaAlloc(&lineArena, (argc + 2) * sizeof(char *));
+        shellArgs[0] = "/bin/sh";
+        shellArgs[1] = (char *)path;
+        memcpy(shellArgs + 2, args + 1, argc * sizeof(char *));
+        error = placedSpawn(&pid, "/bin/sh", options, shellArgs, envp);
+    }
+    // posix_spawn returns once the child has exec'd, so this is the whole cost of starting it
+    traceEvent('X', "exec", trace.pid, start, nowSeconds() - start, error != 0 ? "errno" : "pid", error != 0 ? error : pid,
+               "exec %s", args[0]);
+    if (error != 0)
+    {
+        errno = error;
+        perror(args[0]);
+        return error == EACCES || error == ENOEXEC ? -126 : -127;
+    }
+    traceEvent('B', "process", pid, start, 0, NULL, 0, "%s", args[0]);
+    placementIndex += activePlacement != NULL;
+    return pid;
+}
+
+// Copies everything left in inFd to outFd, letting the kernel move the data whenever it can.
+// copy_file_range is tried between regular files, sendfile from a regular file to anything,
+// splice when a pipe is involved, and plain read/write only as the last resort.
+int streamFile(int inFd, int outFd)
+{
+    struct stat inStat;
+    struct stat outStat;
+    if (fstat(inFd, &inStat) == -1 || fstat(outFd, &outStat) == -1)
+    {
+        return -1;
+    }
+    int useCopyRange = S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode);
+    int useSendfile = S_ISREG(inStat.st_mode);
+    int useSplice = S_ISFIFO(inStat.st_mode) || S_ISFIFO(outStat.st_mode);
+    char *buffer = NULL;
+
+    while (1)
+    {
+        ssize_t copied;
+        if (useCopyRange)
+        {
+            copied = copy_file_range(inFd, NULL, outFd, NULL, STREAM_CHUNK_SIZE, 0);
+            if (copied == -1 && errno != EINTR)
+            {
+                // Not supported for this pair of files, nothing was copied so fall through
+                useCopyRange = 0;
+                continue;
+            }
+        }
+        else if (useSendfile)
+        {
+            copied = sendfile(outFd, inFd, NULL, STREAM_CHUNK_SIZE);
+            if (copied == -1 && (errno == EINVAL || errno == ENOSYS))
+            {
+                useSendfile = 0;
+                continue;
+            }
+        }
+        else if (useSplice)
+        {
+            copied = splice(inFd, NULL, outFd, NULL, STREAM_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (copied == -1 && (errno == EINVAL || errno == ENOSYS))
+            {
+                useSplice = 0;
+                continue;
+            }
+        }
+        else
+        {
+            if (buffer == NULL && (buffer = malloc(STREAM_BUFFER_SIZE)) == NULL)
+            {
+                return -1;
+            }
+            copied = read(inFd, buffer, STREAM_BUFFER_SIZE);
+            for (ssize_t written = 0; copied > 0 && written < copied;)
+            {
+                ssize_t result = write(outFd, buffer + written, copied - written);
+                if (result == -1 && errno != EINTR)
+                {
+                    free(buffer);
+                    return -1;
+                }
+                written += result > 0 ? result : 0;
+            }
+        }
+
+        if (copied == 0)
+        {
+            free(buffer);
+            return 0;
+        }
+        if (copied == -1 && errno != EINTR)
+        {
+            free(buffer);
+            return -1;
+        }
+    }
+}
+
+// Opens a file that is about to be concatenated and asks the kernel to start reading it ahead
+int openForStreaming(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+    return fd;
+}
+
+// Streams the given files one after another into outFd, separated by a space.
+// While one file is being copied the next one is already open and being read ahead.
+int concatenateFiles(char **paths, int pathCount, int outFd)
+{
+    // Report a missing file before anything has been written, as the old temp file did
+    for (int i = 0; i < pathCount; i++)
+    {
+        if (access(paths[i], R_OK) == -1)
+        {
+            printf("Failed to open input file %s\n", paths[i]);
+            return 1;
+        }
+    }
+
+    // Anything still sitting in stdio's buffer has to reach the fd before the file contents
+    fflush(stdout);
+
+    int nextFd = openForStreaming(paths[0]);
+    for (int i = 0; i < pathCount; i++)
+    {
+        int inputFd = nextFd;
+        if (inputFd == -1)
+        {
+            printf("Failed to open input file %s\n", paths[i]);
+            return 1;
+        }
+        nextFd = (i + 1 < pathCount) ? openForStreaming(paths[i + 1]) : -1;
+
+        if (streamFile(inputFd, outFd) == -1)
+        {
+            perror(paths[i]);
+            close(inputFd);
+            if (nextFd != -1)
+            {
+                close(nextFd);
+            }
+            return 1;
+        }
+        close(inputFd);
+
+        if (i != pathCount - 1 && write(outFd, " ", 1) != 1)
+        {
+            perror("write");
+            if (nextFd != -1)
+            {
+                close(nextFd);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Writes a word with its substitutions spelled as $(...) again
+void formatWord(FILE *out, const char *word)
+{
+    for (const char *p = word; *p != '\0'; p++)
+    {
+        if (*p == EXPANSION_START)
+        {
+            int isQuoted = p[1] == 'C' || p[1] == 'V';
+            int isVariable = p[1] == 'v' || p[1] == 'V';
+            fputs(isQuoted ? "\"" : "", out);
+            fputs(isVariable ? "${" : "$(", out);
+            const char *close = strchr(p, EXPANSION_END);
+            fwrite(p + 2, 1, close - p - 2, out);
+            fputs(isVariable ? "}" : ")", out);
+            fputs(isQuoted ? "\"" : "", out);
+            p = close;
+        }
+        else if (*p == GLOB_ESCAPE)
+        {
+            continue;
+        }
+        else
+        {
+            fputc(*p, out);
+        }
+    }
+}
+
+// Writes node back out as command text, used to show jobs
+void formatNode(FILE *out, struct AstNode *node)
+{
+    switch (node->type)
+    {
+    case NODE_COMMAND:
+    case NODE_CONCAT:
+        for (int i = 0; i < node->assignmentCount; i++)
+        {
+            formatWord(out, node->assignments[i]);
+            fputs(i + 1 < node->assignmentCount || node->argc > 0 ? " " : "", out);
+        }
+        for (int i = 0; i < node->argc; i++)
+        {
+            fputs(i == 0 ? "" : (node->type == NODE_CONCAT ? " # " : " "), out);
+            formatWord(out, node->argv[i]);
+        }
+        for (struct Redirect *redirect = node->redirects; redirect != NULL; redirect = redirect->next)
+        {
+            // The descriptor is only written when it is not the one the operator implies
+            fputc(' ', out);
+            if (redirect->fd != (isInputRedirect(redirect->op) ? STDIN_FILENO : STDOUT_FILENO))
+            {
+                fprintf(out, "%d", redirect->fd);
+            }
+            int isWordOperator = redirect->op == OP_DUP_OUT || redirect->op == OP_DUP_IN;
+            fprintf(out, isWordOperator ? "%s" : "%s ", operatorText[redirect->op]);
+            formatWord(out, redirect->target);
+        }
+        break;
+    case NODE_PIPELINE:
+        for (int i = 0; i < node->stageCount; i++)
+        {
+            fputs(i == 0 ? "" : " | ", out);
+            formatNode(out, node->stages[i]);
+        }
+        break;
+    case NODE_AND:
+    case NODE_OR:
+    case NODE_SEQUENCE:
+        formatNode(out, node->left);
+        fputs(node->type == NODE_AND ? " && " : (node->type == NODE_OR ? " || " : "; "), out);
+        formatNode(out, node->right);
+        break;
+    case NODE_BACKGROUND:
+        formatNode(out, node->left);
+        fputs(" &", out);
+        break;
+    }
+}
+
+// Returns a malloc'd copy of the stages as command text
+char *formatStages(struct AstNode **stages, int stageCount)
+{
+    char *text = NULL;
+    size_t textLength = 0;
+    FILE *out = open_memstream(&text, &textLength);
+    for (int i = 0; i < stageCount; i++)
+    {
+        fputs(i == 0 ? "" : " | ", out);
+        formatNode(out, stages[i]);
+    }
+    fclose(out);
+    return text;
+}
+
+// Fills job in for the given processes, a pid of -1 is a stage that could not be started
+void initJob(struct Job *job, pid_t *pids, int processCount, pid_t pgid)
+{
+    memset(job, 0, sizeof(struct Job));
+    job->pids = pids;
+    job->processCount = processCount;
+    job->pgid = pgid;
+    job->state = JOB_RUNNING;
+    for (int i = 0; i < processCount; i++)
+    {
+        if (pids[i] > 0)
+        {
+            job->remaining++;
+        }
+        else
+        {
+            // A last stage that never started decides the status like sh does, 126 for a program
+            // that is there but cannot be run
+            job->status = pids[i] < -1 ? -pids[i] : 127;
+            pids[i] = 0;
+        }
+    }
+}
+
+// Moves a job into the job table, copying its pids so it can outlive the caller
+struct Job *addJob(struct Job *job, char *commandText)
+{
+    if (jobCount == jobCapacity)
+    {
+        jobCapacity = jobCapacity == 0 ? 16 : jobCapacity * 2;
+        jobTable = realloc(jobTable, jobCapacity * sizeof(struct Job *));
+        if (jobTable == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct Job *added = malloc(sizeof(struct Job));
+    pid_t *pids = malloc(job->processCount * sizeof(pid_t));
+    if (added == NULL || pids == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    *added = *job;
+    memcpy(pids, job->pids, job->processCount * sizeof(pid_t));
+    added->pids = pids;
+    added->commandText = commandText;
+
+    // Job numbers keep counting up from the newest job, like sh
+    added->id = jobCount > 0 ? jobTable[jobCount - 1]->id + 1 : 1;
+    jobTable[jobCount++] = added;
+    return added;
+}
+
+void removeJob(struct Job *job)
+{
+    for (int i = 0; i < jobCount; i++)
+    {
+        if (jobTable[i] == job)
+        {
+            memmove(&jobTable[i], &jobTable[i + 1], (jobCount - i - 1) * sizeof(struct Job *));
+            jobCount--;
+            break;
+        }
+    }
+    free(job->pids);
+    free(job->commandText);
+    free(job);
+}
+
+// Finds a job from %n, %+ or %%, or the newest job when spec is NULL
+struct Job *findJob(const char *spec)
+{
+    if (jobCount == 0)
+    {
+        return NULL;
+    }
+    if (spec == NULL || strcmp(spec, "%+") == 0 || strcmp(spec, "%%") == 0)
+    {
+        return jobTable[jobCount - 1];
+    }
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int i = 0; i < jobCount; i++)
+    {
+        if (jobTable[i]->id == id)
+        {
+            return jobTable[i];
+        }
+    }
+    return NULL;
+}
+
+// Converts a wait status to the exit status the shell reports
+int decodeStatus(int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSTOPPED(status))
+    {
+        return 128 + WSTOPSIG(status);
+    }
+    return 128 + WTERMSIG(status);
+}
+
+// Collects every state change of the job's processes without blocking
+void updateJob(struct Job *job)
+{
+    for (int i = 0; i < job->processCount; i++)
+    {
+        if (job->pids[i] == 0)
+        {
+            continue;
+        }
+        int status;
+        struct rusage usage;
+        pid_t result = wait4(job->pids[i], &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+        if (result <= 0)
+        {
+            continue;
+        }
+        if (WIFSTOPPED(status))
+        {
+            job->state = JOB_STOPPED;
+            job->stopSignal = WSTOPSIG(status);
+            job->isChanged = 1;
+            traceEvent('i', "process", result, nowSeconds(), 0, "signal", WSTOPSIG(status), "stopped");
+        }
+        else if (WIFCONTINUED(status))
+        {
+            job->state = JOB_RUNNING;
+        }
+        else
+        {
+            job->pids[i] = 0;
+            job->remaining--;
+            traceEvent('E', "process", result, nowSeconds(), 0, "status", decodeStatus(status), "exit");
+            if (job->usage != NULL)
+            {
+                job->usage[i].end = nowSeconds();
+                job->usage[i].usage = usage;
+            }
+            if (i == job->processCount - 1)
+            {
+                job->status = decodeStatus(status);
+                job->isSignaled = WIFSIGNALED(status);
+            }
+            if (job->remaining == 0)
+            {
+                job->state = JOB_DONE;
+                job->isChanged = 1;
+            }
+        }
+    }
+}
+
+void updateAllJobs()
+{
+    for (int i = 0; i < jobCount; i++)
+    {
+        updateJob(jobTable[i]);
+    }
+}
+
+// Blocks until a child changed state or, with isWatchingInput, until stdin has a line.
+// Returns a mask of JOB_EVENT_CHILD and JOB_EVENT_INPUT.
+struct Session *findSessionByFd(int fd);
+int readSession(struct Session *session, int outFd);
+
+int waitForEvents(int isWatchingInput)
+{
+    struct epoll_event input = {EPOLLIN, {.fd = STDIN_FILENO}};
+    if (isWatchingInput)
+    {
+        epoll_ctl(jobEpollFd, EPOLL_CTL_ADD, STDIN_FILENO, &input);
+    }
+
+    int events = 0;
+    while (events == 0)
+    {
+        struct epoll_event ready[16];
+        int readyCount = epoll_wait(jobEpollFd, ready, 16, -1);
+        if (readyCount == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < readyCount; i++)
+        {
+            if (ready[i].data.fd == childSignalFd)
+            {
+                // Drain the queued SIGCHLDs, the children are collected by updateJob
+                struct signalfd_siginfo info;
+                while (read(childSignalFd, &info, sizeof(info)) == sizeof(info))
+                {
+                }
+                events |= JOB_EVENT_CHILD;
+            }
+            else if (ready[i].data.fd == STDIN_FILENO)
+            {
+                events |= JOB_EVENT_INPUT;
+            }
+            else
+            {
+                // Output of a detached session is kept until it is attached again
+                readSession(findSessionByFd(ready[i].data.fd), -1);
+            }
+        }
+    }
+
+    if (isWatchingInput)
+    {
+        epoll_ctl(jobEpollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    }
+    return events;
+}
+
+// Sends sig to every live process of the job
+void signalJob(struct Job *job, int sig)
+{
+    if (job->pgid > 0)
+    {
+        kill(-job->pgid, sig);
+        return;
+    }
+    for (int i = 0; i < job->processCount; i++)
+    {
+        if (job->pids[i] > 0)
+        {
+            kill(job->pids[i], sig);
+        }
+    }
+}
+
+// Waits until every process of the job has exited or one of them stopped. Returns the status
+// of the last process, or 128 + the stop signal for a stopped job. Background jobs that finish
+// in the meantime are collected as well.
+int waitForJob(struct Job *job)
+{
+    while (1)
+    {
+        updateJob(job);
+        if (job->state == JOB_DONE || job->remaining == 0)
+        {
+            job->state = JOB_DONE;
+            return job->status;
+        }
+        if (job->state == JOB_STOPPED && job->pgid > 0 && isInteractive && tcgetpgrp(STDIN_FILENO) == job->pgid &&
+            (job->stopSignal == SIGTTIN || job->stopSignal == SIGTTOU))
+        {
+            // It touched the terminal before the shell handed it over, now it may go on
+            signalJob(job, SIGCONT);
+            job->state = JOB_RUNNING;
+            job->isChanged = 0;
+            continue;
+        }
+        if (job->state == JOB_STOPPED)
+        {
+            return 128 + job->stopSignal;
+        }
+        waitForEvents(0);
+        updateAllJobs();
+    }
+}
+
+// Describes the state of a job the way jobs prints it
+void formatJobState(struct Job *job, char *text, size_t size)
+{
+    if (job->state == JOB_RUNNING)
+    {
+        snprintf(text, size, "Running");
+    }
+    else if (job->state == JOB_STOPPED)
+    {
+        snprintf(text, size, "Stopped");
+    }
+    else if (job->isSignaled)
+    {
+        snprintf(text, size, "%s", strsignal(job->status - 128));
+    }
+    else if (job->status != 0)
+    {
+        snprintf(text, size, "Exit %d", job->status);
+    }
+    else
+    {
+        snprintf(text, size, "Done");
+    }
+}
+
+void printJob(struct Job *job)
+{
+    char stateText[64];
+    formatJobState(job, stateText, sizeof(stateText));
+    printf("[%d]%c  %-24s %s\n", job->id, job == jobTable[jobCount - 1] ? '+' : ' ', stateText, job->commandText);
+}
+
+// Prints every job that finished or stopped since the last report and forgets finished ones.
+// Returns the number of jobs printed.
+int reportJobs(int isAtPrompt)
+{
+    int reported = 0;
+    for (int i = 0; i < jobCount; i++)
+    {
+        struct Job *job = jobTable[i];
+        if (!job->isChanged)
+        {
+            continue;
+        }
+        if (isAtPrompt && reported == 0)
+        {
+            printf("\n");
+        }
+        printJob(job);
+        job->isChanged = 0;
+        reported++;
+        if (job->state == JOB_DONE)
+        {
+            removeJob(job);
+            i--;
+        }
+    }
+    return reported;
+}
+
+// Sets up SIGCHLD delivery through a signalfd watched by epoll. A forked subshell calls this
+// again to get its own descriptors and an empty job table.
+void initJobControl()
+{
+    if (jobEpollFd != -1)
+    {
+        close(jobEpollFd);
+        close(childSignalFd);
+    }
+    jobCount = 0;
+
+    sigset_t childSignal;
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, NULL);
+    childSignalFd = signalfd(-1, &childSignal, SFD_NONBLOCK | SFD_CLOEXEC);
+    jobEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (childSignalFd == -1 || jobEpollFd == -1)
+    {
+        perror("job control");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event childEvent = {EPOLLIN, {.fd = childSignalFd}};
+    epoll_ctl(jobEpollFd, EPOLL_CTL_ADD, childSignalFd, &childEvent);
+}
+
+// Undoes the shell's own signal setup in a forked child that keeps running shell code
+void resetChildSignals()
+{
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    sigset_t childSignal;
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &childSignal, NULL);
+}
+
+// Closes the descriptors a filter stage owns: its files and both of its pipe ends
+void closeFilterFds(struct FilterStage *stage)
+{
+    for (int i = 0; i < stage->fdCount; i++)
+    {
+        if (stage->fds[i] >= 0)
+        {
+            close(stage->fds[i]);
+        }
+    }
+    if (stage->inFd != STDIN_FILENO)
+    {
+        close(stage->inFd);
+    }
+    if (stage->outFd != STDOUT_FILENO)
+    {
+        close(stage->outFd);
+    }
+}
+
+// A child forked while a pipeline is started must not hold the pipe ends of its filter stages,
+// a write end kept open there would keep the reader of that pipe from ever seeing its end
+void closePendingFilters()
+{
+    for (int i = 0; i < pendingFilterCount; i++)
+    {
+        if (pendingFilters[i] != NULL)
+        {
+            closeFilterFds(pendingFilters[i]);
+        }
+    }
+    pendingFilterCount = 0;
+}
+
+// Gives the terminal to a job's process group, or back to the shell when pgid is 0
+void giveTerminalTo(pid_t pgid)
+{
+    if (isInteractive)
+    {
+        tcsetpgrp(STDIN_FILENO, pgid != 0 ? pgid : getpgrp());
+    }
+}
+
+// Runs a job from the table in the foreground until it exits or stops again
+int foregroundJob(struct Job *job, int isContinued)
+{
+    if (job->pgid > 0)
+    {
+        giveTerminalTo(job->pgid);
+        foregroundPgid = job->pgid;
+    }
+    // The job only continues once it owns the terminal, otherwise a read would stop it again
+    if (isContinued)
+    {
+        signalJob(job, SIGCONT);
+    }
+    job->state = JOB_RUNNING;
+    int status = waitForJob(job);
+    foregroundPgid = 0;
+    if (job->pgid > 0)
+    {
+        giveTerminalTo(0);
+    }
+
+    if (job->state == JOB_STOPPED)
+    {
+        printf("\n");
+        printJob(job);
+        job->isChanged = 0;
+    }
+    else
+    {
+        removeJob(job);
+    }
+    return status;
+}
+
+// Finds the session whose pty master is fd, NULL if fd is not one
+struct Session *findSessionByFd(int fd)
+{
+    for (int i = 0; i < sessionCount; i++)
+    {
+        if (sessionTable[i]->masterFd == fd)
+        {
+            return sessionTable[i];
+        }
+    }
+    return NULL;
+}
+
+// Finds a session by number, or the newest one when spec is NULL
+struct Session *findSession(const char *spec)
+{
+    if (spec == NULL)
+    {
+        return sessionCount > 0 ? sessionTable[sessionCount - 1] : NULL;
+    }
+    int id = atoi(spec);
+    for (int i = 0; i < sessionCount; i++)
+    {
+        if (sessionTable[i]->id == id)
+        {
+            return sessionTable[i];
+        }
+    }
+    return NULL;
+}
+
+void removeSession(struct Session *session)
+{
+    for (int i = 0; i < sessionCount; i++)
+    {
+        if (sessionTable[i] == session)
+        {
+            memmove(&sessionTable[i], &sessionTable[i + 1], (sessionCount - i - 1) * sizeof(struct Session *));
+            sessionCount--;
+            break;
+        }
+    }
+    if (session->masterFd != -1)
+    {
+        epoll_ctl(jobEpollFd, EPOLL_CTL_DEL, session->masterFd, NULL);
+        close(session->masterFd);
+    }
+    free(session->buffer);
+    free(session);
+}
+
+// Keeps output of a detached session, dropping the oldest bytes once SESSION_BUFFER_SIZE is full
+void bufferSessionOutput(struct Session *session, const char *data, size_t length)
+{
+    if (session->buffer == NULL && (session->buffer = malloc(SESSION_BUFFER_SIZE)) == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        if (session->bufferLength == SESSION_BUFFER_SIZE)
+        {
+            session->bufferStart = (session->bufferStart + 1) % SESSION_BUFFER_SIZE;
+            session->bufferLength--;
+            session->droppedBytes++;
+        }
+        session->buffer[(session->bufferStart + session->bufferLength++) % SESSION_BUFFER_SIZE] = data[i];
+    }
+}
+
+// Reads what the session wrote to its terminal, into outFd when it is attached and into its
+// buffer otherwise. Returns -1 once every process of the session closed the terminal.
+int readSession(struct Session *session, int outFd)
+{
+    char data[4096];
+    ssize_t length = read(session->masterFd, data, sizeof(data));
+    if (length == -1 && (errno == EINTR || errno == EAGAIN))
+    {
+        return 0;
+    }
+    if (length <= 0)
+    {
+        // EIO on a pty master means the other side is gone
+        epoll_ctl(jobEpollFd, EPOLL_CTL_DEL, session->masterFd, NULL);
+        close(session->masterFd);
+        session->masterFd = -1;
+        session->isChanged = 1;
+        return -1;
+    }
+    if (outFd != -1)
+    {
+        for (ssize_t written = 0; written < length;)
+        {
+            ssize_t result = write(outFd, data + written, length - written);
+            if (result == -1 && errno != EINTR)
+            {
+                break;
+            }
+            written += result > 0 ? result : 0;
+        }
+    }
+    else
+    {
+        bufferSessionOutput(session, data, length);
+    }
+    return length;
+}
+
+// Collects sessions whose shell exited
+void updateSessions()
+{
+    for (int i = 0; i < sessionCount; i++)
+    {
+        struct Session *session = sessionTable[i];
+        int status;
+        if (session->pid != 0 && waitpid(session->pid, &status, WNOHANG) == session->pid)
+        {
+            session->pid = 0;
+            session->status = decodeStatus(status);
+            session->isChanged = 1;
+        }
+    }
+}
+
+// Tells about sessions that ended and forgets them, returns how many there were
+int reportSessions(int isAtPrompt)
+{
+    int reported = 0;
+    for (int i = 0; i < sessionCount; i++)
+    {
+        struct Session *session = sessionTable[i];
+        if (session->pid != 0 || session->masterFd != -1 || !session->isChanged)
+        {
+            continue;
+        }
+        if (isAtPrompt && reported == 0)
+        {
+            printf("\n");
+        }
+        printf("[session %d] exited with status %d\n", session->id, session->status);
+        reported++;
+        removeSession(session);
+        i--;
+    }
+    return reported;
+}
+
+// Starts shell24 on a new pseudo-terminal in a session of its own, no terminal emulator or
+// display is involved. Returns the new session or NULL.
+struct Session *startSession()
+{
+    int masterFd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (masterFd == -1 || grantpt(masterFd) == -1 || unlockpt(masterFd) == -1)
+    {
+        perror("posix_openpt");
+        if (masterFd != -1)
+        {
+            close(masterFd);
+        }
+        return NULL;
+    }
+    // The new terminal starts with the size of ours
+    struct winsize size;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0)
+    {
+        ioctl(masterFd, TIOCSWINSZ, &size);
+    }
+
+    char shellPath[4096];
+    ssize_t shellPathLength = readlink("/proc/self/exe", shellPath, sizeof(shellPath) - 1);
+    if (shellPathLength == -1)
+    {
+        perror("readlink");
+        close(masterFd);
+        return NULL;
+    }
+    shellPath[shellPathLength] = '\0';
+
+    // setsid runs before the file actions, so opening the pty makes it the controlling terminal
+    struct SpawnOptions options;
+    initSpawnOptions(&options);
+    options.flags |= POSIX_SPAWN_SETSID;
+    posix_spawn_file_actions_addopen(&options.fileActions, STDIN_FILENO, ptsname(masterFd), O_RDWR, 0);
+    spawnDup(&options, STDIN_FILENO, STDOUT_FILENO);
+    spawnDup(&options, STDIN_FILENO, STDERR_FILENO);
+    char *args[] = {shellPath, NULL};
+    pid_t pid = spawnCommand(args, &options);
+    destroySpawnOptions(&options);
+    if (pid < 0)
+    {
+        close(masterFd);
+        return NULL;
+    }
+
+    if (sessionCount == sessionCapacity)
+    {
+        sessionCapacity = sessionCapacity == 0 ? 4 : sessionCapacity * 2;
+        sessionTable = realloc(sessionTable, sessionCapacity * sizeof(struct Session *));
+        if (sessionTable == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct Session *session = calloc(1, sizeof(struct Session));
+    session->id = sessionCount > 0 ? sessionTable[sessionCount - 1]->id + 1 : 1;
+    session->pid = pid;
+    session->masterFd = masterFd;
+    sessionTable[sessionCount++] = session;
+
+    // While detached the output is collected whenever the shell waits for something
+    struct epoll_event event = {EPOLLIN, {.fd = masterFd}};
+    epoll_ctl(jobEpollFd, EPOLL_CTL_ADD, masterFd, &event);
+    return session;
+}
+
+// Connects the terminal to a session until it exits, SESSION_DETACH_KEY is pressed or the input
+// ends. Output the session produced while it was detached is shown first, other sessions keep
+// being buffered.
+void attachSession(struct Session *session)
+{
+    struct termios savedTerminal;
+    int isTerminal = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &savedTerminal) == 0;
+    if (isTerminal)
+    {
+        struct termios raw = savedTerminal;
+        cfmakeraw(&raw);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+        struct winsize size;
+        if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0)
+        {
+            ioctl(session->masterFd, TIOCSWINSZ, &size);
+        }
+    }
+    fflush(stdout);
+
+    if (session->droppedBytes > 0)
+    {
+        dprintf(STDOUT_FILENO, "[%zu older bytes of output were dropped]\r\n", session->droppedBytes);
+    }
+    for (size_t i = 0; i < session->bufferLength;)
+    {
+        size_t start = (session->bufferStart + i) % SESSION_BUFFER_SIZE;
+        size_t chunk = session->bufferLength - i < SESSION_BUFFER_SIZE - start ? session->bufferLength - i : SESSION_BUFFER_SIZE - start;
+        if (write(STDOUT_FILENO, session->buffer + start, chunk) <= 0)
+        {
+            break;
+        }
+        i += chunk;
+    }
+    session->bufferStart = session->bufferLength = session->droppedBytes = 0;
+
+    int isDetached = 0;
+    while (session->masterFd != -1 && !isDetached)
+    {
+        struct pollfd fds[sessionCount + 1];
+        fds[0] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+        for (int i = 0; i < sessionCount; i++)
+        {
+            fds[i + 1] = (struct pollfd){sessionTable[i]->masterFd, POLLIN, 0};
+        }
+        int count = sessionCount;
+        if (poll(fds, count + 1, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents != 0)
+        {
+            char data[4096];
+            ssize_t length = read(STDIN_FILENO, data, sizeof(data));
+            if (length <= 0)
+            {
+                // Nothing more can be typed into the session, which keeps running detached
+                // instead of holding the shell until it exits by itself
+                isDetached = 1;
+                length = 0;
+            }
+            char *detachKey = memchr(data, SESSION_DETACH_KEY, length);
+            if (detachKey != NULL)
+            {
+                length = detachKey - data;
+                isDetached = 1;
+            }
+            if (length > 0 && write(session->masterFd, data, length) == -1)
+            {
+                perror("write");
+            }
+        }
+        for (int i = 0; i < count; i++)
+        {
+            struct Session *other = findSessionByFd(fds[i + 1].fd);
+            if (other != NULL && fds[i + 1].revents != 0)
+            {
+                readSession(other, other == session ? STDOUT_FILENO : -1);
+            }
+        }
+    }
+
+    if (isTerminal)
+    {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &savedTerminal);
+    }
+    if (isDetached)
+    {
+        printf("\n[detached from session %d]\n", session->id);
+    }
+    else
+    {
+        // Wait for the shell of the session so its status can be shown right away
+        if (session->pid != 0)
+        {
+            int status;
+            waitpid(session->pid, &status, 0);
+            session->pid = 0;
+            session->status = decodeStatus(status);
+        }
+        printf("\n");
+        reportSessions(0);
+    }
+}
+
+// Here-docs and here-strings are read from an anonymous memory file, so a body of any size is
+// ready before the command starts and nothing has to feed it through a pipe
+int openHereDocument(struct Redirect *redirect)
+{
+    int fd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("memfd_create");
+        return -1;
+    }
+    struct iovec parts[2] = {{redirect->body, redirect->bodyLength}, {NULL, 0}};
+    if (redirect->op == OP_HERESTRING)
+    {
+        parts[0].iov_base = redirect->target;
+        parts[0].iov_len = strlen(redirect->target);
+        parts[1].iov_base = "\n";
+        parts[1].iov_len = 1;
+    }
+    if (writev(fd, parts, 2) != (ssize_t)(parts[0].iov_len + parts[1].iov_len) || lseek(fd, 0, SEEK_SET) == -1)
+    {
+        perror("heredoc");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Opens and maps the history log, $SHELL24_HISTORY or ~/.shell24_history. Only the file is
+// mapped here, so this takes the same time for ten lines and ten million.
+void initHistory()
+{
+    if (history.fd != -1)
+    {
+        return;
+    }
+    char path[4096];
+    const char *file = getVariable("SHELL24_HISTORY");
+    if (file == NULL)
+    {
+        if (getVariable("HOME") == NULL)
+        {
+            return;
+        }
+        snprintf(path, sizeof(path), "%s/.shell24_history", getVariable("HOME"));
+        file = path;
+    }
+    history.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history.fd == -1)
+    {
+        perror(file);
+    }
+}
+
+// Maps whatever other shells and this one appended since the last look and adds the complete
+// lines to the entries. A line still being written has no newline yet and waits for next time.
+void refreshHistory()
+{
+    struct stat info;
+    if (history.fd == -1 || fstat(history.fd, &info) == -1 || (size_t)info.st_size <= history.mapLength)
+    {
+        return;
+    }
+    char *map = history.map == NULL ? mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, history.fd, 0)
+                                    : mremap(history.map, history.mapLength, info.st_size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+    {
+        perror("history");
+        return;
+    }
+    history.map = map;
+    history.mapLength = info.st_size;
+
+    const char *p = history.map + history.indexedLength;
+    const char *end = history.map + history.mapLength;
+    const char *newline;
+    while ((newline = memchr(p, '\n', end - p)) != NULL)
+    {
+        if (history.count + 2 > history.capacity)
+        {
+            history.capacity = history.capacity == 0 ? 4096 : 2 * history.capacity;
+            history.offsets = realloc(history.offsets, history.capacity * sizeof(size_t));
+            if (history.offsets == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        history.offsets[history.count++] = p - history.map;
+        p = newline + 1;
+    }
+    history.indexedLength = p - history.map;
+    if (history.offsets != NULL)
+    {
+        history.offsets[history.count] = history.indexedLength;
+    }
+}
+
+// Text of entry index without its newline
+const char *historyEntry(unsigned int index, size_t *length)
+{
+    *length = history.offsets[index + 1] - history.offsets[index] - 1;
+    return history.map + history.offsets[index];
+}
+
+// Appends a command line to the log. The lock keeps lines of shells writing at the same moment
+// apart, and the one write with O_APPEND puts the whole line at the end.
+void addHistory(const char *line, size_t length)
+{
+    initHistory();
+    if (history.fd == -1 || length == 0 || memchr(line, '\n', length) != NULL)
+    {
+        return;
+    }
+    struct iovec parts[2] = {{(void *)line, length}, {"\n", 1}};
+    flock(history.fd, LOCK_EX);
+    if (writev(history.fd, parts, 2) != (ssize_t)length + 1)
+    {
+        perror("history");
+    }
+    flock(history.fd, LOCK_UN);
+}
+
+struct HistoryPosting **findTrigram(unsigned int trigram, int isAdding)
+{
+    struct HistoryPosting **link = &history.trigrams[(trigram * 2654435761u) >> 16];
+    while (*link != NULL && (*link)->trigram != trigram)
+    {
+        link = &(*link)->next;
+    }
+    if (*link == NULL && isAdding)
+    {
+        *link = calloc(1, sizeof(struct HistoryPosting));
+        if (*link == NULL)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        (*link)->trigram = trigram;
+    }
+    return link;
+}
+
+// Adds the entries that are not in the trigram index yet. Each entry is listed once under every
+// trigram it contains, and lists stay sorted because entries are added in order.
+void indexHistory()
+{
+    refreshHistory();
+    if (history.trigrams == NULL)
+    {
+        history.trigrams = calloc(HISTORY_TRIGRAM_BUCKETS, sizeof(struct HistoryPosting *));
+        if (history.trigrams == NULL)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (; history.trigramCount < history.count; history.trigramCount++)
+    {
+        size_t length;
+        const unsigned char *text = (const unsigned char *)historyEntry(history.trigramCount, &length);
+        for (size_t i = 0; i + 3 <= length; i++)
+        {
+            unsigned int trigram = text[i] << 16 | text[i + 1] << 8 | text[i + 2];
+            struct HistoryPosting *posting = *findTrigram(trigram, 1);
+            if (posting->count > 0 && posting->entries[posting->count - 1] == history.trigramCount)
+            {
+                continue;
+            }
+            if (posting->count == posting->capacity)
+            {
+                posting->capacity = posting->capacity == 0 ? 4 : 2 * posting->capacity;
+                posting->entries = realloc(posting->entries, posting->capacity * sizeof(unsigned int));
+                if (posting->entries == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            posting->entries[posting->count++] = history.trigramCount;
+        }
+    }
+}
+
+// Returns the newest entry before entry number before that contains query, or -1. Queries of
+// three bytes or more only look at the entries listed under their rarest trigram.
+int searchHistory(const char *query, size_t queryLength, int before)
+{
+    indexHistory();
+    if (before > (int)history.count)
+    {
+        before = history.count;
+    }
+    const unsigned char *bytes = (const unsigned char *)query;
+    struct HistoryPosting *rarest = NULL;
+    for (size_t i = 0; i + 3 <= queryLength; i++)
+    {
+        struct HistoryPosting *posting = *findTrigram(bytes[i] << 16 | bytes[i + 1] << 8 | bytes[i + 2], 0);
+        if (posting == NULL)
+        {
+            return -1;
+        }
+        if (rarest == NULL || posting->count < rarest->count)
+        {
+            rarest = posting;
+        }
+    }
+
+    if (rarest == NULL)
+    {
+        for (int index = before - 1; index >= 0; index--)
+        {
+            size_t length;
+            const char *text = historyEntry(index, &length);
+            if (memmem(text, length, query, queryLength) != NULL)
+            {
+                return index;
+            }
+        }
+        return -1;
+    }
+    // The candidates are sorted, start at the last one before before
+    unsigned int low = 0;
+    unsigned int high = rarest->count;
+    while (low < high)
+    {
+        unsigned int middle = low + (high - low) / 2;
+        if ((int)rarest->entries[middle] < before)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    while (low-- > 0)
+    {
+        size_t length;
+        const char *text = historyEntry(rarest->entries[low], &length);
+        if (memmem(text, length, query, queryLength) != NULL)
+        {
+            return rarest->entries[low];
+        }
+    }
+    return -1;
+}
+
+// Opens the file of a redirection, returns the fd or -1 after reporting why it failed.
+// Descriptor duplications open nothing and are left to the caller.
+int openRedirect(struct Redirect *redirect)
+{
+    if (redirect->op == OP_HEREDOC || redirect->op == OP_HEREDOC_TABS || redirect->op == OP_HERESTRING)
+    {
+        return openHereDocument(redirect);
+    }
+    int flags = O_RDONLY;
+    if (redirect->op == OP_REDIRECT_OUT)
+    {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    else if (redirect->op == OP_APPEND)
+    {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+    double start = nowSeconds();
+    int fd = open(redirect->target, flags | O_CLOEXEC, 0666);
+    traceEvent('X', "redirect", trace.pid, start, nowSeconds() - start, fd != -1 ? "fd" : "errno", fd != -1 ? fd : errno,
+               "open %s", redirect->target);
+    if (fd == -1)
+    {
+        perror(redirect->target);
+    }
+    return fd;
+}
+
+// Concatenate contents of text files into stdout, redirections are already in place
+int fileConcatenation(struct AstNode *command)
+{
+    int status = concatenateFiles(command->argv, command->argc, STDOUT_FILENO);
+    // Finish the output line on the terminal
+    if (status == 0 && isatty(STDOUT_FILENO) && write(STDOUT_FILENO, "\n", 1) != 1)
+    {
+        perror("write");
+    }
+    return status;
+}
+
+// newt [-d], opens a new shell24 session on a pseudo-terminal and attaches to it unless -d is given
+int newtBuiltin(char *args[], int argc)
+{
+    // If there is junk values along with newt
+    if (argc > 2 || (argc == 2 && strcmp(args[1], "-d") != 0))
+    {
+        printf("Invalid Command\n");
+        return 1;
+    }
+    struct Session *session = startSession();
+    if (session == NULL)
+    {
+        return 1;
+    }
+    printf("Creating a new shell24 session... [session %d] PID: %d\n", session->id, session->pid);
+    if (argc == 1)
+    {
+        printf("Press Ctrl+] to detach\n");
+        attachSession(session);
+    }
+    return 0;
+}
+
+// sessions, lists the sessions opened with newt
+int sessionsBuiltin(char *args[], int argc)
+{
+    updateSessions();
+    for (int i = 0; i < sessionCount; i++)
+    {
+        struct Session *session = sessionTable[i];
+        printf("[%d] PID %-8d %-8s %zu bytes of output waiting\n", session->id, session->pid,
+               session->pid != 0 ? "Running" : "Exited", session->bufferLength);
+    }
+    return 0;
+}
+
+// attach [n], shows the newest or the given session until it exits or Ctrl+] is pressed
+int attachBuiltin(char *args[], int argc)
+{
+    struct Session *session = findSession(argc > 1 ? args[1] : NULL);
+    if (session == NULL || session->masterFd == -1)
+    {
+        printf("attach: %s: no such session\n", argc > 1 ? args[1] : "current");
+        return 1;
+    }
+    attachSession(session);
+    return 0;
+}
+
+// fg [%n], continues the newest or the given job in the foreground
+int fgBuiltin(char *args[], int argc)
+{
+    struct Job *job = findJob(argc > 1 ? args[1] : NULL);
+    if (job == NULL)
+    {
+        printf("fg: %s: no such job\n", argc > 1 ? args[1] : "current");
+        return 1;
+    }
+    printf("%s\n", job->commandText);
+    fflush(stdout);
+    return foregroundJob(job, job->state == JOB_STOPPED);
+}
+
+// bg [%n], lets a stopped job continue in the background
+int bgBuiltin(char *args[], int argc)
+{
+    struct Job *job = findJob(argc > 1 ? args[1] : NULL);
+    if (job == NULL)
+    {
+        printf("bg: %s: no such job\n", argc > 1 ? args[1] : "current");
+        return 1;
+    }
+    if (job->state == JOB_STOPPED)
+    {
+        signalJob(job, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+    printf("[%d] %s &\n", job->id, job->commandText);
+    return 0;
+}
+
+int jobsBuiltin(char *args[], int argc)
+{
+    updateAllJobs();
+    for (int i = 0; i < jobCount; i++)
+    {
+        printJob(jobTable[i]);
+        jobTable[i]->isChanged = 0;
+    }
+    // Finished jobs are forgotten once they have been shown
+    for (int i = jobCount - 1; i >= 0; i--)
+    {
+        if (jobTable[i]->state == JOB_DONE)
+        {
+            removeJob(jobTable[i]);
+        }
+    }
+    return 0;
+}
+
+// wait [%n ...], waits for the given jobs or for every job and returns the last status
+int waitBuiltin(char *args[], int argc)
+{
+    int status = 0;
+    if (argc == 1)
+    {
+        int i = 0;
+        while (i < jobCount)
+        {
+            struct Job *job = jobTable[i];
+            if (job->state == JOB_STOPPED)
+            {
+                // A stopped job would never finish, leave it in the table
+                i++;
+                continue;
+            }
+            status = waitForJob(job);
+            if (job->state == JOB_DONE)
+            {
+                removeJob(job);
+            }
+            else
+            {
+                i++;
+            }
+        }
+        return status;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        struct Job *job = findJob(args[i]);
+        if (job == NULL)
+        {
+            printf("wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+        status = waitForJob(job);
+        if (job->state == JOB_DONE)
+        {
+            removeJob(job);
+        }
+    }
+    return status;
+}
+
+// cd [dir | -], without a directory it goes to HOME
+int cdBuiltin(char *args[], int argc)
+{
+    const char *dir = argc > 1 ? args[1] : getVariable("HOME");
+    if (argc > 1 && strcmp(args[1], "-") == 0)
+    {
+        dir = getVariable("OLDPWD");
+    }
+    if (dir == NULL)
+    {
+        fprintf(stderr, "cd: %s not set\n", argc > 1 ? "OLDPWD" : "HOME");
+        return 1;
+    }
+    if (chdir(dir) == -1)
+    {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    char *cwd = getcwd(NULL, 0);
+    if (getVariable("PWD") != NULL)
+    {
+        char *oldPwd = strdup(getVariable("PWD"));
+        setVariable("OLDPWD", 6, oldPwd, 1);
+        free(oldPwd);
+    }
+    if (cwd != NULL)
+    {
+        setVariable("PWD", 3, cwd, 1);
+        if (argc > 1 && strcmp(args[1], "-") == 0)
+        {
+            printf("%s\n", cwd);
+        }
+        free(cwd);
+    }
+    return 0;
+}
+
+int pwdBuiltin(char *args[], int argc)
+{
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+    {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+// echo [-n] words...
+int echoBuiltin(char *args[], int argc)
+{
+    int first = 1;
+    int printNewline = 1;
+    if (argc > 1 && strcmp(args[1], "-n") == 0)
+    {
+        printNewline = 0;
+        first = 2;
+    }
+    for (int i = first; i < argc; i++)
+    {
+        fputs(args[i], stdout);
+        if (i < argc - 1)
+        {
+            putchar(' ');
+        }
+    }
+    if (printNewline)
+    {
+        putchar('\n');
+    }
+    return 0;
+}
+
+// export NAME[=value] ..., without arguments it lists the environment
+int exportBuiltin(char *args[], int argc)
+{
+    loadVariables();
+    if (argc == 1)
+    {
+        for (char **entry = environ; *entry != NULL; entry++)
+        {
+            printf("export %s\n", *entry);
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        size_t nameLength = strcspn(args[i], "=");
+        int result = -1;
+        if (args[i][nameLength] == '=')
+        {
+            result = setVariable(args[i], nameLength, args[i] + nameLength + 1, 1);
+        }
+        else if (isVariableName(args[i], nameLength))
+        {
+            // Exporting a name that is not set does nothing
+            exportVariable(args[i], nameLength);
+            result = 0;
+        }
+        if (result == -1)
+        {
+            fprintf(stderr, "export: %.*s: not a valid identifier\n", (int)nameLength, args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// unset NAME ...
+int unsetBuiltin(char *args[], int argc)
+{
+    int status = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!isVariableName(args[i], strlen(args[i])))
+        {
+            fprintf(stderr, "unset: %s: not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        unsetVariable(args[i], strlen(args[i]));
+    }
+    return status;
+}
+
+int trueBuiltin(char *args[], int argc)
+{
+    return 0;
+}
+
+int falseBuiltin(char *args[], int argc)
+{
+    return 1;
+}
+
+// exit [status], without a status the shell exits with the status of the last command
+int exitBuiltin(char *args[], int argc)
+{
+    fflush(stdout);
+    exit(argc > 1 ? atoi(args[1]) : lastExitStatus);
+}
+
+// parsecache [-c]: shows how well the parse cache does, -c empties it
+int parseCacheBuiltin(char *args[], int argc)
+{
+    if (argc > 1 && strcmp(args[1], "-c") == 0)
+    {
+        clearParseCache();
+        parseCache.hits = parseCache.misses = parseCache.evictions = 0;
+        return 0;
+    }
+    if (argc > 1)
+    {
+        fprintf(stderr, "parsecache: usage: parsecache [-c]\n");
+        return 2;
+    }
+    long lookups = parseCache.hits + parseCache.misses;
+    printf("parse cache: %d of %d lines, %ld hits, %ld misses (%.1f%% hit rate), %ld evictions\n", parseCache.count,
+           parseCache.capacity, parseCache.hits, parseCache.misses, lookups > 0 ? 100.0 * parseCache.hits / lookups : 0.0,
+           parseCache.evictions);
+    return 0;
+}
+
+// history [n] lists the last n entries of the log, all without n. history -s text lists the
+// entries that contain text, oldest first.
+int historyBuiltin(char *args[], int argc)
+{
+    initHistory();
+    refreshHistory();
+    if (argc > 2 && strcmp(args[1], "-s") == 0)
+    {
+        // The words after -s are searched for as one text
+        char query[4096];
+        size_t queryLength = 0;
+        for (int i = 2; i < argc; i++)
+        {
+            queryLength += snprintf(query + queryLength, sizeof(query) - queryLength, i > 2 ? " %s" : "%s", args[i]);
+            queryLength = queryLength < sizeof(query) ? queryLength : sizeof(query) - 1;
+        }
+        int matchCount = 0;
+        int matchCapacity = 0;
+        int *matches = NULL;
+        for (int index = searchHistory(query, queryLength, history.count); index >= 0;
+             index = searchHistory(query, queryLength, index))
+        {
+            if (matchCount == matchCapacity)
+            {
+                matchCapacity = matchCapacity == 0 ? 64 : matchCapacity * 2;
+                matches = realloc(matches, matchCapacity * sizeof(int));
+                if (matches == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            matches[matchCount++] = index;
+        }
+        for (int i = matchCount - 1; i >= 0; i--)
+        {
+            size_t length;
+            const char *text = historyEntry(matches[i], &length);
+            printf("%6d  %.*s\n", matches[i] + 1, (int)length, text);
+        }
+        free(matches);
+        return matchCount > 0 ? 0 : 1;
+    }
+    if (argc > 2 || (argc == 2 && atoi(args[1]) <= 0))
+    {
+        fprintf(stderr, "history: usage: history [n] | history -s <text>\n");
+        return 2;
+    }
+    unsigned int first = argc == 2 && (unsigned int)atoi(args[1]) < history.count ? history.count - atoi(args[1]) : 0;
+    for (unsigned int index = first; index < history.count; index++)
+    {
+        size_t length;
+        const char *text = historyEntry(index, &length);
+        printf("%6u  %.*s\n", index + 1, (int)length, text);
+    }
+    return 0;
+}
+
+int parallelBuiltin(char *args[], int argc);
+
+// Commands the shell runs itself, checked before anything is spawned
+struct Builtin builtins[] = {
+    {"cd", cdBuiltin},
+    {"pwd", pwdBuiltin},
+    {"echo", echoBuiltin},
+    {"export", exportBuiltin},
+    {"unset", unsetBuiltin},
+    {"true", trueBuiltin},
+    {"false", falseBuiltin},
+    {"exit", exitBuiltin},
+    {"fg", fgBuiltin},
+    {"bg", bgBuiltin},
+    {"jobs", jobsBuiltin},
+    {"wait", waitBuiltin},
+    {"newt", newtBuiltin},
+    {"hash", hashBuiltin},
+    {"parallel", parallelBuiltin},
+    {"parsecache", parseCacheBuiltin},
+    {"history", historyBuiltin},
+    {"sessions", sessionsBuiltin},
+    {"attach", attachBuiltin},
+};
+
+struct Builtin *lookupBuiltin(const char *name)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        if (strcmp(builtins[i].name, name) == 0)
+        {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+// Applies one redirection to the current process. Returns 0, or 1 after reporting the error.
+int applyRedirect(struct Redirect *redirect)
+{
+    if (redirect->op == OP_DUP_OUT || redirect->op == OP_DUP_IN)
+    {
+        if (strcmp(redirect->target, "-") == 0)
+        {
+            close(redirect->fd);
+        }
+        else if (dup2(atoi(redirect->target), redirect->fd) == -1)
+        {
+            perror(redirect->target);
+            return 1;
+        }
+        return 0;
+    }
+    int fd = openRedirect(redirect);
+    if (fd == -1)
+    {
+        return 1;
+    }
+    // The file may have landed on the descriptor it is meant for when that one was closed
+    if (fd != redirect->fd)
+    {
+        dup2(fd, redirect->fd);
+        close(fd);
+    }
+    else
+    {
+        fcntl(fd, F_SETFD, 0);
+    }
+    return 0;
+}
+
+// Runs a builtin, or a concatenation when builtin is NULL, inside the shell. Its redirections are
+// applied to the shell's own descriptors and undone afterwards, so it costs no process at all.
+int runBuiltin(struct Builtin *builtin, struct AstNode *command)
+{
+    int redirectCount = 0;
+    for (struct Redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        redirectCount++;
+    }
+    int targetFds[redirectCount + 1];
+    int savedFds[redirectCount + 1];
+    int appliedCount = 0;
+    int status = 0;
+
+    fflush(stdout);
+    for (struct Redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        // Keep the shell's descriptor out of the way, -1 if it was not open
+        targetFds[appliedCount] = redirect->fd;
+        savedFds[appliedCount] = fcntl(redirect->fd, F_DUPFD_CLOEXEC, 10);
+        appliedCount++;
+        if ((status = applyRedirect(redirect)) != 0)
+        {
+            break;
+        }
+    }
+
+    if (status == 0)
+    {
+        status = builtin != NULL ? builtin->run(command->argv, command->argc) : fileConcatenation(command);
+    }
+    fflush(stdout);
+
+    // Restore in reverse so the same descriptor redirected twice ends up as it started
+    for (int i = appliedCount - 1; i >= 0; i--)
+    {
+        if (savedFds[i] == -1)
+        {
+            close(targetFds[i]);
+        }
+        else
+        {
+            dup2(savedFds[i], targetFds[i]);
+            close(savedFds[i]);
+        }
+    }
+    return status;
+}
+
+int executeNode(struct AstNode *node);
+
+// Growable byte buffer that doubles when full, so collecting n bytes copies O(n) in total
+struct CaptureBuffer
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Makes room for at least extra more bytes
+void reserveCapture(struct CaptureBuffer *buffer, size_t extra)
+{
+    if (buffer->length + extra <= buffer->capacity)
+    {
+        return;
+    }
+    size_t capacity = buffer->capacity == 0 ? CAPTURE_BUFFER_SIZE : buffer->capacity;
+    while (buffer->length + extra > capacity)
+    {
+        capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, capacity);
+    if (buffer->data == NULL)
+    {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    buffer->capacity = capacity;
+}
+
+// Runs the command line in [text, text + length) in a forked copy of the shell with stdin inFd
+// and collects what it writes to stdout into output, without the trailing newlines. Returns its
+// exit status, or -1 if it could not be started.
+int captureCommand(const char *text, size_t length, int inFd, struct CaptureBuffer *output)
+{
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+    fflush(stdout);
+    double start = nowSeconds();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        // The substitution shares the shell's process group, so Ctrl+C reaches it too
+        dup2(pipeFds[1], STDOUT_FILENO);
+        if (inFd != STDIN_FILENO)
+        {
+            dup2(inFd, STDIN_FILENO);
+        }
+        resetChildSignals();
+        closePendingFilters();
+        isInteractive = 0;
+        activeUsageReport = NULL;
+        initJobControl();
+        struct Token *tokens;
+        int tokenCount = lexLine(text, length, &tokens);
+        struct AstNode *tree = tokenCount > 0 ? parseLine(tokens, tokenCount) : NULL;
+        int status = tree != NULL ? executeNode(tree) : (tokenCount == 0 ? 0 : 2);
+        fflush(stdout);
+        _exit(status);
+    }
+    close(pipeFds[1]);
+
+    // Read straight into the free end of the buffer, it only grows when a read fills it
+    output->length = 0;
+    while (1)
+    {
+        reserveCapture(output, 1);
+        ssize_t count = read(pipeFds[0], output->data + output->length, output->capacity - output->length);
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            break;
+        }
+        output->length += count;
+    }
+    close(pipeFds[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    {
+    }
+    status = decodeStatus(status);
+    traceEvent('X', "substitution", pid, start, nowSeconds() - start, "status", status, "$(%.*s)",
+               (int)(length < TRACE_NAME_LENGTH - 4 ? length : TRACE_NAME_LENGTH - 4), text);
+    while (output->length > 0 && output->data[output->length - 1] == '\n')
+    {
+        output->length--;
+    }
+    return status;
+}
+
+// Puts the value of the variable name[0..length) into output, nothing when it is not set
+void expandVariable(const char *name, size_t length, struct CaptureBuffer *output)
+{
+    char status[16];
+    const char *value = status;
+    if (length == 1 && name[0] == '?')
+    {
+        snprintf(status, sizeof(status), "%d", lastExitStatus);
+    }
+    else if ((value = lookupVariable(name, length)) == NULL)
+    {
+        value = "";
+    }
+    size_t valueLength = strlen(value);
+    output->length = 0;
+    reserveCapture(output, valueLength + 1);
+    memcpy(output->data, value, valueLength);
+    output->length = valueLength;
+}
+
+void addWord(struct WordList *list, char *word)
+{
+    if (list->count + 1 >= list->capacity)
+    {
+        int capacity = list->capacity == 0 ? 16 : 2 * list->capacity;
+        char **grown = arenaAlloc(&lineArena, capacity * sizeof(char *));
+        if (list->count > 0)
+        {
+            memcpy(grown, list->words, list->count * sizeof(char *));
+        }
+        list->words = grown;
+        list->capacity = capacity;
+    }
+    list->words[list->count++] = word;
+    list->words[list->count] = NULL;
+}
+
+int compareDirectoryEntries(const void *a, const void *b, void *names)
+{
+    return strcmp((char *)names + ((const struct DirectoryEntry *)a)->offset,
+                  (char *)names + ((const struct DirectoryEntry *)b)->offset);
+}
+
+void freeListing(struct DirectoryListing *listing)
+{
+    free(listing->names);
+    free(listing->entries);
+    free(listing);
+}
+
+// Reads every entry of directory but . and .. with getdents64, a few thousand per call. With
+// isSorting they are sorted once, which pays off when the listing is used again. Returns NULL if
+// it cannot be read.
+struct DirectoryListing *readListing(const char *directory, const struct stat *info, int isSorting)
+{
+    static char *readBuffer = NULL;
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (readBuffer == NULL && (readBuffer = malloc(DIRECTORY_READ_SIZE)) == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    struct DirectoryListing *listing = calloc(1, sizeof(struct DirectoryListing));
+    if (listing == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    listing->device = info->st_dev;
+    listing->inode = info->st_ino;
+    listing->modified = info->st_mtim;
+    size_t namesLength = 0;
+    size_t namesCapacity = 0;
+    size_t entriesCapacity = 0;
+
+    ssize_t readLength;
+    while ((readLength = getdents64(fd, readBuffer, DIRECTORY_READ_SIZE)) > 0)
+    {
+        for (ssize_t position = 0; position < readLength;)
+        {
+            struct dirent64 *entry = (struct dirent64 *)(readBuffer + position);
+            position += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+            size_t length = strlen(name);
+            // Both arrays double when full, so a huge directory is not copied over and over
+            if (namesLength + length + 1 > namesCapacity)
+            {
+                namesCapacity = namesCapacity == 0 ? 16 * 1024 : namesCapacity;
+                while (namesLength + length + 1 > namesCapacity)
+                {
+                    namesCapacity *= 2;
+                }
+                listing->names = realloc(listing->names, namesCapacity);
+            }
+            if (listing->count == entriesCapacity)
+            {
+                entriesCapacity = entriesCapacity == 0 ? 1024 : 2 * entriesCapacity;
+                listing->entries = realloc(listing->entries, entriesCapacity * sizeof(struct DirectoryEntry));
+            }
+            if (listing->names == NULL || listing->entries == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(listing->names + namesLength, name, length + 1);
+            listing->entries[listing->count++] = (struct DirectoryEntry){namesLength, length, entry->d_type};
+            namesLength += length + 1;
+        }
+    }
+    close(fd);
+    if (isSorting)
+    {
+        qsort_r(listing->entries, listing->count, sizeof(struct DirectoryEntry), compareDirectoryEntries, listing->names);
+        listing->isSorted = 1;
+    }
+    return listing;
+}
+
+// Takes the listing at index out of the glob cache, freeing it unless a glob is walking it
+void dropCachedListing(int index)
+{
+    struct DirectoryListing *listing = globCache.listings[index];
+    memmove(&globCache.listings[index], &globCache.listings[index + 1],
+            (globCache.count - index - 1) * sizeof(struct DirectoryListing *));
+    globCache.count--;
+    listing->isCached = 0;
+    if (listing->users == 0)
+    {
+        freeListing(listing);
+    }
+}
+
+// Returns the listing of directory, from the glob cache while the directory's mtime is the one it
+// was read at, or NULL if it is not a readable directory. Give it back with releaseListing.
+struct DirectoryListing *openListing(const char *directory)
+{
+    struct stat info;
+    if (stat(directory, &info) == -1 || !S_ISDIR(info.st_mode))
+    {
+        return NULL;
+    }
+    for (int i = 0; i < globCache.count; i++)
+    {
+        struct DirectoryListing *listing = globCache.listings[i];
+        if (listing->device != info.st_dev || listing->inode != info.st_ino)
+        {
+            continue;
+        }
+        if (listing->modified.tv_sec == info.st_mtim.tv_sec && listing->modified.tv_nsec == info.st_mtim.tv_nsec)
+        {
+            memmove(&globCache.listings[1], &globCache.listings[0], i * sizeof(struct DirectoryListing *));
+            globCache.listings[0] = listing;
+            globCache.hits++;
+            listing->users++;
+            return listing;
+        }
+        dropCachedListing(i);
+        break;
+    }
+
+    // A directory changed in the last second can change again without its mtime moving, so it
+    // is not trusted to stay the same
+    globCache.misses++;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int isCacheable = globCache.capacity > 0 && info.st_mtim.tv_sec < now.tv_sec - 1;
+    struct DirectoryListing *listing = readListing(directory, &info, isCacheable);
+    if (listing == NULL)
+    {
+        return NULL;
+    }
+    listing->users = 1;
+    if (!isCacheable)
+    {
+        return listing;
+    }
+    if (globCache.listings == NULL)
+    {
+        globCache.listings = malloc(globCache.capacity * sizeof(struct DirectoryListing *));
+    }
+    // The least recently used listing nobody is walking makes room
+    for (int i = globCache.count - 1; i >= 0 && globCache.count == globCache.capacity; i--)
+    {
+        if (globCache.listings[i]->users == 0)
+        {
+            dropCachedListing(i);
+        }
+    }
+    if (globCache.count < globCache.capacity)
+    {
+        memmove(&globCache.listings[1], &globCache.listings[0], globCache.count * sizeof(struct DirectoryListing *));
+        globCache.listings[0] = listing;
+        globCache.count++;
+        listing->isCached = 1;
+    }
+    return listing;
+}
+
+void releaseListing(struct DirectoryListing *listing)
+{
+    if (--listing->users == 0 && !listing->isCached)
+    {
+        freeListing(listing);
+    }
+}
+
+// Matches the bracket expression starting at p against c. Returns 1 or 0 and points *close at
+// its ], or -1 when there is no ] and the [ is an ordinary character.
+int matchBracket(const char *p, const char *end, char c, const char **close)
+{
+    const char *q = p + 1;
+    int isNegated = q < end && (*q == '!' || *q == '^');
+    q += isNegated;
+    int isMatched = 0;
+    // A ] right after the [ is part of the set
+    for (int isFirst = 1; q < end && (*q != ']' || isFirst); isFirst = 0)
+    {
+        unsigned char low = *q++;
+        if (low == GLOB_ESCAPE && q < end)
+        {
+            low = *q++;
+        }
+        unsigned char high = low;
+        if (q + 1 < end && *q == '-' && q[1] != ']')
+        {
+            q++;
+            high = *q++;
+            if (high == GLOB_ESCAPE && q < end)
+            {
+                high = *q++;
+            }
+        }
+        isMatched |= (unsigned char)c >= low && (unsigned char)c <= high;
+    }
+    if (q >= end)
+    {
+        return -1;
+    }
+    *close = q;
+    return isMatched != isNegated;
+}
+
+// Matches name against the pattern in [p, end). After a mismatch only the last * takes one more
+// character, which is enough for shell patterns and keeps matching linear in practice.
+int matchGlob(const char *p, const char *end, const char *name)
+{
+    const char *starPattern = NULL;
+    const char *starName = NULL;
+    while (*name != '\0')
+    {
+        if (p < end)
+        {
+            if (*p == '*')
+            {
+                starPattern = ++p;
+                starName = name;
+                continue;
+            }
+            if (*p == '?')
+            {
+                p++;
+                name++;
+                continue;
+            }
+            const char *close;
+            int bracket = *p == '[' ? matchBracket(p, end, *name, &close) : -1;
+            if (bracket == 1)
+            {
+                p = close + 1;
+                name++;
+                continue;
+            }
+            const char *literal = *p == GLOB_ESCAPE && p + 1 < end ? p + 1 : p;
+            if (bracket == -1 && *literal == *name)
+            {
+                p = literal + 1;
+                name++;
+                continue;
+            }
+        }
+        if (starPattern == NULL)
+        {
+            return 0;
+        }
+        p = starPattern;
+        name = ++starName;
+    }
+    while (p < end && *p == '*')
+    {
+        p++;
+    }
+    return p == end;
+}
+
+// Appends length bytes of text to path and keeps it NUL terminated
+void appendPath(struct CaptureBuffer *path, const char *text, size_t length)
+{
+    reserveCapture(path, length + 1);
+    memcpy(path->data + path->length, text, length);
+    path->length += length;
+    path->data[path->length] = '\0';
+}
+
+// Returns 1 if the entry named name in the directory path is a directory. Symbolic links are
+// followed unless isFollowingLinks is 0.
+int isDirectoryEntry(struct CaptureBuffer *path, const char *name, unsigned char type, int isFollowingLinks)
+{
+    if (type == DT_DIR || (type != DT_UNKNOWN && type != DT_LNK))
+    {
+        return type == DT_DIR;
+    }
+    if (type == DT_LNK && !isFollowingLinks)
+    {
+        return 0;
+    }
+    size_t length = path->length;
+    appendPath(path, name, strlen(name));
+    struct stat info;
+    int result = (isFollowingLinks ? stat(path->data, &info) : lstat(path->data, &info)) == 0 && S_ISDIR(info.st_mode);
+    path->length = length;
+    path->data[length] = '\0';
+    return result;
+}
+
+int globBelow(struct CaptureBuffer *path, const char *pattern, struct WordList *list);
+
+// ** matches any number of directories, rest is what has to match below them. ** at the end
+// matches every file and directory. Links to directories are not followed.
+int globStar(struct CaptureBuffer *path, const char *rest, int isLast, struct WordList *list)
+{
+    int count = isLast ? 0 : globBelow(path, rest, list);
+    struct DirectoryListing *listing = openListing(path->length > 0 ? path->data : ".");
+    if (listing == NULL)
+    {
+        return count;
+    }
+    size_t length = path->length;
+    for (size_t i = 0; i < listing->count; i++)
+    {
+        struct DirectoryEntry *entry = &listing->entries[i];
+        const char *name = listing->names + entry->offset;
+        if (name[0] == '.')
+        {
+            continue;
+        }
+        appendPath(path, name, entry->length);
+        if (isLast)
+        {
+            addWord(list, arenaStrndup(&lineArena, path->data, path->length));
+            count++;
+        }
+        path->length = length;
+        if (isDirectoryEntry(path, name, entry->type, 0))
+        {
+            appendPath(path, name, entry->length);
+            appendPath(path, "/", 1);
+            count += globStar(path, rest, isLast, list);
+        }
+        path->length = length;
+        path->data[length] = '\0';
+    }
+    releaseListing(listing);
+    return count;
+}
+
+// Adds the paths that match pattern below path, which is empty for the current directory or
+// ends in /. Components without glob characters are taken as they are. Returns how many matched.
+int globBelow(struct CaptureBuffer *path, const char *pattern, struct WordList *list)
+{
+    if (*pattern == '\0')
+    {
+        // The pattern ended in /, only directories got here
+        addWord(list, arenaStrndup(&lineArena, path->data, path->length));
+        return 1;
+    }
+    const char *componentEnd = strchrnul(pattern, '/');
+    const char *rest = componentEnd;
+    while (*rest == '/')
+    {
+        rest++;
+    }
+    size_t componentLength = componentEnd - pattern;
+    size_t length = path->length;
+    int count = 0;
+
+    if (componentLength == 2 && pattern[0] == '*' && pattern[1] == '*')
+    {
+        return globStar(path, rest, *componentEnd == '\0', list);
+    }
+    if (!hasGlobCharacters(strndupa(pattern, componentLength)))
+    {
+        for (const char *p = pattern; p < componentEnd; p++)
+        {
+            appendPath(path, p, *p == GLOB_ESCAPE ? 0 : 1);
+        }
+        struct stat info;
+        if (*componentEnd == '\0')
+        {
+            if (lstat(path->data, &info) == 0)
+            {
+                addWord(list, arenaStrndup(&lineArena, path->data, path->length));
+                count = 1;
+            }
+        }
+        else
+        {
+            appendPath(path, "/", 1);
+            count = globBelow(path, rest, list);
+        }
+        path->length = length;
+        path->data[length] = '\0';
+        return count;
+    }
+
+    struct DirectoryListing *listing = openListing(path->length > 0 ? path->data : ".");
+    if (listing == NULL)
+    {
+        return 0;
+    }
+    // In a sorted listing the names starting with the literal part of the pattern are found by
+    // binary search and sit next to each other
+    size_t prefixLength = strcspn(pattern, "*?[\x03/");
+    size_t first = 0;
+    size_t last = listing->isSorted ? listing->count : 0;
+    while (first < last)
+    {
+        size_t middle = first + (last - first) / 2;
+        if (strncmp(listing->names + listing->entries[middle].offset, pattern, prefixLength) < 0)
+        {
+            first = middle + 1;
+        }
+        else
+        {
+            last = middle;
+        }
+    }
+    // *.log and the like only compare the end of each name
+    size_t suffixLength = componentLength - 1;
+    int isSuffixPattern = pattern[0] == '*' && strcspn(pattern + 1, "*?[\x03/") == suffixLength;
+    // Hidden names only match a pattern that starts with a dot itself
+    int isDotMatched = pattern[0] == '.' || (pattern[0] == GLOB_ESCAPE && pattern[1] == '.');
+    for (size_t i = first; i < listing->count; i++)
+    {
+        struct DirectoryEntry *entry = &listing->entries[i];
+        const char *name = listing->names + entry->offset;
+        if (strncmp(name, pattern, prefixLength) != 0)
+        {
+            if (listing->isSorted)
+            {
+                break;
+            }
+            continue;
+        }
+        int isMatched = isSuffixPattern ? entry->length >= suffixLength &&
+                                              memcmp(name + entry->length - suffixLength, pattern + 1, suffixLength) == 0
+                                        : matchGlob(pattern, componentEnd, name);
+        if ((name[0] == '.' && !isDotMatched) || !isMatched)
+        {
+            continue;
+        }
+        if (*componentEnd == '\0')
+        {
+            appendPath(path, name, entry->length);
+            addWord(list, arenaStrndup(&lineArena, path->data, path->length));
+            count++;
+        }
+        else if (isDirectoryEntry(path, name, entry->type, 1))
+        {
+            appendPath(path, name, entry->length);
+            appendPath(path, "/", 1);
+            count += globBelow(path, rest, list);
+        }
+        path->length = length;
+        path->data[length] = '\0';
+    }
+    releaseListing(listing);
+    return count;
+}
+
+int compareWords(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds the paths matching pattern to list in sorted order and returns how many there were
+int expandGlob(const char *pattern, struct WordList *list)
+{
+    struct CaptureBuffer path = {NULL, 0, 0};
+    appendPath(&path, "", 0);
+    if (*pattern == '/')
+    {
+        appendPath(&path, "/", 1);
+        pattern += strspn(pattern, "/");
+    }
+    int firstWord = list->count;
+    int count = globBelow(&path, pattern, list);
+    free(path.data);
+    // One directory comes out sorted already, matches from several are put in order
+    for (int i = firstWord + 1; i < list->count; i++)
+    {
+        if (strcmp(list->words[i - 1], list->words[i]) > 0)
+        {
+            qsort(list->words + firstWord, count, sizeof(char *), compareWords);
+            break;
+        }
+    }
+    return count;
+}
+
+// Adds word to list, or with isGlobbing the paths it matches if it is a pattern that matches
+// anything. What is added has no GLOB_ESCAPE bytes left.
+void addExpandedWord(struct WordList *list, char *word, int isGlobbing)
+{
+    if (isGlobbing && hasGlobCharacters(word) && expandGlob(word, list) > 0)
+    {
+        return;
+    }
+    if (strchr(word, GLOB_ESCAPE) == NULL)
+    {
+        addWord(list, word);
+        return;
+    }
+    char *text = arenaStrndup(&lineArena, word, strlen(word));
+    char *out = text;
+    for (const char *p = text; *p != '\0'; p++)
+    {
+        if (*p != GLOB_ESCAPE)
+        {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+    addWord(list, text);
+}
+
+// Expands the substitutions in word, which read from inFd, and adds the result to list. Unquoted
+// output is split into separate words at blanks and newlines and then globbed unless isSplitting
+// is 0. The status of each command substitution is stored in substitutionStatus. Returns 0 or -1.
+int expandWord(char *word, struct WordList *list, int isSplitting, int inFd, int *substitutionStatus)
+{
+    if (strchr(word, EXPANSION_START) == NULL)
+    {
+        addExpandedWord(list, word, isSplitting);
+        return 0;
+    }
+    struct CaptureBuffer current = {NULL, 0, 0};
+    struct CaptureBuffer output = {NULL, 0, 0};
+    reserveCapture(&current, strlen(word));
+    int isStarted = 0; // Quoted or literal text makes a word even if it stays empty
+    int status = 0;
+    const char *p = word;
+    while (*p != '\0')
+    {
+        const char *mark = strchr(p, EXPANSION_START);
+        size_t literalLength = mark != NULL ? (size_t)(mark - p) : strlen(p);
+        reserveCapture(&current, literalLength);
+        memcpy(current.data + current.length, p, literalLength);
+        current.length += literalLength;
+        isStarted |= literalLength > 0;
+        if (mark == NULL)
+        {
+            break;
+        }
+        const char *close = strchr(mark, EXPANSION_END);
+        if (mark[1] == 'v' || mark[1] == 'V')
+        {
+            expandVariable(mark + 2, close - mark - 2, &output);
+        }
+        else if ((*substitutionStatus = captureCommand(mark + 2, close - mark - 2, inFd, &output)) == -1)
+        {
+            status = -1;
+            break;
+        }
+        p = close + 1;
+        if (mark[1] == 'C' || mark[1] == 'V' || !isSplitting)
+        {
+            // Quoted output is never a pattern
+            reserveCapture(&current, 2 * output.length);
+            for (size_t i = 0; i < output.length; i++)
+            {
+                current.length = copyQuotedByte(current.data + current.length, output.data[i]) - current.data;
+            }
+            isStarted = 1;
+            continue;
+        }
+        // Every blank run ends the word being built, the text between runs starts the next one
+        for (size_t i = 0; i < output.length; i++)
+        {
+            char c = output.data[i];
+            if (c == ' ' || c == '\t' || c == '\n')
+            {
+                if (isStarted)
+                {
+                    addExpandedWord(list, arenaStrndup(&lineArena, current.data, current.length), 1);
+                    current.length = 0;
+                    isStarted = 0;
+                }
+                continue;
+            }
+            reserveCapture(&current, 1);
+            current.data[current.length++] = c;
+            isStarted = 1;
+        }
+    }
+    if (status == 0 && isStarted)
+    {
+        addExpandedWord(list, arenaStrndup(&lineArena, current.data, current.length), isSplitting);
+    }
+    free(current.data);
+    free(output.data);
+    return status;
+}
+
+// Expands $NAME, ${NAME}, $?, $(...) and `...` in a here-doc body whose delimiter was not
+// quoted. Nothing is split or globbed. Returns 0 or -1.
+int expandHereDocument(struct Redirect *redirect, int inFd)
+{
+    struct CaptureBuffer body = {NULL, 0, 0};
+    struct CaptureBuffer output = {NULL, 0, 0};
+    const char *p = redirect->body;
+    const char *end = redirect->body + redirect->bodyLength;
+    int status = 0;
+    reserveCapture(&body, redirect->bodyLength + 1);
+    while (p < end)
+    {
+        const char *name;
+        size_t nameLength;
+        size_t referenceLength = *p == '$' ? variableReferenceLength(p, end, &name, &nameLength) : 0;
+        const char *close = NULL;
+        if (*p == '`' || (*p == '$' && p + 1 < end && p[1] == '('))
+        {
+            close = findSubstitutionEnd(p, end);
+        }
+        if (referenceLength == 0 && close == NULL)
+        {
+            reserveCapture(&body, 1);
+            body.data[body.length++] = *p++;
+            continue;
+        }
+        if (referenceLength > 0)
+        {
+            expandVariable(name, nameLength, &output);
+            p += referenceLength;
+        }
+        else
+        {
+            const char *inner = p + (*p == '`' ? 1 : 2);
+            if (captureCommand(inner, close - inner, inFd, &output) == -1)
+            {
+                status = -1;
+                break;
+            }
+            p = close + 1;
+        }
+        reserveCapture(&body, output.length);
+        memcpy(body.data + body.length, output.data, output.length);
+        body.length += output.length;
+    }
+    if (status == 0)
+    {
+        redirect->body = arenaAlloc(&lineArena, body.length + 1);
+        memcpy(redirect->body, body.data, body.length);
+        redirect->bodyLength = body.length;
+    }
+    free(body.data);
+    free(output.data);
+    return status;
+}
+
+// Returns a copy of command with its substitutions run and their output put in place, in the
+// line arena. The substitutions read the stdin the command gets, inFd. A command that expanded
+// to no words runs as true so its redirections still happen. Returns NULL if a substitution could
+// not be started.
+struct AstNode *expandCommand(struct AstNode *command, int inFd)
+{
+    struct AstNode *expanded = newAstNode(command->type);
+    *expanded = *command;
+    expanded->hasExpansions = 0;
+
+    struct WordList list = {NULL, 0, 0};
+    for (int i = 0; i < command->argc; i++)
+    {
+        int firstWord = list.count;
+        if (expandWord(command->argv[i], &list, 1, inFd, &expanded->substitutionStatus) == -1)
+        {
+            return NULL;
+        }
+        // Words a glob or substitution produced are what a too long command is split at
+        if (list.count - firstWord > 1 && firstWord > 0)
+        {
+            expanded->batchStart = expanded->batchEnd == 0 ? firstWord : expanded->batchStart;
+            expanded->batchEnd = list.count;
+        }
+    }
+    if (list.count == 0)
+    {
+        addWord(&list, "true");
+        expanded->type = NODE_COMMAND;
+    }
+    expanded->argv = list.words;
+    expanded->argc = list.count;
+
+    // Assignment values stay one word each
+    if (command->assignmentCount > 0)
+    {
+        expanded->assignments = arenaAlloc(&lineArena, command->assignmentCount * sizeof(char *));
+    }
+    for (int i = 0; i < command->assignmentCount; i++)
+    {
+        const char *assignment = command->assignments[i];
+        size_t nameLength = strcspn(assignment, "=");
+        struct WordList value = {NULL, 0, 0};
+        if (expandWord((char *)assignment + nameLength + 1, &value, 0, inFd, &expanded->substitutionStatus) == -1)
+        {
+            return NULL;
+        }
+        const char *text = value.count > 0 ? value.words[0] : "";
+        size_t textLength = strlen(text);
+        char *expandedAssignment = arenaAlloc(&lineArena, nameLength + textLength + 2);
+        memcpy(expandedAssignment, assignment, nameLength + 1);
+        memcpy(expandedAssignment + nameLength + 1, text, textLength + 1);
+        expanded->assignments[i] = expandedAssignment;
+    }
+
+    struct Redirect **link = &expanded->redirects;
+    for (struct Redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        *link = arenaAlloc(&lineArena, sizeof(struct Redirect));
+        **link = *redirect;
+        if (redirect->op == OP_HEREDOC || redirect->op == OP_HEREDOC_TABS)
+        {
+            // A quoted delimiter keeps the body as written
+            if (!redirect->isQuoted && (memchr(redirect->body, '$', redirect->bodyLength) != NULL ||
+                                        memchr(redirect->body, '`', redirect->bodyLength) != NULL) &&
+                expandHereDocument(*link, inFd) == -1)
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            // A target stays one word, its output is not split
+            struct WordList target = {NULL, 0, 0};
+            if (expandWord(redirect->target, &target, 0, inFd, &expanded->substitutionStatus) == -1)
+            {
+                return NULL;
+            }
+            (*link)->target = target.count > 0 ? target.words[0] : "";
+        }
+        link = &(*link)->next;
+    }
+    return expanded;
+}
+
+// Environment of a program started with NAME=value words in front of it: the shell's own with
+// those replaced or added. Only such commands pay for a copy, all others get environ as it is.
+char **assignmentEnvironment(struct AstNode *command)
+{
+    loadVariables();
+    int count = variables.envCount;
+    char **envp = arenaAlloc(&lineArena, (count + command->assignmentCount + 1) * sizeof(char *));
+    memcpy(envp, variables.envp, count * sizeof(char *));
+    for (int i = 0; i < command->assignmentCount; i++)
+    {
+        char *assignment = command->assignments[i];
+        size_t prefixLength = strcspn(assignment, "=") + 1;
+        int j = 0;
+        while (j < count && strncmp(envp[j], assignment, prefixLength) != 0)
+        {
+            j++;
+        }
+        envp[j] = assignment;
+        count += j == count;
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+// Sets the NAME=value words of command as shell variables, exported with isExported
+void applyAssignments(struct AstNode *command, int isExported)
+{
+    for (int i = 0; i < command->assignmentCount; i++)
+    {
+        size_t nameLength = strcspn(command->assignments[i], "=");
+        setVariable(command->assignments[i], nameLength, command->assignments[i] + nameLength + 1, isExported);
+    }
+}
+
+// Space exec needs for count words: the strings with their terminators and a pointer to each
+size_t argumentSpace(char **words, int count)
+{
+    size_t space = 0;
+    for (int i = 0; i < count; i++)
+    {
+        space += strlen(words[i]) + 1 + sizeof(char *);
+    }
+    return space;
+}
+
+// What exec accepts for the arguments and the environment together. SHELL24_ARG_MAX can only
+// lower it.
+long argumentLimit()
+{
+    long limit = sysconf(_SC_ARG_MAX);
+    const char *setting = getenv("SHELL24_ARG_MAX");
+    long lowered = setting != NULL ? atol(setting) : 0;
+    if (lowered > 0 && (limit <= 0 || lowered < limit))
+    {
+        limit = lowered;
+    }
+    return limit > 0 ? limit : _POSIX_ARG_MAX;
+}
+
+// Plans the fewest batches a command splits into so each fits into what exec accepts next to
+// envp, like xargs does. The words from globs and substitutions are split, or every word after
+// the name when there are none, and the words around them go into every batch, so
+// cp *.c dir becomes cp a.c b.c dir, cp c.c d.c dir and so on. Filling every batch as far as it
+// goes in order gives the fewest. A command that fits, or has nothing to split, is one batch.
+void planBatches(struct AstNode *command, char **envp, struct BatchPlan *plan)
+{
+    plan->start = command->batchEnd > 0 ? command->batchStart : 1;
+    plan->end = command->batchEnd > 0 ? command->batchEnd : command->argc;
+    plan->count = 1;
+    plan->starts = NULL;
+    int envCount = 0;
+    while (envp[envCount] != NULL)
+    {
+        envCount++;
+    }
+    long space = argumentLimit() - ARGUMENT_HEADROOM - (long)argumentSpace(envp, envCount) - 2 * sizeof(char *) -
+                 (long)argumentSpace(command->argv, plan->start) -
+                 (long)argumentSpace(command->argv + plan->end, command->argc - plan->end);
+    if (plan->end - plan->start < 2 || space <= 0 ||
+        (long)argumentSpace(command->argv + plan->start, plan->end - plan->start) <= space)
+    {
+        return;
+    }
+
+    plan->starts = arenaAlloc(&lineArena, (plan->end - plan->start) * sizeof(int));
+    plan->count = 0;
+    long used = 0;
+    for (int i = plan->start; i < plan->end; i++)
+    {
+        // A word that does not fit even alone gets a batch of its own, for exec to refuse
+        long wordSpace = strlen(command->argv[i]) + 1 + sizeof(char *);
+        if (plan->count == 0 || used + wordSpace > space)
+        {
+            plan->starts[plan->count++] = i;
+            used = 0;
+        }
+        used += wordSpace;
+    }
+}
+
+// Runs the batches of a plan one after another, or SHELL24_BATCH_JOBS of them at a time.
+// Returns the status of the first batch that failed, in batch order, or 0.
+int runBatches(struct AstNode *command, struct SpawnOptions *options, struct BatchPlan *plan)
+{
+    const char *setting = getenv("SHELL24_BATCH_JOBS");
+    int jobs = setting != NULL && atoi(setting) > 0 ? atoi(setting) : 1;
+    int suffixCount = command->argc - plan->end;
+    char **args = malloc((command->argc + 1) * sizeof(char *));
+    pid_t *pids = calloc(plan->count, sizeof(pid_t));
+    int *statuses = calloc(plan->count, sizeof(int));
+    if (args == NULL || pids == NULL || statuses == NULL)
+    {
+        // Only the child that runs the batches stops here, the shell goes on
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(args, command->argv, plan->start * sizeof(char *));
+    int running = 0;
+    for (int i = 0; i < plan->count || running > 0;)
+    {
+        if (i < plan->count && running < jobs)
+        {
+            int runEnd = i + 1 < plan->count ? plan->starts[i + 1] : plan->end;
+            int runLength = runEnd - plan->starts[i];
+            memcpy(args + plan->start, command->argv + plan->starts[i], runLength * sizeof(char *));
+            memcpy(args + plan->start + runLength, command->argv + plan->end, suffixCount * sizeof(char *));
+            args[plan->start + runLength + suffixCount] = NULL;
+            pids[i] = spawnCommand(args, options);
+            statuses[i] = pids[i] < 0 ? -pids[i] : 0;
+            running += pids[i] > 0;
+            i++;
+            continue;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (pid == -1)
+        {
+            break;
+        }
+        for (int j = 0; j < plan->count; j++)
+        {
+            if (pids[j] == pid)
+            {
+                statuses[j] = decodeStatus(status);
+                running--;
+            }
+        }
+    }
+    int status = 0;
+    for (int i = 0; i < plan->count && status == 0; i++)
+    {
+        status = statuses[i];
+    }
+    free(args);
+    free(pids);
+    free(statuses);
+    return status;
+}
+
+// Starts the batches of a plan from a child of the shell, so a split command is one process of
+// its pipeline or job like any other and the batches join its process group
+pid_t startBatches(struct AstNode *command, struct SpawnOptions *options, struct BatchPlan *plan, int isOwnGroup,
+                   pid_t pgid)
+{
+    fflush(stdout);
+    double start = nowSeconds();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        resetChildSignals();
+        closePendingFilters();
+        if (isOwnGroup)
+        {
+            setpgid(0, pgid);
+        }
+        options->flags &= ~POSIX_SPAWN_SETPGROUP;
+        _exit(runBatches(command, options, plan));
+    }
+    if (isOwnGroup)
+    {
+        setpgid(pid, pgid != 0 ? pgid : pid);
+    }
+    traceEvent('X', "fork", trace.pid, start, nowSeconds() - start, "batches", plan->count, "fork %s", command->argv[0]);
+    traceEvent('B', "process", pid, start, 0, NULL, 0, "%s in %d batches", command->argv[0], plan->count);
+    return pid;
+}
+
+// Starts one stage with stdin/stdout connected to inFd/outFd and its own redirections applied
+// on top, in batches when its arguments are too long for one exec. With isOwnGroup the stages
+// of a job share the process group pgid, 0 starts a new group. Returns the pid or a negative
+// value if the stage could not be started.
+pid_t startStage(struct AstNode *command, int inFd, int outFd, int isOwnGroup, pid_t pgid)
+{
+    if (command->hasExpansions && (command = expandCommand(command, inFd)) == NULL)
+    {
+        return -1;
+    }
+    struct Builtin *builtin = command->type == NODE_COMMAND ? lookupBuiltin(command->argv[0]) : NULL;
+    if (command->type == NODE_CONCAT || builtin != NULL)
+    {
+        // Concatenation and builtins are done by the shell itself, in a child so the pipeline
+        // keeps flowing
+        fflush(stdout);
+        double start = nowSeconds();
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            perror("fork");
+            return -1;
+        }
+        if (pid == 0)
+        {
+            resetChildSignals();
+            closePendingFilters();
+            if (isOwnGroup)
+            {
+                setpgid(0, pgid);
+            }
+            if (activePlacement != NULL)
+            {
+                applyPlacement(activePlacement, placementIndex);
+            }
+            applyAssignments(command, 1);
+            if (inFd != STDIN_FILENO)
+            {
+                dup2(inFd, STDIN_FILENO);
+            }
+            if (outFd != STDOUT_FILENO)
+            {
+                dup2(outFd, STDOUT_FILENO);
+            }
+            _exit(runBuiltin(builtin, command));
+        }
+        if (isOwnGroup)
+        {
+            setpgid(pid, pgid != 0 ? pgid : pid);
+        }
+        traceEvent('X', "fork", trace.pid, start, nowSeconds() - start, "pid", pid, "fork %s",
+                   command->type == NODE_CONCAT ? "#" : command->argv[0]);
+        traceEvent('B', "process", pid, start, 0, NULL, 0, "%s", command->type == NODE_CONCAT ? "#" : command->argv[0]);
+        placementIndex += activePlacement != NULL;
+        return pid;
+    }
+
+    struct SpawnOptions options;
+    initSpawnOptions(&options);
+    if (inFd != STDIN_FILENO)
+    {
+        spawnDup(&options, inFd, STDIN_FILENO);
+    }
+    if (outFd != STDOUT_FILENO)
+    {
+        spawnDup(&options, outFd, STDOUT_FILENO);
+    }
+    if (isOwnGroup)
+    {
+        spawnSetProcessGroup(&options, pgid);
+    }
+    if (command->assignmentCount > 0)
+    {
+        options.envp = assignmentEnvironment(command);
+    }
+
+    // Redirection files are opened here so a missing file is reported once, by the shell. The
+    // child applies them in order, duplications included.
+    int redirectCount = 0;
+    int isHighFdUsed = 0;
+    for (struct Redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        redirectCount++;
+        isHighFdUsed |= redirect->fd > STDERR_FILENO;
+    }
+    int openedFds[redirectCount + 1];
+    int openedCount = 0;
+    pid_t pid = 0;
+    for (struct Redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        if (redirect->op == OP_DUP_OUT || redirect->op == OP_DUP_IN)
+        {
+            if (strcmp(redirect->target, "-") == 0)
+            {
+                spawnClose(&options, redirect->fd);
+            }
+            else
+            {
+                spawnDup(&options, atoi(redirect->target), redirect->fd);
+            }
+            continue;
+        }
+        int fd = openRedirect(redirect);
+        if (fd == -1)
+        {
+            pid = -1;
+            break;
+        }
+        if (isHighFdUsed && fd < 10)
+        {
+            // 3>x could land on a file opened for an earlier redirection before the child
+            // duplicates it, so those are kept above the descriptors people name
+            int movedFd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            close(fd);
+            fd = movedFd;
+        }
+        openedFds[openedCount++] = fd;
+        spawnDup(&options, fd, redirect->fd);
+    }
+    if (pid == 0)
+    {
+        // An argument list longer than exec takes is run in batches instead of failing with E2BIG
+        struct BatchPlan plan;
+        planBatches(command, options.envp != NULL ? options.envp : environ, &plan);
+        pid = plan.count > 1 ? startBatches(command, &options, &plan, isOwnGroup, pgid)
+                             : spawnCommand(command->argv, &options);
+    }
+    destroySpawnOptions(&options);
+
+    for (int i = 0; i < openedCount; i++)
+    {
+        close(openedFds[i]);
+    }
+    return pid;
+}
+
+// Pipe buffer size asked for by SHELL24_PIPE_SIZE, in bytes with an optional K or M suffix.
+// Returns 0 to keep the kernel default.
+int pipeSizeSetting()
+{
+    const char *value = getenv("SHELL24_PIPE_SIZE");
+    if (value == NULL)
+    {
+        return 0;
+    }
+    char *end;
+    long size = strtol(value, &end, 10);
+    if (*end == 'K' || *end == 'k')
+    {
+        size <<= 10;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        size <<= 20;
+    }
+    return size > 0 && size <= (1L << 30) ? (int)size : 0;
+}
+
+// Creates a pipe with O_CLOEXEC and, when pipeSize is not 0, that much buffer. The kernel caps
+// the size at /proc/sys/fs/pipe-max-size for unprivileged users, which is not treated as an error.
+int createPipe(int pipeFds[2], int pipeSize)
+{
+    if (pipe2(pipeFds, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+    traceEvent('i', "pipe", trace.pid, nowSeconds(), 0, "readFd", pipeFds[0], "pipe %d>%d", pipeFds[1], pipeFds[0]);
+    if (pipeSize != 0 && fcntl(pipeFds[1], F_SETPIPE_SZ, pipeSize) == -1 && errno != EPERM)
+    {
+        perror("F_SETPIPE_SZ");
+    }
+    return 0;
+}
+
+// Starts a relay between two pipeline stages that splices everything from inFd to outFd and
+// reports the bytes and throughput of its hop on stderr once the writer is done. closeFd is the
+// read end of outFd's pipe, which the relay must not hold or the next stage exiting early would
+// never be noticed. Returns the pid or -1.
+pid_t startRelay(int inFd, int outFd, int closeFd, int hop, int isOwnGroup, pid_t pgid)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid != 0)
+    {
+        if (isOwnGroup)
+        {
+            setpgid(pid, pgid != 0 ? pgid : pid);
+        }
+        return pid;
+    }
+
+    resetChildSignals();
+    closePendingFilters();
+    if (isOwnGroup)
+    {
+        setpgid(0, pgid);
+    }
+    close(closeFd);
+    // A reader that exits early ends the hop with EPIPE, which is still worth reporting
+    signal(SIGPIPE, SIG_IGN);
+    int pipeSize = fcntl(outFd, F_GETPIPE_SZ);
+    long long total = 0;
+    double start = nowSeconds();
+    while (1)
+    {
+        ssize_t moved = splice(inFd, NULL, outFd, NULL, pipeSize > 0 ? pipeSize : STREAM_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (moved <= 0)
+        {
+            break;
+        }
+        total += moved;
+    }
+    double seconds = nowSeconds() - start;
+    fprintf(stderr, "pipe %d: %lld bytes, %d KB buffer, %.3f s, %.1f MB/s\n", hop, total, pipeSize >> 10, seconds,
+            seconds > 0 ? total / seconds / (1 << 20) : 0.0);
+    _exit(0);
+}
+
+// Appends a finished stage to report
+void addStageUsage(struct UsageReport *report, struct StageUsage *stage)
+{
+    if (report->stageCount == report->capacity)
+    {
+        report->capacity = report->capacity == 0 ? 16 : report->capacity * 2;
+        report->stages = realloc(report->stages, report->capacity * sizeof(struct StageUsage));
+        if (report->stages == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    report->stages[report->stageCount++] = *stage;
+}
+
+double timevalSeconds(struct timeval *time)
+{
+    return time->tv_sec + time->tv_usec / 1e6;
+}
+
+// Sets result to what was used between before and after, each holding the shell's own usage
+// followed by that of its reaped children. The peak RSS is the larger of the two, not a difference.
+void subtractUsage(struct rusage *result, struct rusage after[2], struct rusage before[2])
+{
+    memset(result, 0, sizeof(struct rusage));
+    for (int i = 0; i < 2; i++)
+    {
+        timersub(&after[i].ru_utime, &before[i].ru_utime, &after[i].ru_utime);
+        timersub(&after[i].ru_stime, &before[i].ru_stime, &after[i].ru_stime);
+        timeradd(&result->ru_utime, &after[i].ru_utime, &result->ru_utime);
+        timeradd(&result->ru_stime, &after[i].ru_stime, &result->ru_stime);
+        result->ru_nvcsw += after[i].ru_nvcsw - before[i].ru_nvcsw;
+        result->ru_nivcsw += after[i].ru_nivcsw - before[i].ru_nivcsw;
+        if (after[i].ru_maxrss > result->ru_maxrss)
+        {
+            result->ru_maxrss = after[i].ru_maxrss;
+        }
+    }
+}
+
+// Prints one row of a usage table, command NULL is a pipe relay
+void printUsageRow(double real, struct rusage *usage, struct AstNode *command, const char *label)
+{
+    fprintf(stderr, "%8.3fs %8.3fs %8.3fs %8ldK %7ld %7ld  ", real, timevalSeconds(&usage->ru_utime),
+            timevalSeconds(&usage->ru_stime), usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+    if (command != NULL)
+    {
+        formatNode(stderr, command);
+    }
+    else
+    {
+        fputs(label, stderr);
+    }
+    fputc('\n', stderr);
+}
+
+// Runs node while collecting the resource use of every stage it runs, then prints one row per
+// stage and a total on stderr so the slow stage of a pipeline or chain stands out
+int executeTimed(struct AstNode *node)
+{
+    struct UsageReport report = {nowSeconds()};
+    activeUsageReport = &report;
+    int status = executeNode(node);
+    activeUsageReport = NULL;
+    double real = nowSeconds() - report.start;
+
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    fflush(stdout);
+    fprintf(stderr, "%9s %9s %9s %9s %7s %7s  %s\n", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "command");
+    for (int i = 0; i < report.stageCount; i++)
+    {
+        struct StageUsage *stage = &report.stages[i];
+        printUsageRow(stage->end - stage->start, &stage->usage, stage->command, "(pipe relay)");
+        timeradd(&total.ru_utime, &stage->usage.ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &stage->usage.ru_stime, &total.ru_stime);
+        total.ru_nvcsw += stage->usage.ru_nvcsw;
+        total.ru_nivcsw += stage->usage.ru_nivcsw;
+        if (stage->usage.ru_maxrss > total.ru_maxrss)
+        {
+            total.ru_maxrss = stage->usage.ru_maxrss;
+        }
+    }
+    printUsageRow(real, &total, NULL, "total");
+    free(report.stages);
+    return status;
+}
+
+// Returns the number of newlines in [p, end)
+size_t countNewlinesScalar(const char *p, const char *end)
+{
+    size_t count = 0;
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+    {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+// Returns the first place the length bytes of text occur in [p, end), or NULL
+const char *findStringScalar(const char *p, const char *end, const char *text, size_t length)
+{
+    return memmem(p, end - p, text, length);
+}
+
+#ifdef LEXER_HAS_SIMD
+// Compares 16 bytes at a time and adds the hits up bytewise, so the total is only gathered
+// every 255 blocks before a byte counter could overflow
+size_t countNewlinesSse2(const char *p, const char *end)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    while (end - p >= 16)
+    {
+        __m128i counters = zero;
+        const char *blockEnd = p + 16 * ((end - p) / 16 < 255 ? (end - p) / 16 : 255);
+        for (; p < blockEnd; p += 16)
+        {
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), newline));
+        }
+        __m128i sums = _mm_sad_epu8(counters, zero);
+        count += _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+    return count + countNewlinesScalar(p, end);
+}
+
+__attribute__((target("avx2"))) size_t countNewlinesAvx2(const char *p, const char *end)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    while (end - p >= 64)
+    {
+        // Two vectors per step so the loads of one overlap the compare of the other
+        __m256i counters = zero;
+        __m256i moreCounters = zero;
+        const char *blockEnd = p + 64 * ((end - p) / 64 < 255 ? (end - p) / 64 : 255);
+        for (; p < blockEnd; p += 64)
+        {
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), newline));
+            moreCounters =
+                _mm256_sub_epi8(moreCounters, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), newline));
+        }
+        __m256i sums = _mm256_add_epi64(_mm256_sad_epu8(counters, zero), _mm256_sad_epu8(moreCounters, zero));
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) + _mm256_extract_epi64(sums, 2) +
+                 _mm256_extract_epi64(sums, 3);
+    }
+    return count + countNewlinesSse2(p, end);
+}
+
+// Finds text by comparing its first and last byte at 16 positions at once, only positions
+// where both agree are compared in full
+const char *findStringSse2(const char *p, const char *end, const char *text, size_t length)
+{
+    if (length < 2)
+    {
+        return findStringScalar(p, end, text, length);
+    }
+    const __m128i first = _mm_set1_epi8(text[0]);
+    const __m128i last = _mm_set1_epi8(text[length - 1]);
+    while (end - p >= (ptrdiff_t)(length - 1 + 16))
+    {
+        __m128i firstHits = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)p));
+        __m128i lastHits = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)(p + length - 1)));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(firstHits, lastHits));
+        while (mask != 0)
+        {
+            const char *candidate = p + __builtin_ctz(mask);
+            if (memcmp(candidate + 1, text + 1, length - 2) == 0)
+            {
+                return candidate;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+    return findStringScalar(p, end, text, length);
+}
+
+__attribute__((target("avx2"))) const char *findStringAvx2(const char *p, const char *end, const char *text, size_t length)
+{
+    if (length < 2)
+    {
+        return findStringScalar(p, end, text, length);
+    }
+    const __m256i first = _mm256_set1_epi8(text[0]);
+    const __m256i last = _mm256_set1_epi8(text[length - 1]);
+    while (end - p >= (ptrdiff_t)(length - 1 + 32))
+    {
+        __m256i firstHits = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)p));
+        __m256i lastHits = _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i *)(p + length - 1)));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(firstHits, lastHits));
+        while (mask != 0)
+        {
+            const char *candidate = p + __builtin_ctz(mask);
+            if (memcmp(candidate + 1, text + 1, length - 2) == 0)
+            {
+                return candidate;
+            }
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    return findStringSse2(p, end, text, length);
+}
+#endif
+
+// Kernels picked by initFilters for the running CPU
+size_t (*countNewlines)(const char *p, const char *end) = countNewlinesScalar;
+const char *(*findString)(const char *p, const char *end, const char *text, size_t length) = findStringScalar;
+
+void initFilters()
+{
+#ifdef LEXER_HAS_SIMD
+    __builtin_cpu_init();
+    countNewlines = __builtin_cpu_supports("avx2") ? countNewlinesAvx2 : countNewlinesSse2;
+    findString = __builtin_cpu_supports("avx2") ? findStringAvx2 : findStringSse2;
+#endif
+}
+
+// Reads the options of a command the filter threads can run. Returns NULL when it has to be
+// a process: an option they do not know, a regular expression, redirections, expansions, or a
+// first stage that would read the shell's own input.
+struct FilterStage *prepareFilter(struct AstNode *command, int isFirstStage)
+{
+    const char *setting = getenv("SHELL24_FILTERS");
+    if ((setting != NULL && strcmp(setting, "0") == 0) || command->type != NODE_COMMAND || command->hasExpansions ||
+        command->redirects != NULL || command->assignmentCount > 0 || command->argc == 0)
+    {
+        return NULL;
+    }
+    char **argv = command->argv;
+    int argc = command->argc;
+    struct FilterStage filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.lineLimit = 10;
+    int i = 1;
+    if (strcmp(argv[0], "cat") == 0)
+    {
+        filter.type = FILTER_CAT;
+        for (int j = 1; j < argc; j++)
+        {
+            if (argv[j][0] == '-')
+            {
+                return NULL;
+            }
+        }
+        if (isFirstStage && argc == 1)
+        {
+            return NULL;
+        }
+        i = argc;
+    }
+    else if (strcmp(argv[0], "head") == 0)
+    {
+        filter.type = FILTER_HEAD;
+        const char *count = NULL;
+        if (i < argc && strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            count = argv[i + 1];
+            i += 2;
+        }
+        else if (i < argc && argv[i][0] == '-')
+        {
+            count = argv[i] + (argv[i][1] == 'n' ? 2 : 1);
+            i++;
+        }
+        if (count != NULL)
+        {
+            char *end;
+            filter.lineLimit = strtoll(count, &end, 10);
+            if (end == count || *end != '\0' || filter.lineLimit < 0)
+            {
+                return NULL;
+            }
+        }
+    }
+    else if (strcmp(argv[0], "wc") == 0)
+    {
+        filter.type = FILTER_WC;
+        for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+        {
+            for (const char *option = argv[i] + 1; *option != '\0'; option++)
+            {
+                if (*option == 'l' || *option == 'w' || *option == 'c')
+                {
+                    filter.isCountingLines |= *option == 'l';
+                    filter.isCountingWords |= *option == 'w';
+                    filter.isCountingBytes |= *option == 'c';
+                }
+                else
+                {
+                    return NULL;
+                }
+            }
+        }
+        if (!filter.isCountingLines && !filter.isCountingWords && !filter.isCountingBytes)
+        {
+            filter.isCountingLines = filter.isCountingWords = filter.isCountingBytes = 1;
+        }
+    }
+    else if (strcmp(argv[0], "grep") == 0)
+    {
+        filter.type = FILTER_GREP;
+        int isFixed = 0;
+        for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+        {
+            for (const char *option = argv[i] + 1; *option != '\0'; option++)
+            {
+                if (*option == 'F' || *option == 'v' || *option == 'c')
+                {
+                    isFixed |= *option == 'F';
+                    filter.isInverted |= *option == 'v';
+                    filter.isCounting |= *option == 'c';
+                }
+                else
+                {
+                    return NULL;
+                }
+            }
+        }
+        if (i >= argc)
+        {
+            return NULL;
+        }
+        // Without -F only a pattern that has no special characters is a fixed string
+        filter.pattern = argv[i++];
+        filter.patternLength = strlen(filter.pattern);
+        if (filter.patternLength == 0 || strchr(filter.pattern, '\n') != NULL ||
+            (!isFixed && strpbrk(filter.pattern, ".[]*^$\\") != NULL))
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        return NULL;
+    }
+    if (i < argc || (isFirstStage && filter.type != FILTER_CAT))
+    {
+        return NULL;
+    }
+
+    // Files are opened by the shell, one it cannot open is left to cat to report
+    if (filter.type == FILTER_CAT && argc > 1)
+    {
+        filter.fds = malloc((argc - 1) * sizeof(int));
+        for (int j = 1; j < argc; j++)
+        {
+            int fd = strcmp(argv[j], "-") == 0 ? -2 : openForStreaming(argv[j]);
+            if (fd == -1)
+            {
+                while (filter.fdCount > 0)
+                {
+                    if (filter.fds[--filter.fdCount] >= 0)
+                    {
+                        close(filter.fds[filter.fdCount]);
+                    }
+                }
+                free(filter.fds);
+                return NULL;
+            }
+            filter.fds[filter.fdCount++] = fd;
+        }
+    }
+    struct FilterStage *stage = malloc(sizeof(struct FilterStage));
+    *stage = filter;
+    stage->usage.command = command;
+    if (filter.type != FILTER_CAT)
+    {
+        stage->bufferSize = STREAM_BUFFER_SIZE;
+        stage->buffer = malloc(stage->bufferSize + 1);
+        stage->output = malloc(STREAM_BUFFER_SIZE);
+    }
+    return stage;
+}
+
+void releaseFilter(struct FilterStage *stage)
+{
+    if (__atomic_sub_fetch(&stage->references, 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        return;
+    }
+    free(stage->fds);
+    free(stage->buffer);
+    free(stage->output);
+    free(stage);
+}
+
+// Writes all of data, returns -1 when the reader is gone or the write fails
+int writeFilterOutput(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+        written = written > 0 ? written : 0;
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Queues output of a filter, writing only when the output buffer is full. Big pieces go out
+// directly.
+int emitFilterOutput(struct FilterStage *stage, const char *data, size_t length)
+{
+    if (stage->outputLength + length > STREAM_BUFFER_SIZE)
+    {
+        if (writeFilterOutput(stage->outFd, stage->output, stage->outputLength) == -1)
+        {
+            return -1;
+        }
+        stage->outputLength = 0;
+        if (length > STREAM_BUFFER_SIZE / 2)
+        {
+            return writeFilterOutput(stage->outFd, data, length);
+        }
+    }
+    memcpy(stage->output + stage->outputLength, data, length);
+    stage->outputLength += length;
+    return 0;
+}
+
+// Reads more input after the kept bytes at the start of the buffer. Returns the bytes read, 0
+// at the end of the input and -1 on an error or Ctrl+C.
+ssize_t readFilterInput(struct FilterStage *stage, size_t kept)
+{
+    if (kept == stage->bufferSize)
+    {
+        // A line longer than the buffer, which doubles to hold it
+        stage->bufferSize *= 2;
+        stage->buffer = realloc(stage->buffer, stage->bufferSize + 1);
+        if (stage->buffer == NULL)
+        {
+            return -1;
+        }
+    }
+    while (!isFilterInterrupted)
+    {
+        ssize_t length = read(stage->inFd, stage->buffer + kept, stage->bufferSize - kept);
+        if (length != -1 || errno != EINTR)
+        {
+            return length;
+        }
+    }
+    return -1;
+}
+
+int runCatFilter(struct FilterStage *stage)
+{
+    int status = 0;
+    for (int i = 0; i < (stage->fds != NULL ? stage->fdCount : 1) && !isFilterInterrupted; i++)
+    {
+        int fd = stage->fds == NULL || stage->fds[i] == -2 ? stage->inFd : stage->fds[i];
+        if (streamFile(fd, stage->outFd) == -1)
+        {
+            status = errno == EPIPE ? 128 + SIGPIPE : 1;
+            break;
+        }
+    }
+    return isFilterInterrupted ? 128 + SIGINT : status;
+}
+
+// Passes lines on until lineLimit newlines went through, then closes the input early so the
+// writer gets SIGPIPE like it would from head
+int runHeadFilter(struct FilterStage *stage)
+{
+    long long remaining = stage->lineLimit;
+    ssize_t length;
+    while (remaining > 0 && (length = readFilterInput(stage, 0)) > 0)
+    {
+        const char *end = stage->buffer + length;
+        const char *p = stage->buffer;
+        while (remaining > 0 && (p = memchr(p, '\n', end - p)) != NULL)
+        {
+            p++;
+            remaining--;
+        }
+        if (writeFilterOutput(stage->outFd, stage->buffer, (remaining == 0 ? p : end) - stage->buffer) == -1)
+        {
+            return errno == EPIPE ? 128 + SIGPIPE : 1;
+        }
+    }
+    return isFilterInterrupted ? 128 + SIGINT : 0;
+}
+
+int runWcFilter(struct FilterStage *stage)
+{
+    long long lines = 0;
+    long long words = 0;
+    long long bytes = 0;
+    int isInWord = 0;
+    ssize_t length;
+    while ((length = readFilterInput(stage, 0)) > 0)
+    {
+        const char *end = stage->buffer + length;
+        bytes += length;
+        if (stage->isCountingLines)
+        {
+            lines += countNewlines(stage->buffer, end);
+        }
+        for (const char *p = stage->buffer; stage->isCountingWords && p < end; p++)
+        {
+            int isSpace = *p == ' ' || (*p >= '\t' && *p <= '\r');
+            words += !isSpace && !isInWord;
+            isInWord = !isSpace;
+        }
+    }
+    if (length == -1)
+    {
+        return isFilterInterrupted ? 128 + SIGINT : 1;
+    }
+    // One count alone is printed as it is, several in columns of 7 like wc does for its input
+    int countCount = stage->isCountingLines + stage->isCountingWords + stage->isCountingBytes;
+    long long counts[3] = {lines, words, bytes};
+    int isCounted[3] = {stage->isCountingLines, stage->isCountingWords, stage->isCountingBytes};
+    char text[96];
+    int textLength = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        if (isCounted[i])
+        {
+            textLength += snprintf(text + textLength, sizeof(text) - textLength, "%s%*lld", textLength > 0 ? " " : "",
+                                   countCount == 1 ? 0 : 7, counts[i]);
+        }
+    }
+    text[textLength++] = '\n';
+    return writeFilterOutput(stage->outFd, text, textLength) == -1 ? 1 : 0;
+}
+
+// Fixed string grep. Matches are found with findString on whole blocks of lines, and only the
+// lines around a match are looked at. With -v the lines between two matching lines go out in
+// one piece.
+int runGrepFilter(struct FilterStage *stage)
+{
+    long long matchCount = 0;
+    size_t kept = 0;
+    int isEnd = 0;
+    while (!isEnd)
+    {
+        ssize_t length = readFilterInput(stage, kept);
+        if (length == -1)
+        {
+            return isFilterInterrupted ? 128 + SIGINT : 2;
+        }
+        size_t filled = kept + length;
+        if (length == 0)
+        {
+            // A last line without a newline is still a line
+            isEnd = 1;
+            if (filled == 0)
+            {
+                break;
+            }
+            if (stage->buffer[filled - 1] != '\n')
+            {
+                stage->buffer[filled++] = '\n';
+            }
+        }
+        const char *p = stage->buffer;
+        const char *end = stage->buffer + filled;
+        const char *lastNewline = memrchr(p, '\n', filled);
+        if (lastNewline == NULL)
+        {
+            kept = filled;
+            continue;
+        }
+        end = lastNewline + 1;
+
+        const char *match;
+        while (p < end && (match = findString(p, end, stage->pattern, stage->patternLength)) != NULL)
+        {
+            const char *lineStart = memrchr(p, '\n', match - p);
+            lineStart = lineStart != NULL ? lineStart + 1 : p;
+            const char *lineEnd = (const char *)memchr(match, '\n', end - match) + 1;
+            int result = 0;
+            if (stage->isInverted)
+            {
+                matchCount += stage->isCounting ? (long long)countNewlines(p, lineStart) : lineStart > p;
+                if (!stage->isCounting)
+                {
+                    result = emitFilterOutput(stage, p, lineStart - p);
+                }
+            }
+            else
+            {
+                matchCount++;
+                if (!stage->isCounting)
+                {
+                    result = emitFilterOutput(stage, lineStart, lineEnd - lineStart);
+                }
+            }
+            if (result == -1)
+            {
+                return errno == EPIPE ? 128 + SIGPIPE : 2;
+            }
+            p = lineEnd;
+        }
+        if (stage->isInverted && p < end)
+        {
+            matchCount += stage->isCounting ? (long long)countNewlines(p, end) : 1;
+            if (!stage->isCounting && emitFilterOutput(stage, p, end - p) == -1)
+            {
+                return errno == EPIPE ? 128 + SIGPIPE : 2;
+            }
+        }
+        kept = stage->buffer + filled - end;
+        memmove(stage->buffer, end, kept);
+    }
+
+    if (stage->isCounting)
+    {
+        char text[32];
+        int textLength = snprintf(text, sizeof(text), "%lld\n", matchCount);
+        emitFilterOutput(stage, text, textLength);
+    }
+    if (writeFilterOutput(stage->outFd, stage->output, stage->outputLength) == -1)
+    {
+        return errno == EPIPE ? 128 + SIGPIPE : 2;
+    }
+    return matchCount > 0 ? 0 : 1;
+}
+
+void *runFilterThread(void *argument)
+{
+    struct FilterStage *stage = argument;
+    // A reader that went away shows up as EPIPE. The SIGPIPE stays pending on this thread, which
+    // drops it when it ends, so the shell is not killed by it.
+    sigset_t pipeSignal;
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSignal, NULL);
+
+    switch (stage->type)
+    {
+    case FILTER_CAT:
+        stage->status = runCatFilter(stage);
+        break;
+    case FILTER_HEAD:
+        stage->status = runHeadFilter(stage);
+        break;
+    case FILTER_WC:
+        stage->status = runWcFilter(stage);
+        break;
+    case FILTER_GREP:
+        stage->status = runGrepFilter(stage);
+        break;
+    }
+    getrusage(RUSAGE_THREAD, &stage->usage.usage);
+    stage->usage.end = nowSeconds();
+    traceEvent('X', "filter", gettid(), stage->usage.start, stage->usage.end - stage->usage.start, "status", stage->status,
+               "%s", stage->usage.command->argv[0]);
+    closeFilterFds(stage);
+    releaseFilter(stage);
+    return NULL;
+}
+
+// Starts the filter on a thread that takes over its inFd and outFd. Without a thread the
+// descriptors are closed here, so its neighbours see the end of their pipes, and the stage fails
+// like one that could not be spawned.
+void startFilter(struct FilterStage *stage)
+{
+    stage->references = 2;
+    stage->usage.start = nowSeconds();
+    fflush(stdout);
+    int error = pthread_create(&stage->thread, NULL, runFilterThread, stage);
+    if (error == 0)
+    {
+        stage->isStarted = 1;
+        return;
+    }
+    errno = error;
+    perror("pthread_create");
+    stage->references = 1;
+    stage->status = 127;
+    closeFilterFds(stage);
+}
+
+// Runs stages connected by pipes, each stage is exactly one process or, in the foreground, a
+// filter thread when prepareFilter takes it. In the foreground it waits for all of them and
+// returns the status of the last one. SHELL24_PIPE_SIZE sets the buffer size of the pipes and
+// SHELL24_PIPE_STATS puts a counting relay on every hop, both are read per pipeline so export
+// changes them for the next command.
+int executePipeline(struct AstNode **stages, int stageCount, int isBackground)
+{
+    // The relays go between the stages so the last pid stays the last stage
+    pid_t pids[stageCount * 2];
+    struct StageUsage usage[stageCount * 2];
+    int processCount = 0;
+    pid_t pgid = 0;
+    int inFd = STDIN_FILENO;
+    // Every job gets its own process group at a terminal so Ctrl+C and Ctrl+Z reach only it
+    int isOwnGroup = isBackground || isInteractive;
+    int pipeSize = pipeSizeSetting();
+    int isRelayed = getenv("SHELL24_PIPE_STATS") != NULL;
+    // A single command gains nothing from a thread, it is a process like before. Filter
+    // threads start after every process, so the children forked on the way can close the pipe
+    // ends of the filters while nothing else is using them.
+    struct FilterStage *filters[stageCount];
+    isFilterInterrupted = 0;
+    pendingFilters = filters;
+
+    for (int i = 0; i < stageCount; i++)
+    {
+        // Only the pipes between this stage and the next are open at any time
+        int pipeFds[2] = {-1, STDOUT_FILENO};
+        int relayFds[2] = {-1, -1};
+        if (i < stageCount - 1 && (createPipe(pipeFds, pipeSize) == -1 || (isRelayed && createPipe(relayFds, pipeSize) == -1)))
+        {
+            if (pipeFds[0] != -1)
+            {
+                close(pipeFds[0]);
+                close(pipeFds[1]);
+            }
+            pipeFds[0] = -1;
+            pipeFds[1] = STDOUT_FILENO;
+            relayFds[0] = -1;
+            stageCount = i + 1;
+        }
+
+        int outFd = relayFds[0] != -1 ? relayFds[1] : pipeFds[1];
+        filters[i] = !isBackground && stageCount > 1 ? prepareFilter(stages[i], i == 0) : NULL;
+        if (filters[i] != NULL)
+        {
+            filters[i]->inFd = inFd;
+            filters[i]->outFd = outFd;
+        }
+        pendingFilterCount = i + 1;
+        pid_t pid = 0;
+        if (filters[i] == NULL)
+        {
+            usage[processCount] = (struct StageUsage){stages[i], nowSeconds()};
+            pid = startStage(stages[i], inFd, outFd, isOwnGroup, pgid);
+            pids[processCount++] = pid;
+        }
+        if (isOwnGroup && pgid == 0 && pid > 0)
+        {
+            pgid = pid;
+            if (!isBackground)
+            {
+                giveTerminalTo(pgid);
+            }
+        }
+
+        // The descriptors of a filter are closed by its thread
+        if (inFd != STDIN_FILENO && filters[i] == NULL)
+        {
+            close(inFd);
+        }
+        if (relayFds[0] != -1)
+        {
+            if (filters[i] == NULL)
+            {
+                close(relayFds[1]);
+            }
+            usage[processCount] = (struct StageUsage){NULL, nowSeconds()};
+            pids[processCount] = startRelay(relayFds[0], pipeFds[1], pipeFds[0], i + 1, isOwnGroup, pgid);
+            if (isOwnGroup && pgid == 0 && pids[processCount] > 0)
+            {
+                pgid = pids[processCount];
+            }
+            processCount++;
+            close(relayFds[0]);
+        }
+        if (pipeFds[1] != STDOUT_FILENO && (filters[i] == NULL || relayFds[0] != -1))
+        {
+            close(pipeFds[1]);
+        }
+        inFd = pipeFds[0];
+    }
+    pendingFilterCount = 0;
+    for (int i = 0; i < stageCount; i++)
+    {
+        if (filters[i] != NULL)
+        {
+            startFilter(filters[i]);
+        }
+    }
+
+    struct Job job;
+    initJob(&job, pids, processCount, pgid);
+    if (isBackground)
+    {
+        if (job.remaining > 0)
+        {
+            struct Job *added = addJob(&job, formatStages(stages, stageCount));
+            printf("[%d] Program is running in the background with PID: %d\n", added->id, pgid);
+        }
+        return 0;
+    }
+
+    // Wait for all child processes to finish, a stopped pipeline becomes a job
+    job.usage = activeUsageReport != NULL ? usage : NULL;
+    foregroundPgid = pgid;
+    double waitStart = nowSeconds();
+    int status = waitForJob(&job);
+    foregroundPgid = 0;
+    if (pgid > 0)
+    {
+        giveTerminalTo(0);
+    }
+    for (int i = 0; job.usage != NULL && i < processCount; i++)
+    {
+        if (usage[i].end != 0)
+        {
+            addStageUsage(activeUsageReport, &usage[i]);
+        }
+    }
+
+    // Threads of a stopped job are left running, they end once their input or output does
+    for (int i = 0; i < stageCount; i++)
+    {
+        if (filters[i] == NULL)
+        {
+            continue;
+        }
+        if (job.state == JOB_STOPPED && filters[i]->isStarted)
+        {
+            pthread_detach(filters[i]->thread);
+        }
+        else
+        {
+            if (filters[i]->isStarted)
+            {
+                pthread_join(filters[i]->thread, NULL);
+            }
+            if (job.usage != NULL)
+            {
+                addStageUsage(activeUsageReport, &filters[i]->usage);
+            }
+            if (i == stageCount - 1)
+            {
+                status = filters[i]->status;
+            }
+        }
+        releaseFilter(filters[i]);
+    }
+    traceEvent('X', "wait", trace.pid, waitStart, nowSeconds() - waitStart, "status", status, "wait");
+    if (job.state == JOB_STOPPED)
+    {
+        job.usage = NULL;
+        struct Job *added = addJob(&job, formatStages(stages, stageCount));
+        printf("\n");
+        printJob(added);
+        added->isChanged = 0;
+    }
+    return status;
+}
+
+// This function will execute the command
+int executeCommand(struct AstNode *command)
+{
+    // Substitutions run first, the command name may come from one
+    int isAssignmentOnly = command->argc == 0;
+    if (command->hasExpansions && (command = expandCommand(command, STDIN_FILENO)) == NULL)
+    {
+        return 1;
+    }
+    if (isAssignmentOnly)
+    {
+        // Its status is that of the last substitution in it, as in sh
+        applyAssignments(command, -1);
+        return command->substitutionStatus;
+    }
+    // Builtins are looked up before anything is spawned
+    struct Builtin *builtin = command->type == NODE_COMMAND ? lookupBuiltin(command->argv[0]) : NULL;
+    if (builtin == NULL && command->type != NODE_CONCAT)
+    {
+        return executePipeline(&command, 1, 0);
+    }
+
+    // In-process commands are timed by what the shell and the children it waited for used
+    struct StageUsage usage = {command, nowSeconds()};
+    struct rusage before[2];
+    if (activeUsageReport != NULL)
+    {
+        getrusage(RUSAGE_SELF, &before[0]);
+        getrusage(RUSAGE_CHILDREN, &before[1]);
+    }
+    int status;
+    if (builtin != NULL)
+    {
+        status = runBuiltin(builtin, command);
+    }
+    else
+    {
+        // Txt file concatenation, streamed straight to the output
+        status = runBuiltin(NULL, command);
+    }
+    if (activeUsageReport != NULL)
+    {
+        struct rusage after[2];
+        getrusage(RUSAGE_SELF, &after[0]);
+        getrusage(RUSAGE_CHILDREN, &after[1]);
+        usage.end = nowSeconds();
+        subtractUsage(&usage.usage, after, before);
+        addStageUsage(activeUsageReport, &usage);
+    }
+    return status;
+}
+
+int executePlaced(struct AstNode *node, int isBackground);
+
+// Runs a node without waiting for it. Commands and pipelines are spawned into their own process
+// group directly, anything bigger gets a forked copy of the shell to walk it.
+void executeBackground(struct AstNode *node)
+{
+    if (node->placement != NULL && activePlacement != node->placement)
+    {
+        executePlaced(node, 1);
+        return;
+    }
+    if (node->type == NODE_COMMAND)
+    {
+        executePipeline(&node, 1, 1);
+        return;
+    }
+    if (node->type == NODE_PIPELINE)
+    {
+        executePipeline(node->stages, node->stageCount, 1);
+        return;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return;
+    }
+    if (pid == 0)
+    {
+        // The subshell gets its own job control state and never touches the terminal
+        setpgid(0, 0);
+        resetChildSignals();
+        isInteractive = 0;
+        activeUsageReport = NULL;
+        initJobControl();
+        exit(executeNode(node));
+    }
+    setpgid(pid, pid);
+
+    struct Job job;
+    initJob(&job, &pid, 1, pid);
+    char *commandText = NULL;
+    size_t commandTextLength = 0;
+    FILE *out = open_memstream(&commandText, &commandTextLength);
+    formatNode(out, node);
+    fclose(out);
+    struct Job *added = addJob(&job, commandText);
+    printf("[%d] Program is running in the background with PID: %d\n", added->id, pid);
+}
+
+// Runs node with its placement applied to every process it starts, in the background too
+int executePlaced(struct AstNode *node, int isBackground)
+{
+    struct Placement *savedPlacement = activePlacement;
+    int savedIndex = placementIndex;
+    activePlacement = node->placement;
+    placementIndex = 0;
+    if (node->placement->isSpread)
+    {
+        orderSpreadCpus(node->placement);
+    }
+    int status = 0;
+    if (isBackground)
+    {
+        executeBackground(node);
+    }
+    else
+    {
+        status = executeNode(node);
+    }
+    activePlacement = savedPlacement;
+    placementIndex = savedIndex;
+    return status;
+}
+
+// Walks the parse tree and returns the exit status of the last command that ran. Every node
+// leaves its status in lastExitStatus, so $? and exit in the next command of a chain see it.
+int executeNode(struct AstNode *node)
+{
+    int status = 0;
+    if (node->isTimed && activeUsageReport == NULL)
+    {
+        status = executeTimed(node);
+    }
+    else if (node->placement != NULL && activePlacement != node->placement)
+    {
+        status = executePlaced(node, 0);
+    }
+    else
+    {
+        switch (node->type)
+        {
+        case NODE_COMMAND:
+        case NODE_CONCAT:
+            status = executeCommand(node);
+            break;
+        case NODE_PIPELINE:
+            status = executePipeline(node->stages, node->stageCount, 0);
+            break;
+        case NODE_AND:
+            // The right side only runs if the left side succeeded
+            status = executeNode(node->left);
+            status = status == 0 ? executeNode(node->right) : status;
+            break;
+        case NODE_OR:
+            // The right side only runs if the left side failed
+            status = executeNode(node->left);
+            status = status != 0 ? executeNode(node->right) : status;
+            break;
+        case NODE_SEQUENCE:
+            executeNode(node->left);
+            status = executeNode(node->right);
+            break;
+        case NODE_BACKGROUND:
+            executeBackground(node->left);
+            status = 0;
+            break;
+        }
+    }
+    lastExitStatus = status;
+    return status;
+}
+
+// Reads every line of fd into a malloc'd array, used by parallel for its inputs
+char **readLines(int fd, int *lineCount)
+{
+    FILE *input = fdopen(dup(fd), "r");
+    char **lines = NULL;
+    int capacity = 0;
+    *lineCount = 0;
+    if (input == NULL)
+    {
+        perror("fdopen");
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &lineCapacity, input)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+        {
+            line[--length] = '\0';
+        }
+        if (length == 0)
+        {
+            continue;
+        }
+        if (*lineCount == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            lines = realloc(lines, capacity * sizeof(char *));
+            if (lines == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        lines[(*lineCount)++] = strdup(line);
+    }
+    free(line);
+    fclose(input);
+    return lines;
+}
+
+// Builds the command a parallel task runs: the input line itself when there is no template,
+// otherwise the template words with {} replaced by the input, or the input appended
+struct AstNode *buildParallelTask(char **templateWords, int templateCount, char *input)
+{
+    if (templateCount == 0)
+    {
+        struct Token *tokens;
+        int tokenCount = lexLine(input, strlen(input), &tokens);
+        return tokenCount > 0 ? parseLine(tokens, tokenCount) : NULL;
+    }
+
+    struct AstNode *command = newAstNode(NODE_COMMAND);
+    command->argv = arenaAlloc(&lineArena, (templateCount + 2) * sizeof(char *));
+    int isReplaced = 0;
+    size_t inputLength = strlen(input);
+    for (int i = 0; i < templateCount; i++)
+    {
+        char *word = templateWords[i];
+        char *marker = strstr(word, "{}");
+        if (marker != NULL)
+        {
+            size_t prefixLength = marker - word;
+            char *replaced = arenaAlloc(&lineArena, strlen(word) + inputLength);
+            memcpy(replaced, word, prefixLength);
+            memcpy(replaced + prefixLength, input, inputLength);
+            strcpy(replaced + prefixLength + inputLength, marker + 2);
+            word = replaced;
+            isReplaced = 1;
+        }
+        command->argv[command->argc++] = word;
+    }
+    if (!isReplaced)
+    {
+        command->argv[command->argc++] = input;
+    }
+    command->argv[command->argc] = NULL;
+    return command;
+}
+
+// Starts one parallel task with stdin from /dev/null and stdout and stderr both going to
+// outputFd, so its output can be shown in one piece once it is done
+pid_t startParallelTask(struct AstNode *task, int devNullFd, int outputFd)
+{
+    // Swap the shell's own stdin/stderr for the duration of the start, so that spawned
+    // programs inherit them and any error the shell reports lands in the task's output
+    int savedStdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+    int savedStderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(devNullFd, STDIN_FILENO);
+    dup2(outputFd, STDERR_FILENO);
+
+    pid_t pid;
+    if ((task->type == NODE_COMMAND && lookupBuiltin(task->argv[0]) == NULL) || task->type == NODE_CONCAT)
+    {
+        // A plain program is one spawn, like any other stage
+        pid = startStage(task, STDIN_FILENO, outputFd, 0, 0);
+    }
+    else
+    {
+        // Builtins, pipelines and chains get a forked copy of the shell
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0)
+        {
+            dup2(outputFd, STDOUT_FILENO);
+            resetChildSignals();
+            isInteractive = 0;
+            activeUsageReport = NULL;
+            initJobControl();
+            exit(executeNode(task));
+        }
+        if (pid == -1)
+        {
+            perror("fork");
+        }
+    }
+
+    dup2(savedStdin, STDIN_FILENO);
+    dup2(savedStderr, STDERR_FILENO);
+    close(savedStdin);
+    close(savedStderr);
+    return pid;
+}
+
+// Copies a finished task's output to stdout in one piece
+void emitParallelOutput(int outputFd)
+{
+    fflush(stdout);
+    lseek(outputFd, 0, SEEK_SET);
+    streamFile(outputFd, STDOUT_FILENO);
+    close(outputFd);
+}
+
+// parallel [-j N] [command [args]] [::: inputs...]
+// Runs one task per input with at most N running at a time (default: one per core). Without a
+// command every input is a command line of its own, without ::: the inputs are read from stdin
+// one per line. Each task's output is shown as a whole when it finishes. Returns the number of
+// failed tasks, at most 101, like GNU parallel.
+int parallelBuiltin(char *args[], int argc)
+{
+    long slotCount = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    if (first < argc && strncmp(args[first], "-j", 2) == 0)
+    {
+        if (args[first][2] != '\0')
+        {
+            slotCount = atol(args[first] + 2);
+            first++;
+        }
+        else if (first + 1 < argc)
+        {
+            slotCount = atol(args[first + 1]);
+            first += 2;
+        }
+    }
+    if (first < argc && strcmp(args[first], "--") == 0)
+    {
+        first++;
+    }
+
+    int separator = first;
+    while (separator < argc && strcmp(args[separator], ":::") != 0)
+    {
+        separator++;
+    }
+    char **inputs;
+    int inputCount;
+    char **readInputs = NULL;
+    if (separator < argc)
+    {
+        inputs = &args[separator + 1];
+        inputCount = argc - separator - 1;
+    }
+    else
+    {
+        readInputs = readLines(STDIN_FILENO, &inputCount);
+        inputs = readInputs;
+    }
+    if (slotCount < 1)
+    {
+        slotCount = 1;
+    }
+    if (slotCount > inputCount)
+    {
+        slotCount = inputCount;
+    }
+
+    // Waited for with sigwaitinfo rather than the job epoll, which a pipeline stage running this
+    // in a forked child shares with the parent shell
+    sigset_t childSignal;
+    sigset_t savedMask;
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, &savedMask);
+
+    int devNullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    pid_t *runningPids = malloc((slotCount + 1) * sizeof(pid_t));
+    int *runningOutputs = malloc((slotCount + 1) * sizeof(int));
+    int runningCount = 0;
+    int nextInput = 0;
+    int failedCount = 0;
+
+    while (nextInput < inputCount || runningCount > 0)
+    {
+        // Fill every free slot
+        while (runningCount < slotCount && nextInput < inputCount)
+        {
+            int outputFd = memfd_create("parallel", MFD_CLOEXEC);
+            struct AstNode *task = buildParallelTask(&args[first], separator - first, inputs[nextInput++]);
+            pid_t pid = -1;
+            if (outputFd != -1 && task != NULL)
+            {
+                pid = startParallelTask(task, devNullFd, outputFd);
+            }
+            if (pid <= 0)
+            {
+                failedCount++;
+                if (outputFd != -1)
+                {
+                    emitParallelOutput(outputFd);
+                }
+                continue;
+            }
+            runningPids[runningCount] = pid;
+            runningOutputs[runningCount] = outputFd;
+            runningCount++;
+        }
+
+        // Collect whatever finished, a slot is refilled as soon as its task is done
+        int finishedCount = 0;
+        for (int i = 0; i < runningCount; i++)
+        {
+            int status;
+            if (waitpid(runningPids[i], &status, WNOHANG) != runningPids[i])
+            {
+                continue;
+            }
+            if (decodeStatus(status) != 0)
+            {
+                failedCount++;
+            }
+            emitParallelOutput(runningOutputs[i]);
+            runningCount--;
+            runningPids[i] = runningPids[runningCount];
+            runningOutputs[i] = runningOutputs[runningCount];
+            i--;
+            finishedCount++;
+        }
+        if (finishedCount == 0 && runningCount > 0)
+        {
+            // SIGCHLD is blocked from the start, so one that arrived since the scan is still pending
+            sigwaitinfo(&childSignal, NULL);
+            updateAllJobs();
+        }
+    }
+    sigprocmask(SIG_SETMASK, &savedMask, NULL);
+
+    close(devNullFd);
+    free(runningPids);
+    free(runningOutputs);
+    for (int i = 0; readInputs != NULL && i < inputCount; i++)
+    {
+        free(readInputs[i]);
+    }
+    free(readInputs);
+    return failedCount > 101 ? 101 : failedCount;
+}
 
-// Function to expand tilde character to user's home directory
-char *expandTilde(const char *path)
+// Makes source read the whole of fd through a read-only mapping, starting at the current offset.
+// Returns -1 if fd cannot be mapped, e.g. because it is not a regular file.
+int mapLineSource(struct LineSource *source, int fd)
 {
-    if (path[0] == '~')
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1 || !S_ISREG(fileStat.st_mode))
     {
-        const char *homeDir = getenv("HOME");
-        char *expandedPath = malloc(strlen(homeDir) + strlen(path));
-        strcpy(expandedPath, homeDir);
-        strcat(expandedPath, path + 1); // Skip '~'
-        return expandedPath;
+        return -1;
     }
-    else
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    source->data = "";
+    source->length = 0;
+    source->position = 0;
+    if (fileStat.st_size > 0)
     {
-        return strdup(path);
+        void *data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            return -1;
+        }
+        madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+        source->data = data;
+        source->length = fileStat.st_size;
+        source->position = offset > 0 ? offset : 0;
     }
+    return 0;
 }
 
-int isMultiCharOp(char c)
+// Returns the next line of source with its newline, or NULL at the end of the input
+const char *readSourceLine(struct LineSource *source, size_t *lineLength)
 {
-    return c == '>' || c == '&' || c == '|';
+    if (source->data == NULL)
+    {
+        ssize_t length = getline(&source->buffer, &source->capacity, source->stream);
+        if (length == -1)
+        {
+            return NULL;
+        }
+        *lineLength = length;
+        return source->buffer;
+    }
+
+    if (source->seekFd != -1)
+    {
+        // A command may have read from the script on stdin, go on from where it stopped
+        off_t offset = lseek(source->seekFd, 0, SEEK_CUR);
+        if (offset >= 0 && (size_t)offset > source->position)
+        {
+            source->position = offset;
+        }
+    }
+    if (source->position >= source->length)
+    {
+        return NULL;
+    }
+    const char *line = source->data + source->position;
+    const char *end = memchr(line, '\n', source->length - source->position);
+    *lineLength = end != NULL ? (size_t)(end - line + 1) : source->length - source->position;
+    source->position += *lineLength;
+    if (source->seekFd != -1)
+    {
+        // Commands reading stdin start right after this line, like they would in sh
+        lseek(source->seekFd, source->position, SEEK_SET);
+    }
+    return line;
 }
 
-void addSpaces(char *command)
+// Lines starting with # are comments in scripts, including a #! line. # joins files only
+// after a file name, so a line cannot start with it otherwise.
+int isCommentLine(const char *line, size_t length)
 {
-    // Length of the command
-    size_t len = strlen(command);
-
-    // Buffer to store the modified command
-    char modified[MAX_COMMAND_LENGTH * 2]; // Assuming worst case scenario for length
-
-    // Initialize the buffer index
-    size_t j = 0;
+    size_t i = 0;
+    while (i < length && (line[i] == ' ' || line[i] == '\t'))
+    {
+        i++;
+    }
+    return i < length && line[i] == '#';
+}
 
-    // Iterate through each character in the command
-    for (size_t i = 0; i < len; i++)
+// Reads the body of one here-doc from source, up to the line that is just the delimiter
+void readHereDocument(struct Redirect *redirect, struct LineSource *source)
+{
+    char *body = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    while (1)
     {
-        char currentChar = command[i];
-        // Check if the current character is a symbol
-        if (currentChar == '#' || currentChar == '<' || currentChar == ';')
+        if (isInteractive)
         {
-            // Add a space before the symbol if necessary
-            if (i > 0 && command[i - 1] != ' ')
-            {
-                modified[j++] = ' ';
-            }
-            // Add the symbol itself
-            modified[j++] = currentChar;
-            // Add a space after the symbol if necessary
-            if (i < len - 1 && command[i + 1] != ' ')
+            printf("> ");
+            fflush(stdout);
+        }
+        size_t lineLength;
+        const char *line = readSourceLine(source, &lineLength);
+        if (line == NULL)
+        {
+            fprintf(stderr, "warning: here-document delimited by end of file (wanted `%s')\n", redirect->target);
+            break;
+        }
+        if (redirect->op == OP_HEREDOC_TABS)
+        {
+            while (lineLength > 0 && *line == '\t')
             {
-                modified[j++] = ' ';
+                line++;
+                lineLength--;
             }
         }
-        else if (isMultiCharOp(currentChar))
+        size_t textLength = lineLength;
+        if (textLength > 0 && line[textLength - 1] == '\n')
+        {
+            textLength--;
+        }
+        if (textLength == strlen(redirect->target) && memcmp(line, redirect->target, textLength) == 0)
+        {
+            break;
+        }
+        if (length + lineLength > capacity)
         {
-            // Check if the current character is part of a multi-character operator
-            if (i < len - 1 && command[i + 1] == currentChar)
+            capacity = capacity == 0 ? 4096 : capacity;
+            while (length + lineLength > capacity)
             {
-                // Multi-character operator found, add a space before and after if necessary
-                if (i > 0 && command[i - 1] != ' ')
-                {
-                    modified[j++] = ' ';
-                }
-                modified[j++] = currentChar;
-                modified[j++] = currentChar;
-                // Skip the next character
-                i++;
-                // Add a space after the symbol if necessary
-                if (i < len - 1 && command[i + 1] != ' ')
-                {
-                    modified[j++] = ' ';
-                }
+                capacity *= 2;
             }
-            else
+            body = realloc(body, capacity);
+            if (body == NULL)
             {
-                // Single character operator found, add spaces around it if necessary
-                if (i > 0 && command[i - 1] != ' ')
-                {
-                    modified[j++] = ' ';
-                }
-                modified[j++] = currentChar;
-                // Add a space after the symbol if necessary
-                if (i < len - 1 && command[i + 1] != ' ')
-                {
-                    modified[j++] = ' ';
-                }
+                perror("realloc");
+                exit(EXIT_FAILURE);
             }
         }
-        else
+        memcpy(body + length, line, lineLength);
+        length += lineLength;
+    }
+    // The body lives as long as the tree, in the line arena
+    redirect->body = arenaAlloc(&lineArena, length + 1);
+    redirect->bodyLength = length;
+    if (length > 0)
+    {
+        memcpy(redirect->body, body, length);
+    }
+    free(body);
+}
+
+// Reads the here-doc bodies that follow the command line, in the order their operators appear.
+// Returns how many there were.
+int readHereDocuments(struct AstNode *node, struct LineSource *source)
+{
+    if (node == NULL)
+    {
+        return 0;
+    }
+    int count = 0;
+    for (struct Redirect *redirect = node->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        if (redirect->op == OP_HEREDOC || redirect->op == OP_HEREDOC_TABS)
         {
-            // Copy non-symbol characters as-is
-            modified[j++] = currentChar;
+            readHereDocument(redirect, source);
+            count++;
+            // With an unquoted delimiter the body is expanded when the command runs
+            if (!redirect->isQuoted && (memchr(redirect->body, '$', redirect->bodyLength) != NULL ||
+                                        memchr(redirect->body, '`', redirect->bodyLength) != NULL))
+            {
+                node->hasExpansions = 1;
+            }
         }
     }
+    for (int i = 0; i < node->stageCount; i++)
+    {
+        count += readHereDocuments(node->stages[i], source);
+    }
+    return count + readHereDocuments(node->left, source) + readHereDocuments(node->right, source);
+}
 
-    // Null-terminate the modified string
-    modified[j] = '\0';
-
-    // Copy the modified string back to the original command
-    strcpy(command, modified);
+// Returns the child of parent for byte, adding it with isAdding, or 0 if there is none
+int trieChild(struct CommandTrie *trie, int parent, unsigned char byte, int isAdding)
+{
+    int previous = 0;
+    int node = trie->nodes[parent].child;
+    while (node != 0 && trie->nodes[node].byte < byte)
+    {
+        previous = node;
+        node = trie->nodes[node].sibling;
+    }
+    if (node != 0 && trie->nodes[node].byte == byte)
+    {
+        return node;
+    }
+    if (!isAdding)
+    {
+        return 0;
+    }
+    if (trie->nodeCount == trie->nodeCapacity)
+    {
+        trie->nodeCapacity *= 2;
+        trie->nodes = realloc(trie->nodes, trie->nodeCapacity * sizeof(struct TrieNode));
+        if (trie->nodes == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int added = trie->nodeCount++;
+    trie->nodes[added] = (struct TrieNode){0, node, 0, byte, 0};
+    if (previous == 0)
+    {
+        trie->nodes[parent].child = added;
+    }
+    else
+    {
+        trie->nodes[previous].sibling = added;
+    }
+    return added;
 }
 
-void parseInput(char *input, struct KeyValuePair *keyValuePairs, int *keyValuePairSize)
+// Adds name to the trie, a name found in several PATH directories is counted once
+void addTrieName(struct CommandTrie *trie, const char *name, size_t length)
 {
-    int argc = 0;
-    keyValuePairs[*keyValuePairSize].cmd = malloc((MAX_ARGS + 1) * sizeof(char *));
-    if (keyValuePairs[*keyValuePairSize].cmd == NULL)
+    int path[COMMAND_NAME_LIMIT];
+    if (length == 0 || length >= COMMAND_NAME_LIMIT)
     {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+        return;
+    }
+    int node = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        node = path[i] = trieChild(trie, node, name[i], 1);
+    }
+    if (trie->nodes[node].isEnd)
+    {
+        return;
     }
+    trie->nodes[node].isEnd = 1;
+    trie->nodes[0].count++;
+    for (size_t i = 0; i < length; i++)
+    {
+        trie->nodes[path[i]].count++;
+    }
+}
 
-    // Iterate through the command to divide the command based on spaces
-    char *saveptr; // Pointer used by strtok_r for thread safety
-    char *token = strtok_r(input, " ", &saveptr);
-    while (token != NULL)
+// Fills the trie again from the builtins and the listings already read, no directory is read
+void rebuildCommandTrie(struct CommandTrie *trie)
+{
+    if (trie->nodes == NULL)
     {
-        // Expland the path if it exists in the command
-        if (strstr(token, "~/") != NULL)
+        trie->nodeCapacity = 4096;
+        trie->nodes = malloc(trie->nodeCapacity * sizeof(struct TrieNode));
+        if (trie->nodes == NULL)
         {
-            token = expandTilde(token);
+            perror("malloc");
+            exit(EXIT_FAILURE);
         }
-
-        if (token[0] == '\"')
+    }
+    trie->nodes[0] = (struct TrieNode){0, 0, 0, 0, 0};
+    trie->nodeCount = 1;
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        addTrieName(trie, builtins[i].name, strlen(builtins[i].name));
+    }
+    for (int i = 0; i < trie->directoryCount; i++)
+    {
+        struct DirectoryListing *listing = trie->directories[i].listing;
+        for (size_t j = 0; listing != NULL && j < listing->count; j++)
         {
-            // Token starts with a quote, indicating the start of a quoted string
-            char *endQuote = strchr(token + 1, '\"'); // Find the end quote
-            if (endQuote == NULL)
+            if (listing->entries[j].type != DT_DIR)
             {
-                // If end quote is not found, it means the quoted string spans multiple tokens
-                // Concatenate tokens until the end quote is found
-                char *concatToken = malloc(strlen(token) + 1); // Allocate memory for the concatenated token
-                if (concatToken == NULL)
-                {
-                    perror("malloc");
-                    exit(EXIT_FAILURE);
-                }
-                strcpy(concatToken, token + 1); // Copy the substring after the opening quote
-                while (endQuote == NULL)
-                {
-                    token = strtok_r(NULL, " ", &saveptr);
-                    if (token == NULL)
-                    {
-                        printf(stderr, "Syntax error: Unmatched double quote\n");
-                        return;
-                    }
-                    if (strchr(token, '\"') != NULL)
-                    {
-                        endQuote = strchr(token, '\"');
-                        token[endQuote - token] = '\0'; // Null-terminate the string at the end quote
-                    }
-                    concatToken = realloc(concatToken, strlen(concatToken) + strlen(token) + 1);
-                    if (concatToken == NULL)
-                    {
-                        perror("realloc");
-                        exit(EXIT_FAILURE);
-                    }
-                    strcat(concatToken, " ");
-                    strcat(concatToken, token);
-                }
-                token = concatToken;
+                addTrieName(trie, listing->names + listing->entries[j].offset, listing->entries[j].length);
             }
-            else
+        }
+    }
+}
+
+// Brings the trie up to date with PATH. A directory is read again only when it is another one
+// or its mtime moved, so when nothing changed this is one stat per PATH entry.
+void refreshCommandTrie(struct CommandTrie *trie)
+{
+    const char *pathValue = getVariable("PATH") != NULL ? getVariable("PATH") : "";
+    int isChanged = trie->nodes == NULL;
+    if (trie->pathValue == NULL || strcmp(trie->pathValue, pathValue) != 0)
+    {
+        for (int i = 0; i < trie->directoryCount; i++)
+        {
+            if (trie->directories[i].listing != NULL)
             {
-                // Token is a single quoted string
-                *endQuote = '\0'; // Null-terminate the string at the end quote
-                // Remove the first character (quote) from the token
-                memmove(token, token + 1, strlen(token)); // Shift the string one character to the left
+                freeListing(trie->directories[i].listing);
             }
+            free(trie->directories[i].path);
         }
-
-        if (strcmp(token, "#") == 0 || strcmp(token, "|") == 0 || strcmp(token, ">>") == 0 || strcmp(token, ">") == 0 || strcmp(token, "<") == 0 || strcmp(token, "&&") == 0 || strcmp(token, "||") == 0 || strcmp(token, ";") == 0)
+        free(trie->directories);
+        free(trie->pathValue);
+        trie->pathValue = strdup(pathValue);
+        if (trie->pathValue == NULL)
+        {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        trie->directoryCount = 1;
+        for (const char *p = pathValue; *p != '\0'; p++)
+        {
+            trie->directoryCount += *p == ':';
+        }
+        trie->directories = calloc(trie->directoryCount, sizeof(struct PathDirectory));
+        if (trie->directories == NULL)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        const char *start = pathValue;
+        for (int i = 0; i < trie->directoryCount; i++)
         {
-            // Add NULL pointer to terminate the argument list
-            keyValuePairs[*keyValuePairSize].cmd[argc] = NULL;
-            keyValuePairs[*keyValuePairSize].cmdLen = argc;
-            // check if the arguments are greater than 5 and less than 1, if yes then exit
-            if (argc > MAX_ARGS || argc < 1)
+            // An empty entry is the current directory
+            const char *end = strchrnul(start, ':');
+            trie->directories[i].path = end > start ? strndup(start, end - start) : strdup(".");
+            if (trie->directories[i].path == NULL)
             {
-                if (*keyValuePairSize != 0 || (*keyValuePairSize == 0 && argc > MAX_ARGS))
-                {
-                    printf("Individual commands cannot be greater than 5 and less than 1 arguments\n");
-                }
-                isCommandValid = 0;
-                break;
+                perror("strdup");
+                exit(EXIT_FAILURE);
             }
-            keyValuePairs[*keyValuePairSize].cmdSuffix = strdup(token);
+            start = end + 1;
+        }
+        isChanged = 1;
+    }
 
-            (*keyValuePairSize)++;
-            argc = 0;
-            // Dynamically assign value to (*keyValuePairSize)++;
-            keyValuePairs[*keyValuePairSize].cmd = malloc((MAX_ARGS + 1) * sizeof(char *));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; i < trie->directoryCount; i++)
+    {
+        struct PathDirectory *directory = &trie->directories[i];
+        struct stat info;
+        int isDirectory = stat(directory->path, &info) == 0 && S_ISDIR(info.st_mode);
+        if (!isDirectory && directory->isTrusted && directory->listing == NULL)
+        {
+            continue;
         }
-        else
+        if (isDirectory && directory->isTrusted && directory->device == info.st_dev && directory->inode == info.st_ino &&
+            directory->modified.tv_sec == info.st_mtim.tv_sec && directory->modified.tv_nsec == info.st_mtim.tv_nsec)
         {
-            keyValuePairs[*keyValuePairSize].cmd[argc] = strdup(token);
-            argc++;
+            continue;
+        }
+        if (directory->listing != NULL)
+        {
+            freeListing(directory->listing);
         }
-        token = strtok_r(NULL, " ", &saveptr);
+        directory->listing = isDirectory ? readListing(directory->path, &info, 0) : NULL;
+        directory->device = isDirectory ? info.st_dev : 0;
+        directory->inode = isDirectory ? info.st_ino : 0;
+        directory->modified = isDirectory ? info.st_mtim : (struct timespec){0, 0};
+        // Like in the glob cache, a directory changed in the last second is read again next time
+        directory->isTrusted = !isDirectory || info.st_mtim.tv_sec < now.tv_sec - 1;
+        isChanged = 1;
     }
+    if (isChanged)
+    {
+        rebuildCommandTrie(trie);
+    }
+}
 
-    keyValuePairs[*keyValuePairSize].cmd[argc] = NULL;
-    keyValuePairs[*keyValuePairSize].cmdLen = argc;
-    keyValuePairs[*keyValuePairSize].cmdSuffix = NULL;
-    // check if the arguments are greater than 5 and less than 1, if yes then exit
-    if (isCommandValid && (argc > MAX_ARGS || argc < 1))
+// Counts a match of a completion, only the first ones are kept for listing
+void addCompletion(struct Completion *completion, const char *name, size_t length, int isDirectory)
+{
+    if (completion->count == 0)
     {
-        if (*keyValuePairSize != 0 || (*keyValuePairSize == 0 && argc > MAX_ARGS))
+        completion->commonLength = length < sizeof(completion->common) ? length : sizeof(completion->common) - 1;
+        memcpy(completion->common, name, completion->commonLength);
+    }
+    else
+    {
+        size_t shared = 0;
+        while (shared < completion->commonLength && shared < length && completion->common[shared] == name[shared])
         {
-            printf("Individual commands cannot be greater than 5 and less than 1 arguments\n");
+            shared++;
         }
-        isCommandValid = 0;
+        completion->commonLength = shared;
+    }
+    completion->count++;
+    completion->isDirectory = isDirectory;
+    if (completion->matches.count < COMPLETION_LIST_LIMIT)
+    {
+        addWord(&completion->matches, arenaStrndup(&lineArena, name, length));
     }
-    (*keyValuePairSize)++;
 }
 
-void printKeyValuePair(struct KeyValuePair kvp)
+// Adds the names at and below node to the listed matches, name holds the length bytes up to node
+void listTrieNames(struct CommandTrie *trie, int node, char *name, size_t length, struct Completion *completion)
 {
-    printf("cmdLen: %d\n", kvp.cmdLen);
-    printf("cmdSuffix: %s\n", kvp.cmdSuffix);
-    printf("cmd:");
-    for (int i = 0; i < kvp.cmdLen; i++)
+    if (trie->nodes[node].isEnd && completion->matches.count < COMPLETION_LIST_LIMIT)
     {
-        printf(" %s", kvp.cmd[i]);
+        addWord(&completion->matches, arenaStrndup(&lineArena, name, length));
+    }
+    for (int child = trie->nodes[node].child; child != 0 && completion->matches.count < COMPLETION_LIST_LIMIT;
+         child = trie->nodes[child].sibling)
+    {
+        name[length] = trie->nodes[child].byte;
+        listTrieNames(trie, child, name, length + 1, completion);
     }
-    printf("\n");
 }
 
-void openNewTerminal()
+// Completes a command name. The count and the shared start come straight from the trie, so the
+// time depends on the length of the prefix and not on how many commands there are.
+void completeCommandName(const char *prefix, size_t length, struct Completion *completion)
 {
-    pid_t pid = fork();
+    refreshCommandTrie(&commandTrie);
+    int node = 0;
+    for (size_t i = 0; i < length && node != -1; i++)
+    {
+        node = trieChild(&commandTrie, node, prefix[i], 0);
+        node = node == 0 ? -1 : node;
+    }
+    completion->typedLength = length;
+    if (node == -1 || commandTrie.nodes[node].count == 0 || length >= COMMAND_NAME_LIMIT)
+    {
+        return;
+    }
+    char name[COMMAND_NAME_LIMIT];
+    memcpy(name, prefix, length);
+    completion->count = commandTrie.nodes[node].count;
+    // Names share every byte down to the first node that ends a name or branches
+    while (!commandTrie.nodes[node].isEnd && commandTrie.nodes[commandTrie.nodes[node].child].sibling == 0)
+    {
+        node = commandTrie.nodes[node].child;
+        name[length++] = commandTrie.nodes[node].byte;
+    }
+    memcpy(completion->common, name, length);
+    completion->commonLength = length;
+    listTrieNames(&commandTrie, node, name, length, completion);
+}
 
-    if (pid == -1)
+// Completes the last part of a path, only with directories if isDirectoryOnly. A leading ~/
+// stands for the home directory like it does in a command.
+void completeFileName(const char *word, size_t length, int isDirectoryOnly, struct Completion *completion)
+{
+    char directory[4096];
+    const char *slash = memrchr(word, '/', length);
+    const char *prefix = slash != NULL ? slash + 1 : word;
+    size_t prefixLength = word + length - prefix;
+    if (slash == NULL)
     {
-        perror("fork");
-        exit(EXIT_FAILURE);
+        snprintf(directory, sizeof(directory), ".");
+    }
+    else if (word[0] == '~' && word + 1 == slash && getVariable("HOME") != NULL)
+    {
+        snprintf(directory, sizeof(directory), "%s/", getVariable("HOME"));
+    }
+    else
+    {
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - word + 1), word);
     }
+    completion->typedLength = prefixLength;
 
-    if (pid > 0)
+    struct DirectoryListing *listing = openListing(directory);
+    for (size_t i = 0; listing != NULL && i < listing->count; i++)
     {
-        // Parent process does not wait for the child to complete immediately
-        return;
+        const char *name = listing->names + listing->entries[i].offset;
+        size_t nameLength = listing->entries[i].length;
+        // Hidden names only when the word asks for them, as in globbing
+        if ((name[0] == '.' && (prefixLength == 0 || prefix[0] != '.')) || nameLength < prefixLength ||
+            memcmp(name, prefix, prefixLength) != 0)
+        {
+            continue;
+        }
+        int type = listing->entries[i].type;
+        int isDirectory = type == DT_DIR;
+        if (type == DT_UNKNOWN || type == DT_LNK)
+        {
+            char path[8192];
+            struct stat info;
+            snprintf(path, sizeof(path), "%s/%s", directory, name);
+            isDirectory = stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+        }
+        if (isDirectory || !isDirectoryOnly)
+        {
+            addCompletion(completion, name, nameLength, isDirectory);
+        }
     }
-    else if (pid == 0)
+    if (listing != NULL)
     {
-        // Launch a new instance of shell24 in a new Bash terminal
-        execlp("x-terminal-emulator", "x-terminal-emulator", "-e", "./shell24", NULL);
-        perror("execlp");
-        exit(EXIT_FAILURE);
+        releaseListing(listing);
     }
 }
 
-// This function will execute the command
-void executeCommand(char *args[], int argc)
+// Completes %n with the numbers of the jobs
+void completeJob(const char *word, size_t length, struct Completion *completion)
 {
-    pid_t pid = fork();
+    completion->typedLength = length;
+    for (int i = 0; i < jobCount; i++)
+    {
+        char name[32];
+        int nameLength = snprintf(name, sizeof(name), "%%%d", jobTable[i]->id);
+        if ((size_t)nameLength >= length && memcmp(name, word, length) == 0)
+        {
+            addCompletion(completion, name, nameLength, 0);
+        }
+    }
+}
 
-    if (pid == -1)
+// Width of the terminal, 80 when it cannot be told
+int terminalColumns()
+{
+    struct winsize size;
+    return ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+}
+
+// Columns text takes on the screen, counting each UTF-8 character as one
+size_t displayWidth(const char *text, size_t length)
+{
+    size_t width = 0;
+    for (size_t i = 0; i < length; i++)
     {
-        perror("fork");
-        exit(EXIT_FAILURE);
+        width += ((unsigned char)text[i] & 0xc0) != 0x80;
+    }
+    return width;
+}
+
+// Redraws the prompt and the line with the cursor in place. A line wider than the terminal is
+// scrolled sideways so the cursor stays on screen.
+void refreshLine(struct LineEditor *editor)
+{
+    char prompt[512];
+    if (editor->isSearching)
+    {
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ", editor->searchIndex == -1 ? "failed " : "",
+                 (int)editor->queryLength, editor->query);
+    }
+    else
+    {
+        snprintf(prompt, sizeof(prompt), "%s", editor->prompt);
+    }
+    size_t promptWidth = displayWidth(prompt, strlen(prompt));
+    size_t columns = terminalColumns();
+    size_t start = 0;
+    while (start < editor->cursor && promptWidth + displayWidth(editor->line + start, editor->cursor - start) >= columns)
+    {
+        start++;
+    }
+    while (start < editor->length && ((unsigned char)editor->line[start] & 0xc0) == 0x80)
+    {
+        start++;
+    }
+    size_t end = start;
+    size_t width = promptWidth;
+    while (end < editor->length && (width < columns - 1 || ((unsigned char)editor->line[end] & 0xc0) == 0x80) &&
+           end - start < 6000)
+    {
+        width += ((unsigned char)editor->line[end++] & 0xc0) != 0x80;
     }
 
-    if (pid > 0)
+    char screen[8192];
+    int length = snprintf(screen, sizeof(screen), "\r%s%.*s\033[K\r", prompt, (int)(end - start), editor->line + start);
+    size_t cursorColumn = promptWidth + displayWidth(editor->line + start, editor->cursor - start);
+    if (cursorColumn > 0 && length < (int)sizeof(screen))
+    {
+        length += snprintf(screen + length, sizeof(screen) - length, "\033[%zuC", cursorColumn);
+    }
+    fflush(stdout);
+    if (write(STDOUT_FILENO, screen, length < (int)sizeof(screen) ? length : (int)sizeof(screen) - 1) == -1)
     {
-        // Parent process waitinng for child to complete
-        wait(NULL);
+        perror("write");
     }
-    else if (pid == 0)
+}
+
+// Replaces the line with text and puts the cursor at the end
+void setEditorLine(struct LineEditor *editor, const char *text, size_t length)
+{
+    editor->length = editor->cursor = 0;
+    if (length + 1 > editor->capacity)
     {
-        // Execute commands
-        if (execvp(args[0], args) == -1)
+        editor->capacity = length + 256;
+        editor->line = realloc(editor->line, editor->capacity);
+        if (editor->line == NULL)
         {
-            perror("execvp");
+            perror("realloc");
+            exit(EXIT_FAILURE);
         }
     }
+    memcpy(editor->line, text, length);
+    editor->length = editor->cursor = length;
 }
 
-// Checks if there is a combination of special characters used, If yes returns 0
-int ifValidSpecialChar(struct KeyValuePair *keyValuePairs, int keyValuePairSize, char *specialChar)
+void insertText(struct LineEditor *editor, const char *text, size_t length)
 {
-    for (int i = 0; i < keyValuePairSize - 1; i++)
+    if (editor->length + length + 2 > editor->capacity)
     {
-        if (strcmp(keyValuePairs[i].cmdSuffix, specialChar) != 0)
+        editor->capacity = 2 * (editor->length + length) + 256;
+        editor->line = realloc(editor->line, editor->capacity);
+        if (editor->line == NULL)
         {
-            // return 0 because it conatins combinations
-            printf("Combination of special characters cannot be used %s and %s\n", specialChar, keyValuePairs[i].cmdSuffix);
-            return 0;
+            perror("realloc");
+            exit(EXIT_FAILURE);
         }
     }
-    return 1;
+    memmove(editor->line + editor->cursor + length, editor->line + editor->cursor, editor->length - editor->cursor);
+    memcpy(editor->line + editor->cursor, text, length);
+    editor->length += length;
+    editor->cursor += length;
+}
+
+void deleteText(struct LineEditor *editor, size_t start, size_t end)
+{
+    memmove(editor->line + start, editor->line + end, editor->length - end);
+    editor->length -= end - start;
+    editor->cursor = start;
+}
+
+// Start of the UTF-8 character before or after position
+size_t previousCharacter(struct LineEditor *editor, size_t position)
+{
+    while (position > 0 && ((unsigned char)editor->line[--position] & 0xc0) == 0x80)
+    {
+    }
+    return position;
+}
+
+size_t nextCharacter(struct LineEditor *editor, size_t position)
+{
+    while (position < editor->length && ((unsigned char)editor->line[++position] & 0xc0) == 0x80)
+    {
+    }
+    return position < editor->length ? position : editor->length;
+}
+
+// Inserts a completed part of a word. Outside quotes a part with characters the lexer treats
+// specially is put in quotes of its own, which the lexer joins to the rest of the word.
+void insertCompletion(struct LineEditor *editor, const char *text, size_t length, int quote)
+{
+    int isSpecial = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        isSpecial |= strchr(" \t|;&<>()'\"$`*?[", text[i]) != NULL;
+    }
+    if (quote != 0 || !isSpecial)
+    {
+        insertText(editor, text, length);
+        return;
+    }
+    const char *quoteText = memchr(text, '\'', length) == NULL ? "'" : "\"";
+    insertText(editor, quoteText, 1);
+    insertText(editor, text, length);
+    insertText(editor, quoteText, 1);
 }
 
-// Concatenate contents of text files
-void fileConcatenation(struct KeyValuePair *keyValuePairs, int keyValuePairSize, char *specialChar)
+// Prints the listed matches in columns under the line
+void listCompletions(struct Completion *completion)
 {
-    if (!ifValidSpecialChar(keyValuePairs, keyValuePairSize, specialChar))
+    qsort(completion->matches.words, completion->matches.count, sizeof(char *), compareWords);
+    size_t width = 0;
+    for (int i = 0; i < completion->matches.count; i++)
     {
-        return;
+        size_t length = displayWidth(completion->matches.words[i], strlen(completion->matches.words[i]));
+        width = length > width ? length : width;
     }
-
-    // Open output file for writing concatenated contents
-    FILE *outputFile = fopen("output.txt", "w");
-    if (outputFile == NULL)
+    width += 2;
+    int columnCount = terminalColumns() / width > 0 ? terminalColumns() / width : 1;
+    int rowCount = (completion->matches.count + columnCount - 1) / columnCount;
+    printf("\n");
+    for (int row = 0; row < rowCount; row++)
     {
-        perror("Failed to open output file");
-        exit(EXIT_FAILURE);
+        for (int column = 0; column < columnCount; column++)
+        {
+            int i = column * rowCount + row;
+            if (i < completion->matches.count)
+            {
+                const char *word = completion->matches.words[i];
+                printf("%s%*s", word, (int)(width - displayWidth(word, strlen(word))), "");
+            }
+        }
+        printf("\n");
+    }
+    if (completion->count > completion->matches.count)
+    {
+        printf("... and %d more\n", completion->count - completion->matches.count);
     }
+}
 
-    for (int i = 0; i < keyValuePairSize; i++)
+// Tab: completes the word before the cursor as a command name, a job, a directory after cd or a
+// file. The part every match shares is inserted, a second Tab lists the matches.
+void completeWord(struct LineEditor *editor)
+{
+    // Walk the line to the cursor to find the word, whether it is inside quotes and the command
+    // it belongs to
+    int quote = 0;
+    size_t wordStart = 0;
+    int isCommandPosition = 1;
+    size_t commandStart = 0;
+    size_t commandLength = 0;
+    for (size_t i = 0; i < editor->cursor; i++)
     {
-        // Open input file for reading
-        FILE *inputFile = fopen(keyValuePairs[i].cmd[0], "r");
-        if (inputFile == NULL)
+        char c = editor->line[i];
+        if (quote != 0)
         {
-            printf("Failed to open input file %s\n", keyValuePairs[i].cmd[0]);
-            fclose(outputFile);
-            remove("output.txt");
-            return;
+            quote = c == quote ? 0 : quote;
+            continue;
         }
-
-        // Read contents of input file and write to output file
-        char buffer[1024];
-        while (fgets(buffer, sizeof(buffer), inputFile) != NULL)
+        if (c == '\'' || c == '"')
         {
-            fputs(buffer, outputFile);
+            quote = c;
+            continue;
         }
-
-        // Close input file
-        fclose(inputFile);
-
-        // Close output file
-        if (i != keyValuePairSize - 1)
+        if (strchr(" \t|;&<>()", c) == NULL)
+        {
+            continue;
+        }
+        if (i > wordStart && isCommandPosition)
+        {
+            // Assignments and time come before the command
+            const char *word = editor->line + wordStart;
+            size_t length = i - wordStart;
+            const char *equals = memchr(word, '=', length);
+            int isAssignment = equals != NULL && isVariableName(word, equals - word);
+            if (!isAssignment && !(length == 4 && memcmp(word, "time", 4) == 0))
+            {
+                isCommandPosition = 0;
+                commandStart = wordStart;
+                commandLength = length;
+            }
+        }
+        if (strchr("|;&(", c) != NULL)
+        {
+            isCommandPosition = 1;
+            commandLength = 0;
+        }
+        else if (c == '<' || c == '>')
         {
-            // Add newline between concatenated files
-            fputs(" ", outputFile);
+            isCommandPosition = 0;
         }
+        wordStart = i + 1;
     }
 
-    // Close output file
-    fclose(outputFile);
-
-    // Open output file to print concatenated contents
-    FILE *resultFile = fopen("output.txt", "r");
-    if (resultFile == NULL)
+    // The word as the command will see it, without its quotes
+    char word[4096];
+    size_t wordLength = 0;
+    for (size_t i = wordStart; i < editor->cursor && wordLength < sizeof(word) - 1; i++)
     {
-        perror("Failed to open output file");
-        exit(EXIT_FAILURE);
+        if (editor->line[i] != '\'' && editor->line[i] != '"')
+        {
+            word[wordLength++] = editor->line[i];
+        }
     }
+    const char *command = editor->line + commandStart;
+    int isJobCommand = (commandLength == 2 && (memcmp(command, "fg", 2) == 0 || memcmp(command, "bg", 2) == 0)) ||
+                       (commandLength == 4 && memcmp(command, "wait", 4) == 0);
 
-    // Print concatenated contents
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), resultFile) != NULL)
+    struct Completion completion = {{NULL, 0, 0}, 0, 0, "", 0, 0};
+    if ((wordLength > 0 && word[0] == '%') || (wordLength == 0 && isJobCommand))
     {
-        printf("%s", buffer);
+        completeJob(word, wordLength, &completion);
     }
-    printf("\n");
-
-    // Close output file
-    fclose(resultFile);
-
-    // Remove temporary output file
-    remove("output.txt");
-}
-
-// Piping operation
-void pipeOperation(struct KeyValuePair *keyValuePairs, int keyValuePairSize, char *specialChar)
-{
-    if (!ifValidSpecialChar(keyValuePairs, keyValuePairSize, specialChar))
+    else if (isCommandPosition && memchr(word, '/', wordLength) == NULL)
     {
-        return;
+        completeCommandName(word, wordLength, &completion);
+    }
+    else
+    {
+        int isDirectoryOnly = commandLength == 2 && memcmp(command, "cd", 2) == 0;
+        completeFileName(word, wordLength, isDirectoryOnly, &completion);
     }
 
-    // Initialize pipes
-    int pipes[keyValuePairSize - 1][2];
-    for (int i = 0; i < keyValuePairSize - 1; i++)
+    if (completion.count == 0)
     {
-        if (pipe(pipes[i]) == -1)
+        if (write(STDOUT_FILENO, "\a", 1) == -1)
         {
-            perror("pipe");
-            exit(EXIT_FAILURE);
+            perror("write");
         }
+        return;
     }
-
-    // Execute commands
-    for (int i = 0; i < keyValuePairSize; i++)
+    size_t addedLength = completion.commonLength - completion.typedLength;
+    insertCompletion(editor, completion.common + completion.typedLength, addedLength, quote);
+    if (completion.count == 1)
     {
-        pid_t pid = fork();
-        if (pid == -1)
+        if (completion.isDirectory)
         {
-            perror("fork");
-            exit(EXIT_FAILURE);
+            insertText(editor, "/", 1);
         }
-        else if (pid == 0)
+        else
         {
-            // Child process
-            if (i > 0)
-            {
-                // Connect input to previous pipe
-                if (dup2(pipes[i - 1][0], STDIN_FILENO) == -1)
-                {
-                    perror("dup2");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            if (i < keyValuePairSize - 1)
-            {
-                // Connect output to next pipe
-                if (dup2(pipes[i][1], STDOUT_FILENO) == -1)
-                {
-                    perror("dup2");
-                    exit(EXIT_FAILURE);
-                }
-            }
-
-            // Close all pipe descriptors
-            for (int j = 0; j < keyValuePairSize - 1; j++)
-            {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-
-            // Execute command
-            if (execvp(keyValuePairs[i].cmd[0], keyValuePairs[i].cmd) == -1)
+            if (quote != 0)
             {
-                perror("execvp");
+                char closing = quote;
+                insertText(editor, &closing, 1);
             }
+            insertText(editor, " ", 1);
         }
     }
-
-    // Close all pipe descriptors in parent
-    for (int i = 0; i < keyValuePairSize - 1; i++)
+    else if (addedLength == 0 && editor->lastKey == '\t')
     {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+        listCompletions(&completion);
     }
-
-    // Wait for all child processes to finish
-    for (int i = 0; i < keyValuePairSize; i++)
+    else if (addedLength == 0 && write(STDOUT_FILENO, "\a", 1) == -1)
     {
-        wait(NULL);
+        perror("write");
     }
 }
 
-// Redirection
-void redirection(struct KeyValuePair *keyValuePairs, int keyValuePairSize, char *specialChar)
+// Runs the Ctrl-R search for the query from entry before down, loading what it finds
+void searchEditorHistory(struct LineEditor *editor, int before)
 {
+    int found = editor->queryLength > 0 ? searchHistory(editor->query, editor->queryLength, before) : -1;
+    if (found == -1)
+    {
+        editor->searchIndex = editor->queryLength > 0 ? -1 : editor->searchIndex;
+        return;
+    }
+    size_t length;
+    const char *text = historyEntry(found, &length);
+    setEditorLine(editor, text, length);
+    editor->cursor = (const char *)memmem(text, length, editor->query, editor->queryLength) - text;
+    editor->searchIndex = found;
+}
 
-    // Open the file based on the redirection operator
-    int fileDescriptor;
-    if (strcmp(specialChar, ">") == 0)
+// Handles a key while Ctrl-R is on. Returns 1 if the key was used, 0 if it ends the search and
+// is to be handled as usual.
+int editSearch(struct LineEditor *editor, int key)
+{
+    if (key == 0x12)
+    {
+        searchEditorHistory(editor, editor->searchIndex >= 0 ? editor->searchIndex : (int)history.count);
+        return 1;
+    }
+    if (key == 0x7f || key == 0x08)
     {
-        fileDescriptor = open(keyValuePairs[1].cmd[0], O_WRONLY | O_CREAT | O_TRUNC, 0777);
+        editor->queryLength -= editor->queryLength > 0;
+        editor->searchIndex = history.count;
+        searchEditorHistory(editor, history.count);
+        return 1;
     }
-    else if (strcmp(specialChar, ">>") == 0)
+    if (key == 0x07 || key == 0x03)
     {
-        fileDescriptor = open(keyValuePairs[1].cmd[0], O_WRONLY | O_CREAT | O_APPEND, 0777);
+        // Ctrl-G and Ctrl-C give back the line that was being typed
+        setEditorLine(editor, editor->draft, editor->draftLength);
+        editor->isSearching = 0;
+        return 1;
     }
-    else if (strcmp(specialChar, "<") == 0)
+    if (key >= 0x20 && key != 0x7f && editor->queryLength < sizeof(editor->query))
     {
-        fileDescriptor = open(keyValuePairs[1].cmd[0], O_RDONLY);
+        editor->query[editor->queryLength++] = key;
+        searchEditorHistory(editor, editor->searchIndex >= 0 ? editor->searchIndex + 1 : (int)history.count);
+        return 1;
     }
+    editor->isSearching = 0;
+    return 0;
+}
 
-    if (fileDescriptor == -1)
+// Keeps the line being typed while Up, Down or Ctrl-R show history entries
+void saveDraft(struct LineEditor *editor)
+{
+    free(editor->draft);
+    editor->draft = malloc(editor->length + 1);
+    if (editor->draft == NULL)
     {
-        perror("open");
+        perror("malloc");
         exit(EXIT_FAILURE);
     }
+    memcpy(editor->draft, editor->line, editor->length);
+    editor->draftLength = editor->length;
+}
 
-    pid_t pid = fork();
-    if (pid == -1)
+// Shows history entry index, or the line being typed at history.count
+void showHistoryEntry(struct LineEditor *editor, int index)
+{
+    if (editor->historyIndex == (int)history.count)
     {
-        perror("fork");
-        exit(EXIT_FAILURE);
+        saveDraft(editor);
+    }
+    editor->historyIndex = index;
+    if (index == (int)history.count)
+    {
+        setEditorLine(editor, editor->draft, editor->draftLength);
+        return;
     }
-    else if (pid == 0)
+    size_t length;
+    const char *text = historyEntry(index, &length);
+    setEditorLine(editor, text, length);
+}
+
+// Reads the next byte of an escape sequence, 0 if none arrives
+int readEscapeByte()
+{
+    unsigned char byte;
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    return poll(&input, 1, 50) == 1 && read(STDIN_FILENO, &byte, 1) == 1 ? byte : 0;
+}
+
+// Reads a line from the terminal with editing: arrows, Home/End, Ctrl-A/E/K/U/W/L, Up/Down
+// through the history, Ctrl-R to search it and Tab to complete. Job reports are shown while
+// waiting for keys. Returns the line with its newline or NULL at Ctrl-D on an empty line.
+const char *editLine(struct LineEditor *editor, const char *prompt, size_t *lineLength)
+{
+    initHistory();
+    refreshHistory();
+    editor->prompt = prompt;
+    editor->length = editor->cursor = 0;
+    editor->historyIndex = history.count;
+    editor->isSearching = 0;
+    editor->lastKey = 0;
+    if (editor->line == NULL)
     {
-        // Child process
+        setEditorLine(editor, "", 0);
+    }
+
+    // Keys arrive one at a time and untranslated, Ctrl-C and Ctrl-Z are keys too. Output
+    // processing stays on so job reports print as usual.
+    tcgetattr(STDIN_FILENO, &editor->savedTerminal);
+    struct termios raw = editor->savedTerminal;
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | ISTRIP | INPCK);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    refreshLine(editor);
 
-        // Redirect stdin or stdout to the file
-        if (strcmp(specialChar, ">") == 0 || strcmp(specialChar, ">>") == 0)
+    int isDone = 0;
+    int isEnd = 0;
+    while (!isDone && !isEnd)
+    {
+        int events = waitForEvents(1);
+        if (events & JOB_EVENT_CHILD)
         {
-            if (dup2(fileDescriptor, STDOUT_FILENO) == -1)
+            updateAllJobs();
+            updateSessions();
+            if (reportJobs(1) + reportSessions(1) > 0)
             {
-                perror("dup2");
-                exit(EXIT_FAILURE);
+                refreshLine(editor);
             }
         }
-        else if (strcmp(specialChar, "<") == 0)
+        unsigned char byte;
+        if (!(events & JOB_EVENT_INPUT))
         {
-            if (dup2(fileDescriptor, STDIN_FILENO) == -1)
-            {
-                perror("dup2");
-                exit(EXIT_FAILURE);
-            }
+            continue;
         }
-
-        // Close the file descriptor
-        close(fileDescriptor);
-
-        // Execute the command
-        if (execvp(keyValuePairs[0].cmd[0], keyValuePairs[0].cmd) == -1)
+        if (read(STDIN_FILENO, &byte, 1) != 1)
         {
-            perror("execvp");
-            exit(EXIT_FAILURE);
+            isEnd = 1;
+            break;
         }
-    }
-
-    // Close the file descriptor in the parent process
-    close(fileDescriptor);
-
-    // Wait for the child process to finish
-    wait(NULL);
-}
-
-void conditionalExecution(struct KeyValuePair *keyValuePairs, int keyValuePairSize)
-{
-    int status; // Used to store the exit status of the executed commands
-
-    // Iterate through each command in the key-value pairs
-    for (int i = 0; i < keyValuePairSize; i++)
-    {
-        // Execute the command
-        pid_t pid = fork();
-
-        if (pid == -1)
+        int key = byte;
+        if (editor->isSearching && editSearch(editor, key))
         {
-            perror("fork");
-            exit(EXIT_FAILURE);
+            refreshLine(editor);
+            editor->lastKey = key;
+            continue;
         }
-        else if (pid == 0)
+
+        switch (key)
+        {
+        case '\r':
+        case '\n':
+            isDone = 1;
+            break;
+        case 0x04: // Ctrl-D
+            if (editor->length == 0)
+            {
+                isEnd = 1;
+            }
+            else if (editor->cursor < editor->length)
+            {
+                deleteText(editor, editor->cursor, nextCharacter(editor, editor->cursor));
+            }
+            break;
+        case 0x03: // Ctrl-C
+            printf("^C\n");
+            editor->length = editor->cursor = 0;
+            editor->historyIndex = history.count;
+            break;
+        case 0x7f: // Backspace
+        case 0x08:
+            if (editor->cursor > 0)
+            {
+                size_t cursor = editor->cursor;
+                deleteText(editor, previousCharacter(editor, cursor), cursor);
+            }
+            break;
+        case '\t':
+            completeWord(editor);
+            break;
+        case 0x01: // Ctrl-A
+            editor->cursor = 0;
+            break;
+        case 0x05: // Ctrl-E
+            editor->cursor = editor->length;
+            break;
+        case 0x02: // Ctrl-B
+            editor->cursor = previousCharacter(editor, editor->cursor);
+            break;
+        case 0x06: // Ctrl-F
+            editor->cursor = nextCharacter(editor, editor->cursor);
+            break;
+        case 0x0b: // Ctrl-K
+            editor->length = editor->cursor;
+            break;
+        case 0x15: // Ctrl-U
+            deleteText(editor, 0, editor->cursor);
+            break;
+        case 0x17: // Ctrl-W
         {
-            // Child process
-            if (execvp(keyValuePairs[i].cmd[0], keyValuePairs[i].cmd) == -1)
+            size_t start = editor->cursor;
+            while (start > 0 && (editor->line[start - 1] == ' ' || editor->line[start - 1] == '\t'))
+            {
+                start--;
+            }
+            while (start > 0 && editor->line[start - 1] != ' ' && editor->line[start - 1] != '\t')
             {
-                perror("execvp");
+                start--;
             }
+            deleteText(editor, start, editor->cursor);
+            break;
         }
-        else
+        case 0x0c: // Ctrl-L
+            printf("\033[H\033[2J");
+            break;
+        case 0x10: // Ctrl-P
+        case 0x0e: // Ctrl-N
+            key = key == 0x10 ? 'A' : 'B';
+            // fall through
+        case 0x1b: // Escape sequences of the arrows, Home, End and Delete
         {
-            // Parent process
-            waitpid(pid, &status, 0); // Wait for child process to complete
-            if (WIFEXITED(status))
+            int sequence = key;
+            if (key == 0x1b)
             {
-                int exit_status = WEXITSTATUS(status);
-
-                // Check for conditional execution operators
-                if ((keyValuePairs[i].cmdSuffix != NULL) && (strcmp(keyValuePairs[i].cmdSuffix, "&&") == 0))
-                {
-                    // If the previous command succeeded, proceed to the next command
-                    if (exit_status != 0)
-                    {
-                        i++; // Skip the next command
-                    }
-                }
-                else if ((keyValuePairs[i].cmdSuffix != NULL) && strcmp(keyValuePairs[i].cmdSuffix, "||") == 0)
+                int kind = readEscapeByte();
+                sequence = kind == '[' || kind == 'O' ? readEscapeByte() : 0;
+                if (sequence >= '0' && sequence <= '9')
                 {
-                    // If the previous command failed, proceed to the next command
-                    if (exit_status == 0)
-                    {
-                        i++; // Skip the next command
-                    }
+                    sequence = readEscapeByte() == '~' ? sequence : 0;
                 }
             }
+            if (sequence == 'A' && editor->historyIndex > 0)
+            {
+                showHistoryEntry(editor, editor->historyIndex - 1);
+            }
+            else if (sequence == 'B' && editor->historyIndex < (int)history.count)
+            {
+                showHistoryEntry(editor, editor->historyIndex + 1);
+            }
+            else if (sequence == 'C')
+            {
+                editor->cursor = nextCharacter(editor, editor->cursor);
+            }
+            else if (sequence == 'D')
+            {
+                editor->cursor = previousCharacter(editor, editor->cursor);
+            }
+            else if (sequence == 'H' || sequence == '1' || sequence == '7')
+            {
+                editor->cursor = 0;
+            }
+            else if (sequence == 'F' || sequence == '4' || sequence == '8')
+            {
+                editor->cursor = editor->length;
+            }
+            else if (sequence == '3' && editor->cursor < editor->length)
+            {
+                deleteText(editor, editor->cursor, nextCharacter(editor, editor->cursor));
+            }
+            break;
         }
-    }
-}
-
-void sequentialExecution(struct KeyValuePair *keyValuePairs, int keyValuePairSize, char *specialChar)
-{
-    if (!ifValidSpecialChar(keyValuePairs, keyValuePairSize, specialChar))
-    {
-        return;
-    }
-
-    // Iterate through each command in the key-value pairs
-    for (int i = 0; i < keyValuePairSize; i++)
-    {
-        pid_t pid = fork();
-
-        if (pid == -1)
-        {
-            perror("fork");
-            exit(EXIT_FAILURE);
-        }
-
-        if (pid > 0)
-        {
-            // Parent process waiting for child to complete
-            int status;
-            if (waitpid(pid, &status, 0) == -1)
+        case 0x12: // Ctrl-R
+            saveDraft(editor);
+            editor->isSearching = 1;
+            editor->queryLength = 0;
+            editor->searchIndex = history.count;
+            break;
+        default:
+            if (key >= 0x20)
             {
-                perror("waitpid");
-                exit(EXIT_FAILURE);
+                char text = key;
+                insertText(editor, &text, 1);
             }
+            break;
         }
-        else if (pid == 0)
+        editor->lastKey = key;
+        if (!isDone && !isEnd)
         {
-            // Execute commands
-            executeCommand(keyValuePairs[i].cmd, keyValuePairs[i].cmdLen);
-            // Exit the child process after command execution
-            exit(EXIT_SUCCESS);
+            refreshLine(editor);
         }
     }
-}
-
-// Method to add a value to the array
-void addToBgProcessArr(int value)
-{
-    if (bgProcessCount < MAX_BG_PROCESSES)
-    {
-        bgProcessArr[bgProcessCount++] = value;
-    }
-    else
-    {
-        printf("Error: Background process array is full.\n");
-    }
-}
 
-// Method to read the last element of the array
-int readLastBgProcess()
-{
-    if (bgProcessCount > 0)
+    editor->isSearching = 0;
+    if (isDone)
     {
-        return bgProcessArr[bgProcessCount - 1];
+        editor->cursor = editor->length;
+        refreshLine(editor);
+        printf("\n");
+        fflush(stdout);
     }
-    else
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor->savedTerminal);
+    if (isEnd)
     {
-        printf("Error: Background process array is empty.\n");
-        return -999; // Return a default value indicating an error
+        return NULL;
     }
+    editor->line[editor->length] = '\n';
+    *lineLength = editor->length + 1;
+    return editor->line;
 }
 
-// Method to remove the last element of the array
-void removeLastBgProcess()
+void sigint_handler(int signum)
 {
-    if (bgProcessCount > 0)
-    {
-        bgProcessCount--;
-    }
-    else
+    // Handle SIGINT signal (Ctrl+C) in the parent process, a job brought back with fg is in its
+    // own process group so it is passed on to it
+    if (foregroundPgid > 0)
     {
-        printf("Error: Background process array is empty.\n");
+        kill(-foregroundPgid, signum);
     }
+    // Filter threads are part of the shell, they stop at their next block of input
+    isFilterInterrupted = 1;
 }
 
-void pushBackground(char *args[], int argc)
+// shell24_bench.c includes this file to reach the parser and brings its own main
+#ifndef SHELL24_NO_MAIN
+int main(int argc, char *argv[])
 {
-    // args[argc - 1] = NULL;
-    pid_t pid = fork();
-
-    if (pid == -1)
+    // shell24 script, shell24 -c 'commands' or commands on stdin, only stdin can be interactive
+    struct LineSource source = {NULL, 0, 0, -1, stdin, NULL, 0};
+    if (argc > 2 && strcmp(argv[1], "-c") == 0)
     {
-        perror("fork");
-        exit(EXIT_FAILURE);
+        source.data = argv[2];
+        source.length = strlen(argv[2]);
     }
-
-    if (pid > 0)
+    else if (argc > 1)
     {
-        addToBgProcessArr(pid);
-        // Set the process group ID of the current process to its own PID
-        if (setpgid(pid, pid) == -1)
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || mapLineSource(&source, fd) == -1)
         {
-            perror("setpgid");
-            exit(EXIT_FAILURE);
+            perror(argv[1]);
+            exit(127);
         }
-        printf("Program is running in the background with PID: %d\n", pid);
+        close(fd);
     }
-    else if (pid == 0)
+    else if (!isatty(STDIN_FILENO))
     {
-        // Execute commands
-        if (execvp(args[0], args) == -1)
+        // A script file on stdin is mapped, a pipe is read in big blocks instead of the default
+        if (mapLineSource(&source, STDIN_FILENO) == 0)
         {
-            perror("execvp");
+            source.seekFd = STDIN_FILENO;
+        }
+        else
+        {
+            setvbuf(stdin, NULL, _IOFBF, STREAM_BUFFER_SIZE);
         }
     }
-}
-
-void sigint_handler(int signum)
-{
-    // Handle SIGINT signal (Ctrl+C) in the parent process
-    if (isFgProcess && kill(readLastBgProcess(), signum) == 0)
-    {
-        printf("Process with PID %d killed successfully", readLastBgProcess());
-        removeLastBgProcess();
-    }
-}
 
-int main()
-{
     // Register SIGINT signal handler for the parent process
     if (signal(SIGINT, sigint_handler) == SIG_ERR)
     {
@@ -721,131 +8233,147 @@ int main()
         exit(EXIT_FAILURE);
     }
 
-    // This will be the whole command as a string
-    char command[MAX_COMMAND_LENGTH];
+    // At a terminal the shell must not be stopped by Ctrl+Z or by handing the terminal around,
+    // and stdin is read unbuffered so epoll sees exactly what is left to read
+    isInteractive = argc == 1 && isatty(STDIN_FILENO);
+    if (isInteractive)
+    {
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        setvbuf(stdin, NULL, _IONBF, 0);
+        setpgid(0, 0);
+        tcsetpgrp(STDIN_FILENO, getpid());
+    }
+    initJobControl();
+    // The line editor needs a terminal that understands cursor movement
+    struct LineEditor editor = {0};
+    struct termios terminal;
+    int isLineEditing = isInteractive && tcgetattr(STDIN_FILENO, &terminal) == 0 &&
+                        (getenv("TERM") == NULL || strcmp(getenv("TERM"), "dumb") != 0);
 
-    while (1)
+    isArenaDebug = getenv("SHELL24_ARENA_DEBUG") != NULL;
+    if (getenv("SHELL24_PARSE_CACHE") != NULL)
+    {
+        parseCache.capacity = atoi(getenv("SHELL24_PARSE_CACHE"));
+    }
+    if (getenv("SHELL24_GLOB_CACHE") != NULL)
     {
+        globCache.capacity = atoi(getenv("SHELL24_GLOB_CACHE"));
+    }
+    initLexer();
+    initFilters();
+    initTrace();
 
-        isCommandValid = 1;
-        printf("shell24$ ");
-        if (fgets(command, sizeof(command), stdin) == NULL)
+    while (1)
+    {
+        // Everything parsed from the previous line is released in one go
+        if (isArenaDebug && lineArena.allocated > 0)
         {
-            perror("fgets");
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "arena: %zu bytes this line, peak %zu bytes per line, %zu bytes held (peak %zu)\n",
+                    lineArena.allocated, lineArena.peakAllocated, lineArena.capacity, lineArena.peakCapacity);
         }
-        // Remove newline character
-        command[strcspn(command, "\n")] = '\0';
-        // Add spaces in between commands if it does not exist
-        addSpaces(command);
-        // Initialize an array of KeyValuePair with max size 5
-        struct KeyValuePair *keyValuePairs = malloc(MAX_NUMBER_OF_COMMANDS * sizeof(struct KeyValuePair));
-        int keyValuePairSize = 0;
-        // Parse input into arguments
-        parseInput(command, keyValuePairs, &keyValuePairSize);
-        if (!isCommandValid)
+        arenaReset(&lineArena);
+
+        // Tell about jobs that finished or stopped while the last line ran
+        updateAllJobs();
+        reportJobs(0);
+        updateSessions();
+        reportSessions(0);
+
+        size_t commandLength;
+        const char *command;
+        if (isLineEditing)
         {
-            continue;
+            command = editLine(&editor, "shell24$ ", &commandLength);
         }
-        // Print each KeyValuePair
-        // for (int i = 0; i < keyValuePairSize; i++) {
-        //     printf("KeyValuePair %d:\n", i + 1);
-        //     printKeyValuePair(keyValuePairs[i]);
-        //     printf("\n");
-        // }
-
-        // Execute command
-        if (strcmp(keyValuePairs[0].cmd[0], "newt") == 0)
+        else
         {
-            // If there is junk values along with newt
-            if (keyValuePairs[0].cmdLen > 1)
-            {
-                printf("Invalid Command\n");
-            }
-            else
+            if (isInteractive)
             {
-                printf("Creating a new shell24 session...\n");
-                // Fork and execute a new instance of shell24
-                openNewTerminal();
+                printf("shell24$ ");
+                fflush(stdout);
+                // Jobs that finish while the prompt waits are reported right away
+                int events;
+                do
+                {
+                    events = waitForEvents(1);
+                    if (events & JOB_EVENT_CHILD)
+                    {
+                        updateAllJobs();
+                        updateSessions();
+                        if (reportJobs(1) + reportSessions(1) > 0)
+                        {
+                            printf("shell24$ ");
+                            fflush(stdout);
+                        }
+                    }
+                } while (!(events & JOB_EVENT_INPUT));
             }
+            command = readSourceLine(&source, &commandLength);
         }
-        else if ((keyValuePairSize == 1) && (keyValuePairs[0].cmdLen == 2) && (strcmp(keyValuePairs[0].cmd[1], "&") == 0))
-        {
-            // Push the process to the background
-            pushBackground(keyValuePairs[0].cmd, keyValuePairs[0].cmdLen);
-        }
-        else if ((keyValuePairSize == 1) && (keyValuePairs[0].cmdLen == 1) && (strcmp(keyValuePairs[0].cmd[0], "fg") == 0))
-        {
-            isFgProcess = 1;
-            waitpid(readLastBgProcess(), NULL, 0);
-            isFgProcess = 0;
-        }
-        else if (keyValuePairs[0].cmdSuffix == NULL)
-        {
-            // There is only one command without any spacial characters
-            executeCommand(keyValuePairs[0].cmd, keyValuePairs[0].cmdLen);
-        }
-        else if (strcmp(keyValuePairs[0].cmdSuffix, "#") == 0)
+        if (command == NULL)
         {
-            if (keyValuePairSize > 6)
-            {
-                printf("More than 5 operations are not allowed\n");
-            }
-            else
+            // End of input ends the shell with the status of the last command, like exit
+            if (isInteractive)
             {
-                // Txt file concatenation upto 5 concatinations
-                fileConcatenation(keyValuePairs, keyValuePairSize, "#");
+                printf("\n");
             }
+            break;
         }
-        else if (strcmp(keyValuePairs[0].cmdSuffix, "|") == 0)
+        if (isCommentLine(command, commandLength))
         {
-            if (keyValuePairSize > 7)
-            {
-                printf("More than 6 pipes are not allowed\n");
-            }
-            else
-            {
-                // Implement code for piping
-                pipeOperation(keyValuePairs, keyValuePairSize, "|");
-            }
+            continue;
         }
-        else if ((strcmp(keyValuePairs[0].cmdSuffix, ">>") == 0) || (strcmp(keyValuePairs[0].cmdSuffix, ">") == 0) || (strcmp(keyValuePairs[0].cmdSuffix, "<") == 0))
+        // A line run before goes straight to execution
+        size_t keyLength = commandLength;
+        while (keyLength > 0 && (command[keyLength - 1] == '\n' || command[keyLength - 1] == '\r'))
         {
-            if (keyValuePairSize > 2)
-            {
-                printf("More than 2 commands not allowed for %s\n", keyValuePairs[0].cmdSuffix);
-            }
-            else
-            {
-                // Implement code for redirection
-                redirection(keyValuePairs, keyValuePairSize, keyValuePairs[0].cmdSuffix);
-            }
+            keyLength--;
         }
-        else if ((strcmp(keyValuePairs[0].cmdSuffix, "&&") == 0) || (strcmp(keyValuePairs[0].cmdSuffix, "||") == 0))
+        if (isInteractive)
         {
-            if (keyValuePairSize > 6)
-            {
-                printf("More than 5 conditional operations are not allowed\n");
-            }
-            else
-            {
-                // Conditional execution
-                conditionalExecution(keyValuePairs, keyValuePairSize);
-            }
+            addHistory(command, keyLength);
         }
-        else if (strcmp(keyValuePairs[0].cmdSuffix, ";") == 0)
+        double parseStart = nowSeconds();
+        unsigned long long lineHash = hashLine(command, keyLength);
+        struct AstNode *tree = lookupParseCache(command, keyLength, lineHash);
+        int isCached = tree != NULL;
+        if (tree == NULL)
         {
-            if (keyValuePairSize > 5)
+            // Split the line into tokens, operators do not need spaces around them
+            struct Token *tokens;
+            int tokenCount = lexLine(command, commandLength, &tokens);
+            if (tokenCount == -1)
             {
-                printf("More than 5 commands are not allowed\n");
+                lastExitStatus = 2;
+                continue;
             }
-            else
+            // Build the parse tree, any mix of operators is allowed
+            tree = parseLine(tokens, tokenCount);
+            if (tree == NULL)
+            {
+                // Syntax errors fail the line like in sh, an empty line changes nothing
+                lastExitStatus = tokenCount > 0 ? 2 : lastExitStatus;
+                continue;
+            }
+            // Here-docs take the lines after this one, so such a line is never the same twice
+            if (readHereDocuments(tree, &source) == 0)
             {
-                // Sequential execution
-                sequentialExecution(keyValuePairs, keyValuePairSize, ";");
+                storeParseCache(command, keyLength, lineHash, tree);
             }
         }
+
+        double lineStart = nowSeconds();
+        traceEvent('X', "parse", trace.pid, parseStart, lineStart - parseStart, "cached", isCached, "parse");
+
+        // Execute command
+        // SHELL24_STATS times every line as if it started with time
+        lastExitStatus = getenv("SHELL24_STATS") != NULL ? executeTimed(tree) : executeNode(tree);
+        traceEvent('X', "line", trace.pid, lineStart, nowSeconds() - lineStart, "status", lastExitStatus, "%.*s",
+                   (int)(keyLength < TRACE_NAME_LENGTH ? keyLength : TRACE_NAME_LENGTH - 1), command);
     }
 
-    return 0;
-}
\ No newline at end of file
+    fflush(stdout);
+    return lastExitStatus;
+}
+#endif
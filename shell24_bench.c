@@ -0,0 +1,1235 @@
+// The shell itself is compiled in so in-process workloads can call its functions directly
+#define SHELL24_NO_MAIN
+#include "shell24.c"
+#include <time.h>
+#include <glob.h>
+
+// Benchmarks for shell24. Process workloads run generated scripts under every shell given with
+// --shell, so shell24 can be compared with bash and dash on the same work. The parse workload
+// runs the lexer in-process against a copy of the old addSpaces/strtok_r parser, and the glob
+// workload runs the glob expansion in-process against glob(3) on a directory of --entries files.
+//
+// Latencies are measured per command: every timed line starts with "shell24_bench stamp", which
+// appends the time it started to a file. The gaps between consecutive stamps are the samples the
+// percentiles are computed from, so they include reading, parsing, spawning and waiting.
+//
+// Build: gcc -O2 -o shell24_bench shell24_bench.c
+// Usage: ./shell24_bench <workload|all> [--shell ./shell24,bash,dash] [--dir /tmp] [--size-mb N]
+//                        [--files N] [--lines N] [--iterations N] [--stages N] [--entries N]
+
+#define BENCH_MAX_SHELLS 8
+
+// Options shared by every workload
+struct BenchOptions
+{
+    char *shellPaths[BENCH_MAX_SHELLS]; // Shells to compare, looked up in PATH without a /
+    int shellCount;
+    const char *dir;          // Scratch directory for generated inputs
+    long sizeMb;              // Size of each generated input file
+    int fileCount;            // Number of generated input files
+    long lineCount;           // Lines of generated scripts
+    int iterations;           // Samples per shell of the stamped workloads, 0 for the workload's default
+    int stageCount;           // Stages of the pipeline workload
+    long entryCount;          // Files in the directory of the glob workload
+    char stampCommand[4096];  // Command that records a stamp, this binary with the stamp argument
+    char stampPath[4096];     // File the stamps are appended to
+};
+
+// One named workload
+struct BenchWorkload
+{
+    const char *name;
+    int (*run)(struct BenchOptions *options);
+};
+
+// shell24 understands # and the SHELL24_* settings, other shells get the portable variant
+int isShell24(const char *shellPath)
+{
+    const char *name = strrchr(shellPath, '/');
+    return strstr(name != NULL ? name + 1 : shellPath, "shell24") != NULL;
+}
+
+// Runs shellPath with script fed on its stdin and its stdout/stderr sent to /dev/null.
+// Returns the wall time in seconds or -1 on failure.
+double runShellScript(const char *shellPath, const char *script)
+{
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    posix_spawn_file_actions_t fileActions;
+    posix_spawn_file_actions_init(&fileActions);
+    posix_spawn_file_actions_adddup2(&fileActions, pipeFds[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fileActions, devNull, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fileActions, devNull, STDERR_FILENO);
+
+    char *args[] = {(char *)shellPath, NULL};
+    pid_t pid;
+    double start = nowSeconds();
+    int error = posix_spawnp(&pid, shellPath, &fileActions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&fileActions);
+    close(pipeFds[0]);
+    close(devNull);
+    if (error != 0)
+    {
+        errno = error;
+        perror(shellPath);
+        close(pipeFds[1]);
+        return -1;
+    }
+
+    size_t length = strlen(script);
+    for (size_t written = 0; written < length;)
+    {
+        ssize_t result = write(pipeFds[1], script + written, length - written);
+        if (result == -1)
+        {
+            perror("write");
+            break;
+        }
+        written += result;
+    }
+    close(pipeFds[1]);
+    waitpid(pid, NULL, 0);
+    return nowSeconds() - start;
+}
+
+// Runs args with stdin read from inputPath and stdout/stderr sent to /dev/null.
+// Returns the wall time in seconds or -1 on failure.
+double runShellFile(char *args[], const char *inputPath)
+{
+    int inputFd = open(inputPath, O_RDONLY | O_CLOEXEC);
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (inputFd == -1)
+    {
+        perror(inputPath);
+        close(devNull);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t fileActions;
+    posix_spawn_file_actions_init(&fileActions);
+    posix_spawn_file_actions_adddup2(&fileActions, inputFd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fileActions, devNull, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fileActions, devNull, STDERR_FILENO);
+
+    pid_t pid;
+    double start = nowSeconds();
+    int error = posix_spawnp(&pid, args[0], &fileActions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&fileActions);
+    close(inputFd);
+    close(devNull);
+    if (error != 0)
+    {
+        errno = error;
+        perror(args[0]);
+        return -1;
+    }
+    waitpid(pid, NULL, 0);
+    return nowSeconds() - start;
+}
+
+// Creates path with sizeMb megabytes of text unless a file of that size is already there
+int generateTextFile(const char *path, long sizeMb)
+{
+    struct stat fileStat;
+    off_t size = (off_t)sizeMb << 20;
+    if (stat(path, &fileStat) == 0 && fileStat.st_size == size)
+    {
+        return 0;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    // Lines of varying length, some far longer than the old 1 KB line buffer
+    char *block = malloc(1 << 20);
+    for (int i = 0; i < (1 << 20); i++)
+    {
+        block[i] = (i % 4093 == 4092) ? '\n' : (char)('a' + i % 26);
+    }
+    for (long i = 0; i < sizeMb; i++)
+    {
+        if (write(fd, block, 1 << 20) != (1 << 20))
+        {
+            perror("write");
+            free(block);
+            close(fd);
+            return -1;
+        }
+    }
+    free(block);
+    close(fd);
+    return 0;
+}
+
+int compareDoubles(const void *a, const void *b)
+{
+    double left = *(const double *)a;
+    double right = *(const double *)b;
+    return (left > right) - (left < right);
+}
+
+// Nearest rank percentile of sorted samples
+double percentile(double *sorted, int count, double rank)
+{
+    int index = (int)(rank / 100 * count + 0.5) - 1;
+    return sorted[index < 0 ? 0 : (index >= count ? count - 1 : index)];
+}
+
+// Prints the percentiles of samples in seconds, sorting them. With megabytes the throughput at
+// the median is added.
+void printSamples(const char *workload, const char *label, double *samples, int count, double megabytes)
+{
+    if (count == 0)
+    {
+        printf("%-9s %-22s no samples\n", workload, label);
+        return;
+    }
+    double total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        total += samples[i];
+    }
+    qsort(samples, count, sizeof(double), compareDoubles);
+    printf("%-9s %-22s %10.1fus %10.1fus %10.1fus %10.1fus %10.1fus", workload, label, percentile(samples, count, 50) * 1e6,
+           percentile(samples, count, 90) * 1e6, percentile(samples, count, 99) * 1e6, samples[count - 1] * 1e6,
+           total / count * 1e6);
+    if (megabytes > 0)
+    {
+        printf(" %9.1f MB/s", megabytes / percentile(samples, count, 50));
+    }
+    printf("  (%d samples)\n", count);
+}
+
+void printSampleHeader(const char *workload)
+{
+    printf("%-9s %-22s %12s %12s %12s %12s %12s\n", workload, "shell", "p50", "p90", "p99", "max", "mean");
+}
+
+// Runs iterations lines of stamp followed by body under shellPath, e.g. body " && true" gives
+// "shell24_bench stamp && true". Stores the time of every line in samples and returns how many
+// there are, or -1 on failure.
+int runStamped(struct BenchOptions *options, const char *shellPath, const char *body, int iterations, double *samples)
+{
+    char scriptPath[4096];
+    snprintf(scriptPath, sizeof(scriptPath), "%s/shell24_bench_script.sh", options->dir);
+    FILE *script = fopen(scriptPath, "w");
+    if (script == NULL)
+    {
+        perror(scriptPath);
+        return -1;
+    }
+    for (int i = 0; i < iterations; i++)
+    {
+        fprintf(script, "%s%s\n", options->stampCommand, body);
+    }
+    // One more stamp marks the end of the last line
+    fprintf(script, "%s\n", options->stampCommand);
+    fclose(script);
+
+    unlink(options->stampPath);
+    setenv("SHELL24_BENCH_STAMPS", options->stampPath, 1);
+    char *args[] = {(char *)shellPath, scriptPath, NULL};
+    double seconds = runShellFile(args, "/dev/null");
+    unlink(scriptPath);
+    if (seconds < 0)
+    {
+        return -1;
+    }
+
+    int fd = open(options->stampPath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "%s: no stamps recorded\n", shellPath);
+        return -1;
+    }
+    double *stamps = malloc((iterations + 1) * sizeof(double));
+    ssize_t bytes = read(fd, stamps, (iterations + 1) * sizeof(double));
+    close(fd);
+    int stampCount = bytes > 0 ? bytes / sizeof(double) : 0;
+    for (int i = 0; i + 1 < stampCount; i++)
+    {
+        samples[i] = stamps[i + 1] - stamps[i];
+    }
+    free(stamps);
+    return stampCount > 0 ? stampCount - 1 : 0;
+}
+
+// Runs the same stamped body under every shell and prints one row per shell
+int benchStampedBody(struct BenchOptions *options, const char *workload, const char *body, int iterations)
+{
+    double *samples = malloc(iterations * sizeof(double));
+    printSampleHeader(workload);
+    for (int i = 0; i < options->shellCount; i++)
+    {
+        int count = runStamped(options, options->shellPaths[i], body, iterations, samples);
+        if (count < 0)
+        {
+            free(samples);
+            return 1;
+        }
+        printSamples(workload, options->shellPaths[i], samples, count, 0);
+    }
+    free(samples);
+    return 0;
+}
+
+// Latency of a single external command, the stamp itself, from one line to the next
+int benchSpawn(struct BenchOptions *options)
+{
+    return benchStampedBody(options, "spawn", "", options->iterations > 0 ? options->iterations : 2000);
+}
+
+// Latency of a line chaining builtins and external commands with && || and ;
+int benchChain(struct BenchOptions *options)
+{
+    return benchStampedBody(options, "chain", " && true && /bin/true ; /bin/false || /bin/true",
+                            options->iterations > 0 ? options->iterations : 500);
+}
+
+// Time and throughput of cat input | cat | ... with stageCount stages
+int benchPipeline(struct BenchOptions *options)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/shell24_bench_pipe.txt", options->dir);
+    printf("preparing %s (%ld MB)\n", path, options->sizeMb);
+    if (generateTextFile(path, options->sizeMb) == -1)
+    {
+        return 1;
+    }
+    char *body = malloc(4200 + options->stageCount * 8);
+    int length = sprintf(body, " ; cat %s", path);
+    for (int i = 1; i < options->stageCount; i++)
+    {
+        length += sprintf(body + length, " | cat");
+    }
+    sprintf(body + length, " > /dev/null");
+
+    int iterations = options->iterations > 0 ? options->iterations : 10;
+    double *samples = malloc(iterations * sizeof(double));
+    char workload[32];
+    snprintf(workload, sizeof(workload), "pipe%d", options->stageCount);
+    printSampleHeader(workload);
+    for (int i = 0; i < options->shellCount; i++)
+    {
+        int count = runStamped(options, options->shellPaths[i], body, iterations, samples);
+        if (count < 0)
+        {
+            break;
+        }
+        printSamples(workload, options->shellPaths[i], samples, count, options->sizeMb);
+    }
+    free(samples);
+    free(body);
+    return 0;
+}
+
+// Throughput of # compared to cat, both writing into a file. Shells other than shell24 only
+// have cat.
+int benchConcat(struct BenchOptions *options)
+{
+    char outputPath[4096];
+    char *concatBody = malloc(options->fileCount * 4200 + 4200);
+    char *catBody = malloc(options->fileCount * 4200 + 4200);
+    snprintf(outputPath, sizeof(outputPath), "%s/shell24_bench_concat.out", options->dir);
+    strcpy(concatBody, " ; ");
+    strcpy(catBody, " ; cat");
+    for (int i = 0; i < options->fileCount; i++)
+    {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/shell24_bench_concat_%d.txt", options->dir, i);
+        printf("preparing %s (%ld MB)\n", path, options->sizeMb);
+        if (generateTextFile(path, options->sizeMb) == -1)
+        {
+            free(concatBody);
+            free(catBody);
+            return 1;
+        }
+        strcat(concatBody, i > 0 ? " # " : "");
+        strcat(concatBody, path);
+        strcat(catBody, " ");
+        strcat(catBody, path);
+    }
+    strcat(concatBody, " > ");
+    strcat(concatBody, outputPath);
+    strcat(catBody, " > ");
+    strcat(catBody, outputPath);
+
+    int iterations = options->iterations > 0 ? options->iterations : 5;
+    double *samples = malloc(iterations * sizeof(double));
+    double totalMb = (double)options->sizeMb * options->fileCount;
+    printSampleHeader("concat");
+    for (int i = 0; i < options->shellCount; i++)
+    {
+        char label[256];
+        for (int variant = isShell24(options->shellPaths[i]) ? 0 : 1; variant < 2; variant++)
+        {
+            snprintf(label, sizeof(label), "%s %s", options->shellPaths[i], variant == 0 ? "#" : "cat");
+            int count = runStamped(options, options->shellPaths[i], variant == 0 ? concatBody : catBody, iterations, samples);
+            if (count >= 0)
+            {
+                printSamples("concat", label, samples, count, totalMb);
+            }
+        }
+    }
+    unlink(outputPath);
+    free(samples);
+    free(concatBody);
+    free(catBody);
+    return 0;
+}
+
+// Throughput of a cat | cat | cat | cat pipeline in shell24 with default pipes and with bigger
+// pipe buffers
+int benchPipe(struct BenchOptions *options)
+{
+    char path[4096];
+    char script[8192];
+    snprintf(path, sizeof(path), "%s/shell24_bench_pipe.txt", options->dir);
+    printf("preparing %s (%ld MB)\n", path, options->sizeMb);
+    if (generateTextFile(path, options->sizeMb) == -1)
+    {
+        return 1;
+    }
+    snprintf(script, sizeof(script), "cat %s | cat | cat | cat > /dev/null\n", path);
+
+    const char *pipeSizes[] = {NULL, "256K", "1M"};
+    for (int i = 0; i < (int)(sizeof(pipeSizes) / sizeof(pipeSizes[0])); i++)
+    {
+        if (pipeSizes[i] == NULL)
+        {
+            unsetenv("SHELL24_PIPE_SIZE");
+        }
+        else
+        {
+            setenv("SHELL24_PIPE_SIZE", pipeSizes[i], 1);
+        }
+        double seconds = runShellScript(options->shellPaths[0], script);
+        if (seconds < 0)
+        {
+            return 1;
+        }
+        printf("pipe  %-7s buffers: %8ld MB in %7.3f s = %8.1f MB/s\n", pipeSizes[i] != NULL ? pipeSizes[i] : "default",
+               options->sizeMb, seconds, options->sizeMb / seconds);
+    }
+    unsetenv("SHELL24_PIPE_SIZE");
+    return 0;
+}
+
+// Commands per second of a long generated script, run as shell script, shell < script and
+// cat script | shell. Most lines are builtins so the shell's own per-line cost dominates.
+int benchBatch(struct BenchOptions *options)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/shell24_bench_batch.sh", options->dir);
+    FILE *script = fopen(path, "w");
+    if (script == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    fprintf(script, "# generated by shell24_bench\n");
+    for (long i = 0; i < options->lineCount; i++)
+    {
+        switch (i % 4)
+        {
+        case 0:
+            fprintf(script, "echo line %ld\n", i);
+            break;
+        case 1:
+            fprintf(script, "true && cd .\n");
+            break;
+        case 2:
+            fprintf(script, "false || pwd > /dev/null\n");
+            break;
+        default:
+            fprintf(script, "export BENCH_LINE=%ld\n", i);
+            break;
+        }
+    }
+    fclose(script);
+
+    const char *names[] = {"script file", "stdin file", "stdin pipe"};
+    for (int shell = 0; shell < options->shellCount; shell++)
+    {
+        char *shellPath = options->shellPaths[shell];
+        char catCommand[8192];
+        snprintf(catCommand, sizeof(catCommand), "cat %s | %s", path, shellPath);
+        char *fileArgs[] = {shellPath, path, NULL};
+        char *stdinArgs[] = {shellPath, NULL};
+        char *pipeArgs[] = {"/bin/sh", "-c", catCommand, NULL};
+        char **modes[] = {fileArgs, stdinArgs, pipeArgs};
+        for (int i = 0; i < 3; i++)
+        {
+            double seconds = runShellFile(modes[i], i == 1 ? path : "/dev/null");
+            if (seconds < 0)
+            {
+                unlink(path);
+                return 1;
+            }
+            printf("batch  %-22s %-11s: %8ld lines in %7.3f s = %10.0f lines/s\n", shellPath, names[i], options->lineCount,
+                   seconds, options->lineCount / seconds);
+        }
+    }
+    unlink(path);
+    return 0;
+}
+
+// The parser as it was before lexLine: addSpaces into a second buffer, strcpy back, then
+// strtok_r with a strstr for ~/ and a strcmp chain per token. Buffers are sized for the line
+// so that long lines can be measured at all, the old fixed buffers would overflow.
+int legacyParse(char *command)
+{
+    size_t len = strlen(command);
+    char *modified = malloc(len * 3 + 1);
+    size_t j = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        char currentChar = command[i];
+        int isMultiCharOp = currentChar == '>' || currentChar == '&' || currentChar == '|';
+        if (currentChar == '#' || currentChar == '<' || currentChar == ';' || isMultiCharOp)
+        {
+            if (i > 0 && command[i - 1] != ' ')
+            {
+                modified[j++] = ' ';
+            }
+            modified[j++] = currentChar;
+            if (isMultiCharOp && i < len - 1 && command[i + 1] == currentChar)
+            {
+                modified[j++] = command[++i];
+            }
+            if (i < len - 1 && command[i + 1] != ' ')
+            {
+                modified[j++] = ' ';
+            }
+        }
+        else
+        {
+            modified[j++] = currentChar;
+        }
+    }
+    modified[j] = '\0';
+    char *rewritten = malloc(j + 1);
+    strcpy(rewritten, modified);
+
+    int tokenCount = 0;
+    char *saveptr;
+    char *token = strtok_r(rewritten, " ", &saveptr);
+    while (token != NULL)
+    {
+        char *expanded = NULL;
+        if (strstr(token, "~/") != NULL)
+        {
+            expanded = strdup(token);
+        }
+        if (token[0] == '"')
+        {
+            char *endQuote = strchr(token + 1, '"');
+            while (endQuote == NULL && (token = strtok_r(NULL, " ", &saveptr)) != NULL)
+            {
+                endQuote = strchr(token, '"');
+            }
+            if (token == NULL)
+            {
+                break;
+            }
+        }
+        if (!(strcmp(token, "#") == 0 || strcmp(token, "|") == 0 || strcmp(token, ">>") == 0 || strcmp(token, ">") == 0 || strcmp(token, "<") == 0 || strcmp(token, "&&") == 0 || strcmp(token, "||") == 0 || strcmp(token, ";") == 0))
+        {
+            // The old parser strdup'd every word
+            free(strdup(token));
+        }
+        free(expanded);
+        tokenCount++;
+        token = strtok_r(NULL, " ", &saveptr);
+    }
+    free(modified);
+    free(rewritten);
+    return tokenCount;
+}
+
+// Builds a command line of roughly length bytes mixing words, paths, quotes and operators
+char *generateCommandLine(size_t length)
+{
+    const char *pieces[] = {"grep", "--color=auto", "-n", "pattern_value", "/var/log/syslog.1", "|", "sort", "-u",
+                            "\"quoted words here\"", "&&", "wc", "-l", ">", "/tmp/out.txt", ";", "echo", "done", "||",
+                            "~/bin/tool", "#", "notes.txt"};
+    int pieceCount = sizeof(pieces) / sizeof(pieces[0]);
+    char *line = malloc(length + 64);
+    size_t used = 0;
+    for (int i = 0; used < length; i++)
+    {
+        used += sprintf(line + used, "%s ", pieces[i % pieceCount]);
+    }
+    return line;
+}
+
+// Lines per second of the old parser and of lexLine on generated lines of several lengths, the
+// work is split into rounds so the percentiles show how steady each parser is
+int benchParse(struct BenchOptions *options)
+{
+    size_t lengths[] = {80, 1000, 64 * 1024, 1024 * 1024};
+    int roundCount = 50;
+    double legacySamples[roundCount];
+    double lexerSamples[roundCount];
+    initLexer();
+    printf("%-9s %-22s %12s %12s %12s %12s %12s\n", "parse", "parser", "p50", "p90", "p99", "max", "mean");
+    for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++)
+    {
+        char *line = generateCommandLine(lengths[i]);
+        size_t lineLength = strlen(line);
+        char *scratch = malloc(lineLength + 1);
+        // Enough repetitions to parse about 128 MB of input with each parser
+        long iterations = (128L << 20) / lineLength / roundCount + 1;
+
+        long legacyTokens = 0;
+        long lexerTokens = 0;
+        for (int round = 0; round < roundCount; round++)
+        {
+            double start = nowSeconds();
+            for (long n = 0; n < iterations; n++)
+            {
+                memcpy(scratch, line, lineLength + 1);
+                legacyTokens += legacyParse(scratch);
+            }
+            legacySamples[round] = (nowSeconds() - start) / iterations;
+
+            start = nowSeconds();
+            for (long n = 0; n < iterations; n++)
+            {
+                struct Token *tokens;
+                lexerTokens += lexLine(line, lineLength, &tokens);
+                arenaReset(&lineArena);
+            }
+            lexerSamples[round] = (nowSeconds() - start) / iterations;
+        }
+
+        // Per line times, with the throughput at the median
+        char label[64];
+        double megabytes = (double)lineLength / (1 << 20);
+        snprintf(label, sizeof(label), "old %zu bytes", lineLength);
+        printSamples("parse", label, legacySamples, roundCount, megabytes);
+        snprintf(label, sizeof(label), "lexer %zu bytes", lineLength);
+        printSamples("parse", label, lexerSamples, roundCount, megabytes);
+        if (legacyTokens != lexerTokens)
+        {
+            printf("parse token counts differ: old %ld, lexer %ld\n", legacyTokens, lexerTokens);
+        }
+        free(scratch);
+        free(line);
+    }
+    (void)options;
+    return 0;
+}
+
+// Fills path with entryCount empty files, every tenth one a .txt and the rest .log. The mtime
+// of the directory is set an hour back so the glob cache trusts it right away.
+int generateGlobDirectory(const char *path, long entryCount)
+{
+    char name[4096];
+    snprintf(name, sizeof(name), "%s/file%07ld.log", path, entryCount - 1);
+    if (access(name, F_OK) == 0)
+    {
+        return 0;
+    }
+    if (mkdir(path, 0755) == -1 && errno != EEXIST)
+    {
+        perror(path);
+        return -1;
+    }
+    int dirFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    for (long i = 0; i < entryCount; i++)
+    {
+        snprintf(name, sizeof(name), "file%07ld.%s", i, i % 10 == 0 ? "txt" : "log");
+        int fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            perror(name);
+            close(dirFd);
+            return -1;
+        }
+        close(fd);
+    }
+    struct timespec times[2] = {{0, UTIME_OMIT}, {time(NULL) - 3600, 0}};
+    futimens(dirFd, times);
+    close(dirFd);
+    return 0;
+}
+
+// Time to expand a few patterns on a big directory: glob(3), shell24 reading the directory every
+// time, and shell24 with the listing cache. A pattern with a literal prefix shows the binary search.
+int benchGlob(struct BenchOptions *options)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/shell24_bench_glob.%ld", options->dir, options->entryCount);
+    printf("glob      creating %ld files in %s\n", options->entryCount, path);
+    if (generateGlobDirectory(path, options->entryCount) == -1)
+    {
+        return 1;
+    }
+    const char *suffixes[] = {"*.txt", "file00012*", "f*[0-4]?[05].log"};
+    int rounds = options->iterations > 0 ? options->iterations : 20;
+    double *samples = malloc(rounds * sizeof(double));
+    initLexer();
+    printf("%-9s %-22s %12s %12s %12s %12s %12s\n", "glob", "expansion", "p50", "p90", "p99", "max", "mean");
+    for (int i = 0; i < (int)(sizeof(suffixes) / sizeof(suffixes[0])); i++)
+    {
+        char pattern[4200];
+        snprintf(pattern, sizeof(pattern), "%s/%s", path, suffixes[i]);
+        char label[64];
+        size_t libcCount = 0;
+        for (int round = 0; round < rounds; round++)
+        {
+            glob_t result;
+            double start = nowSeconds();
+            glob(pattern, 0, NULL, &result);
+            samples[round] = nowSeconds() - start;
+            libcCount = result.gl_pathc;
+            globfree(&result);
+        }
+        snprintf(label, sizeof(label), "libc %s", suffixes[i]);
+        printSamples("glob", label, samples, rounds, 0);
+
+        // Without the cache every expansion reads and sorts the directory, with it only the first
+        int counts[2] = {0, 0};
+        for (int isCached = 0; isCached <= 1; isCached++)
+        {
+            globCache.capacity = isCached ? GLOB_CACHE_CAPACITY : 0;
+            while (globCache.count > 0)
+            {
+                dropCachedListing(0);
+            }
+            for (int round = 0; round < rounds; round++)
+            {
+                struct WordList list = {NULL, 0, 0};
+                double start = nowSeconds();
+                counts[isCached] = expandGlob(pattern, &list);
+                samples[round] = nowSeconds() - start;
+                arenaReset(&lineArena);
+            }
+            snprintf(label, sizeof(label), "%s %s", isCached ? "cached" : "read", suffixes[i]);
+            printSamples("glob", label, samples, rounds, 0);
+        }
+        if ((size_t)counts[0] != libcCount || (size_t)counts[1] != libcCount)
+        {
+            printf("glob match counts differ: glob(3) %zu, shell24 %d and %d\n", libcCount, counts[0], counts[1]);
+        }
+    }
+    free(samples);
+    return 0;
+}
+
+// Time to open a history log of lineCount entries, to index it once and to search it, against
+// the linear scan the index replaces. Queries are picked so some are rare and some common.
+int benchHistory(struct BenchOptions *options)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/shell24_bench_history.%ld", options->dir, options->lineCount);
+    if (access(path, F_OK) != 0)
+    {
+        printf("history   writing %ld entries to %s\n", options->lineCount, path);
+        FILE *file = fopen(path, "w");
+        if (file == NULL)
+        {
+            perror(path);
+            return 1;
+        }
+        const char *commands[] = {"git commit -m", "make -j8 target", "grep -rn pattern src/module", "cd /srv/project",
+                                  "ssh build-host", "ls -la /var/log/app"};
+        for (long i = 0; i < options->lineCount; i++)
+        {
+            fprintf(file, "%s%ld %s\n", commands[i % 6], i % 997, i % 50000 == 7 ? "rare-needle" : "");
+        }
+        fclose(file);
+    }
+    setVariable("SHELL24_HISTORY", strlen("SHELL24_HISTORY"), path, 0);
+
+    // Only the open is paid at startup, the rest on the first use of the history
+    double start = nowSeconds();
+    initHistory();
+    double opened = nowSeconds();
+    refreshHistory();
+    double mapped = nowSeconds();
+    indexHistory();
+    double indexed = nowSeconds();
+    printf("history   %u entries: open %.1fus, map and find lines %.1fms, trigram index %.1fms\n", history.count,
+           (opened - start) * 1e6, (mapped - opened) * 1e3, (indexed - mapped) * 1e3);
+
+    const char *queries[] = {"rare-needle", "grep -rn pattern src/module996", "commit", "no such command"};
+    int rounds = options->iterations > 0 ? options->iterations : 200;
+    double *samples = malloc(rounds * sizeof(double));
+    printf("%-9s %-22s %12s %12s %12s %12s %12s\n", "history", "search", "p50", "p90", "p99", "max", "mean");
+    for (int i = 0; i < (int)(sizeof(queries) / sizeof(queries[0])); i++)
+    {
+        size_t queryLength = strlen(queries[i]);
+        char label[64];
+        int found[2] = {-1, -1};
+        for (int round = 0; round < rounds; round++)
+        {
+            // Ten steps back through the matches like repeated Ctrl-R
+            double begin = nowSeconds();
+            int index = history.count;
+            for (int step = 0; step < 10 && index >= 0; step++)
+            {
+                index = searchHistory(queries[i], queryLength, index);
+            }
+            samples[round] = nowSeconds() - begin;
+            found[0] = index;
+        }
+        snprintf(label, sizeof(label), "index %.14s", queries[i]);
+        printSamples("history", label, samples, rounds, 0);
+        for (int round = 0; round < rounds; round++)
+        {
+            double begin = nowSeconds();
+            int index = history.count;
+            for (int step = 0; step < 10 && index >= 0; step++)
+            {
+                while (--index >= 0)
+                {
+                    size_t length;
+                    const char *text = historyEntry(index, &length);
+                    if (memmem(text, length, queries[i], queryLength) != NULL)
+                    {
+                        break;
+                    }
+                }
+            }
+            samples[round] = nowSeconds() - begin;
+            found[1] = index;
+        }
+        snprintf(label, sizeof(label), "scan %.14s", queries[i]);
+        printSamples("history", label, samples, rounds, 0);
+        if (found[0] != found[1])
+        {
+            printf("history results differ: index %d, scan %d\n", found[0], found[1]);
+        }
+    }
+    free(samples);
+    return 0;
+}
+
+// Fills path with count empty files named like pcmd0000123 for prefix p, dated like
+// generateGlobDirectory so the trie trusts the directory right away
+int generatePathDirectory(const char *path, char prefix, long count)
+{
+    char name[4200];
+    snprintf(name, sizeof(name), "%s/%ccmd%07ld", path, prefix, count - 1);
+    if (access(name, F_OK) == 0)
+    {
+        return 0;
+    }
+    if (mkdir(path, 0755) == -1 && errno != EEXIST)
+    {
+        perror(path);
+        return -1;
+    }
+    int dirFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    for (long i = 0; i < count; i++)
+    {
+        snprintf(name, sizeof(name), "%ccmd%07ld", prefix, i);
+        int fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+        if (fd == -1)
+        {
+            perror(name);
+            close(dirFd);
+            return -1;
+        }
+        close(fd);
+    }
+    struct timespec times[2] = {{0, UTIME_OMIT}, {time(NULL) - 3600, 0}};
+    futimens(dirFd, times);
+    close(dirFd);
+    return 0;
+}
+
+// Time of a Tab on a command name with entryCount commands spread over eight PATH directories:
+// shell24's trie with its mtime checks against reading every PATH directory for each Tab.
+int benchComplete(struct BenchOptions *options)
+{
+    char root[4096];
+    char pathValue[8 * 4200] = "";
+    snprintf(root, sizeof(root), "%s/shell24_bench_path.%ld", options->dir, options->entryCount);
+    printf("complete  creating %ld commands in 8 directories under %s\n", options->entryCount, root);
+    if (mkdir(root, 0755) == -1 && errno != EEXIST)
+    {
+        perror(root);
+        return 1;
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        char path[4200];
+        snprintf(path, sizeof(path), "%s/%c", root, 'a' + i);
+        if (generatePathDirectory(path, 'a' + i, options->entryCount / 8) == -1)
+        {
+            return 1;
+        }
+        snprintf(pathValue + strlen(pathValue), sizeof(pathValue) - strlen(pathValue), "%s%s", i > 0 ? ":" : "", path);
+    }
+    setVariable("PATH", strlen("PATH"), pathValue, 0);
+
+    double start = nowSeconds();
+    refreshCommandTrie(&commandTrie);
+    printf("complete  first Tab reads PATH and builds the trie of %d names in %.1fms\n", commandTrie.nodes[0].count,
+           (nowSeconds() - start) * 1e3);
+
+    const char *prefixes[] = {"ccmd000012", "ccmd", "missing"};
+    int rounds = options->iterations > 0 ? options->iterations : 200;
+    double *samples = malloc(rounds * sizeof(double));
+    printf("%-9s %-22s %12s %12s %12s %12s %12s\n", "complete", "prefix", "p50", "p90", "p99", "max", "mean");
+    for (int i = 0; i < (int)(sizeof(prefixes) / sizeof(prefixes[0])); i++)
+    {
+        size_t prefixLength = strlen(prefixes[i]);
+        char label[64];
+        int counts[2] = {0, 0};
+        for (int round = 0; round < rounds; round++)
+        {
+            struct Completion completion = {{NULL, 0, 0}, 0, 0, "", 0, 0};
+            double begin = nowSeconds();
+            completeCommandName(prefixes[i], prefixLength, &completion);
+            samples[round] = nowSeconds() - begin;
+            counts[0] = completion.count;
+            arenaReset(&lineArena);
+        }
+        snprintf(label, sizeof(label), "trie %s", prefixes[i]);
+        printSamples("complete", label, samples, rounds, 0);
+
+        // What a shell without the trie does: read the directories again and filter the names
+        int scanRounds = rounds < 20 ? rounds : 20;
+        for (int round = 0; round < scanRounds; round++)
+        {
+            double begin = nowSeconds();
+            counts[1] = 0;
+            for (int j = 0; j < commandTrie.directoryCount; j++)
+            {
+                struct stat info;
+                struct DirectoryListing *listing = stat(commandTrie.directories[j].path, &info) == 0
+                                                       ? readListing(commandTrie.directories[j].path, &info, 0)
+                                                       : NULL;
+                for (size_t k = 0; listing != NULL && k < listing->count; k++)
+                {
+                    counts[1] += strncmp(listing->names + listing->entries[k].offset, prefixes[i], prefixLength) == 0;
+                }
+                if (listing != NULL)
+                {
+                    freeListing(listing);
+                }
+            }
+            samples[round] = nowSeconds() - begin;
+        }
+        snprintf(label, sizeof(label), "rescan %s", prefixes[i]);
+        printSamples("complete", label, samples, scanRounds, 0);
+        if (counts[0] != counts[1])
+        {
+            printf("complete match counts differ: trie %d, rescan %d\n", counts[0], counts[1]);
+        }
+    }
+    free(samples);
+    return 0;
+}
+
+// Latency of a short cat | grep | wc pipeline under every shell and under shell24 without its
+// filter threads, then the throughput of the newline count and fixed string search kernels
+// against their scalar versions on --size-mb of text in memory
+int benchFilter(struct BenchOptions *options)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/shell24_bench_filter.txt", options->dir);
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    for (int i = 0; i < 100; i++)
+    {
+        fprintf(file, "line %d of a short file%s\n", i, i % 10 == 3 ? " with a needle" : "");
+    }
+    fclose(file);
+
+    char body[4200];
+    snprintf(body, sizeof(body), " ; cat %s | grep -F needle | wc -l", path);
+    int iterations = options->iterations > 0 ? options->iterations : 500;
+    double *samples = malloc(iterations * sizeof(double));
+    printSampleHeader("filter");
+    for (int i = 0; i < options->shellCount; i++)
+    {
+        for (int isThreaded = 1; isThreaded >= 0; isThreaded--)
+        {
+            if (!isThreaded && !isShell24(options->shellPaths[i]))
+            {
+                continue;
+            }
+            setenv("SHELL24_FILTERS", isThreaded ? "1" : "0", 1);
+            int count = runStamped(options, options->shellPaths[i], body, iterations, samples);
+            char label[64];
+            snprintf(label, sizeof(label), "%.12s%s", options->shellPaths[i], isThreaded ? "" : " processes");
+            if (count >= 0)
+            {
+                printSamples("filter", label, samples, count, 0);
+            }
+        }
+    }
+    unsetenv("SHELL24_FILTERS");
+    free(samples);
+
+    // Lines of 40 bytes like a log, where a memchr call per newline pays its setup every time
+    size_t size = (size_t)options->sizeMb << 20;
+    char *text = malloc(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        text[i] = i % 41 == 40 ? '\n' : (char)('a' + i % 26);
+    }
+    initFilters();
+    int rounds = 20;
+    double kernelSamples[rounds];
+    size_t results[4] = {0};
+    printf("%-9s %-22s %12s %12s %12s %12s %12s\n", "filter", "kernel", "p50", "p90", "p99", "max", "mean");
+    for (int kernel = 0; kernel < 4; kernel++)
+    {
+        const char *labels[] = {"wc -l dispatched", "wc -l memchr", "grep dispatched", "grep memmem"};
+        for (int round = 0; round < rounds; round++)
+        {
+            // The pattern is not in the text so the whole of it is searched
+            double start = nowSeconds();
+            const char *found = NULL;
+            switch (kernel)
+            {
+            case 0:
+                results[kernel] = countNewlines(text, text + size);
+                break;
+            case 1:
+                results[kernel] = countNewlinesScalar(text, text + size);
+                break;
+            case 2:
+                found = findString(text, text + size, "zyxwv", 5);
+                results[kernel] = found != NULL ? (size_t)(found - text) : size;
+                break;
+            case 3:
+                found = findStringScalar(text, text + size, "zyxwv", 5);
+                results[kernel] = found != NULL ? (size_t)(found - text) : size;
+                break;
+            }
+            kernelSamples[round] = nowSeconds() - start;
+        }
+        printSamples("filter", labels[kernel], kernelSamples, rounds, options->sizeMb);
+    }
+    if (results[0] != results[1] || results[2] != results[3])
+    {
+        printf("filter kernel results differ: %zu/%zu lines, %zu/%zu offset\n", results[0], results[1], results[2],
+               results[3]);
+    }
+    free(text);
+    return 0;
+}
+
+// Latency of the chain workload's line under every shell24 given, without and with SHELL24_TRACE
+int benchTrace(struct BenchOptions *options)
+{
+    char tracePath[4096];
+    snprintf(tracePath, sizeof(tracePath), "%s/shell24_bench_trace.json", options->dir);
+    const char *body = " && true && /bin/true ; /bin/false || /bin/true";
+    int iterations = options->iterations > 0 ? options->iterations : 500;
+    double *samples = malloc(iterations * sizeof(double));
+    printSampleHeader("trace");
+    for (int i = 0; i < options->shellCount; i++)
+    {
+        if (!isShell24(options->shellPaths[i]))
+        {
+            continue;
+        }
+        for (int isTraced = 0; isTraced <= 1; isTraced++)
+        {
+            if (isTraced)
+            {
+                setenv("SHELL24_TRACE", tracePath, 1);
+            }
+            int count = runStamped(options, options->shellPaths[i], body, iterations, samples);
+            unsetenv("SHELL24_TRACE");
+            char label[64];
+            snprintf(label, sizeof(label), "%.14s%s", options->shellPaths[i], isTraced ? " traced" : "");
+            if (count >= 0)
+            {
+                printSamples("trace", label, samples, count, 0);
+            }
+        }
+    }
+    struct stat traceStat;
+    if (stat(tracePath, &traceStat) == 0)
+    {
+        printf("trace     %s: %lld bytes\n", tracePath, (long long)traceStat.st_size);
+        unlink(tracePath);
+    }
+    free(samples);
+    return 0;
+}
+
+// Time of one command given all --entries files of a directory, more than exec takes at once,
+// with its batches run one after another and several at a time
+int benchArgs(struct BenchOptions *options)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/shell24_bench_glob.%ld", options->dir, options->entryCount);
+    printf("args      creating %ld files in %s\n", options->entryCount, path);
+    if (generateGlobDirectory(path, options->entryCount) == -1)
+    {
+        return 1;
+    }
+    char body[4200];
+    snprintf(body, sizeof(body), " ; ls -d %s/* > /dev/null", path);
+    int iterations = options->iterations > 0 ? options->iterations : 10;
+    double *samples = malloc(iterations * sizeof(double));
+    char jobs[16];
+    snprintf(jobs, sizeof(jobs), "%ld", sysconf(_SC_NPROCESSORS_ONLN));
+    const char *settings[] = {"1", jobs};
+    printSampleHeader("args");
+    for (int i = 0; i < options->shellCount; i++)
+    {
+        for (int j = 0; j < (isShell24(options->shellPaths[i]) ? 2 : 1); j++)
+        {
+            setenv("SHELL24_BATCH_JOBS", settings[j], 1);
+            int count = runStamped(options, options->shellPaths[i], body, iterations, samples);
+            char label[64];
+            // Other shells fail with E2BIG, which shows what the first batch costs
+            snprintf(label, sizeof(label), "%.12s%s%s", options->shellPaths[i],
+                     isShell24(options->shellPaths[i]) ? " jobs " : "", isShell24(options->shellPaths[i]) ? settings[j] : "");
+            if (count >= 0)
+            {
+                printSamples("args", label, samples, count, 0);
+            }
+        }
+    }
+    unsetenv("SHELL24_BATCH_JOBS");
+    free(samples);
+    return 0;
+}
+
+struct BenchWorkload workloads[] = {
+    {"spawn", benchSpawn},
+    {"chain", benchChain},
+    {"pipeline", benchPipeline},
+    {"concat", benchConcat},
+    {"parse", benchParse},
+    {"batch", benchBatch},
+    {"pipe", benchPipe},
+    {"glob", benchGlob},
+    {"history", benchHistory},
+    {"complete", benchComplete},
+    {"filter", benchFilter},
+    {"trace", benchTrace},
+    {"args", benchArgs},
+};
+
+int main(int argc, char *argv[])
+{
+    // Scripts run this binary with stamp at the start of every timed line
+    if (argc == 2 && strcmp(argv[1], "stamp") == 0)
+    {
+        double now = nowSeconds();
+        const char *stampPath = getenv("SHELL24_BENCH_STAMPS");
+        int fd = stampPath != NULL ? open(stampPath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644) : -1;
+        return fd == -1 || write(fd, &now, sizeof(now)) != sizeof(now);
+    }
+
+    struct BenchOptions options = {{"./shell24"}, 1, "/tmp", 256, 2, 100000, 0, 4, 500000};
+    int workloadCount = sizeof(workloads) / sizeof(workloads[0]);
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <workload|all> [--shell path[,path...]] [--dir path] [--size-mb N] [--files N] [--lines N]"
+                        " [--iterations N] [--stages N] [--entries N]\n", argv[0]);
+        fprintf(stderr, "Workloads:");
+        for (int i = 0; i < workloadCount; i++)
+        {
+            fprintf(stderr, " %s", workloads[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--shell") == 0)
+        {
+            // A comma separated list compares shells, e.g. --shell ./shell24,bash,dash
+            options.shellCount = 0;
+            for (char *saveptr, *path = strtok_r(argv[i + 1], ",", &saveptr); path != NULL && options.shellCount < BENCH_MAX_SHELLS;
+                 path = strtok_r(NULL, ",", &saveptr))
+            {
+                options.shellPaths[options.shellCount++] = path;
+            }
+        }
+        else if (strcmp(argv[i], "--dir") == 0)
+        {
+            options.dir = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--size-mb") == 0)
+        {
+            options.sizeMb = atol(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--files") == 0)
+        {
+            options.fileCount = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--lines") == 0)
+        {
+            options.lineCount = atol(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--iterations") == 0)
+        {
+            options.iterations = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--stages") == 0)
+        {
+            options.stageCount = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--entries") == 0)
+        {
+            options.entryCount = atol(argv[i + 1]);
+        }
+    }
+
+    char selfPath[4000];
+    ssize_t selfLength = readlink("/proc/self/exe", selfPath, sizeof(selfPath) - 1);
+    if (selfLength == -1)
+    {
+        perror("readlink");
+        return 1;
+    }
+    selfPath[selfLength] = '\0';
+    snprintf(options.stampCommand, sizeof(options.stampCommand), "%s stamp", selfPath);
+    snprintf(options.stampPath, sizeof(options.stampPath), "%s/shell24_bench_stamps.%d", options.dir, getpid());
+
+    int isAll = strcmp(argv[1], "all") == 0;
+    int status = -1;
+    for (int i = 0; i < workloadCount; i++)
+    {
+        if (isAll || strcmp(workloads[i].name, argv[1]) == 0)
+        {
+            status = (status > 0 ? status : 0) | workloads[i].run(&options);
+        }
+    }
+    unlink(options.stampPath);
+    if (status == -1)
+    {
+        fprintf(stderr, "Unknown workload %s\n", argv[1]);
+        return 1;
+    }
+    return status;
+}